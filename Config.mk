@@ -66,8 +66,16 @@
         DISK_BLOCKS=2048 # For fsmaker
         DISK_INODES=240  # For fsmaker
 
+# Size in blocks of the RAM disk (ram0) created at boot, 0 for none. Its pages
+# are only allocated as blocks are written.
+        RAMDISK_BLOCKS=2048
+# Copy disk0 onto ram0 at boot and mount the root file system from there, to
+# take the disk emulation out of file system benchmarks. Needs RAMDISK_BLOCKS
+# to be at least DISK_BLOCKS.
+        RAMDISK_ROOT=0
+
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES SMP KPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES SMP KPREEMPT RAMDISK_ROOT "
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE "
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE DISK_BLOCKS RAMDISK_BLOCKS "
@@ -571,6 +571,7 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
 
     /* variables to clean up on failure */
     vmmap_t *map = NULL;
+    pml4_t *pml4 = NULL;
     file_t *file = NULL;
     char *pht = NULL;
     char *interpname = NULL;
@@ -598,6 +599,14 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
         goto done;
     }
 
+    /* A vfork() child is still running on its parent's page table, and needs
+     * one of its own for the new mappings. */
+    if (curproc->p_vfork_parent && !(pml4 = pt_create()))
+    {
+        ret = -ENOMEM;
+        goto done;
+    }
+
     // Program header table entry size multiplied by
     // number of entries.
     size_t phtsize = header.e_phentsize * header.e_phnum;
@@ -836,16 +845,26 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     /* the final threshold / What warm unspoken secrets will we learn? / Beyond
      * the point of no return ... */
 
-    /* Give the process the new mappings. */
-    vmmap_destroy(&curproc->p_vmmap);
+    /* Give the process the new mappings. A vfork() child gives the old ones
+     * back to its parent instead, untouched. */
+    if (curproc->p_vfork_parent)
+    {
+        proc_vfork_release(pml4);
+        pml4 = NULL;
+    }
+    else
+    {
+        /* Flush the process pagetables, and the TLBs before the old pages can
+         * be freed. Going through vmmap_remove() also drops the mapped frames'
+         * counts of mappings. */
+        vmmap_remove(curproc->p_vmmap, ADDR_TO_PN(USER_MEM_LOW),
+                     ADDR_TO_PN(USER_MEM_HIGH) - ADDR_TO_PN(USER_MEM_LOW));
+        vmmap_destroy(&curproc->p_vmmap);
+    }
     map->vmm_proc = curproc;
     curproc->p_vmmap = map;
     map = NULL; /* So it doesn't get cleaned up at the end */
 
-    /* Flush the process pagetables and TLB */
-    pt_unmap_range(curproc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
-    tlb_flush_all();
-
     /* Set the process break and starting break (immediately after the mapped-in
      * text/data/bss from the executable) */
     curproc->p_brk = proghigh;
@@ -871,6 +890,10 @@ done:
     {
         vmmap_destroy(&map);
     }
+    if (pml4)
+    {
+        pt_destroy(pml4);
+    }
     if (pht)
     {
         kfree(pht);
@@ -578,6 +578,13 @@ static long sys_fork(regs_t *regs)
     return ret;
 }
 
+static long sys_vfork(regs_t *regs)
+{
+    long ret = do_vfork(regs);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static void free_vector(char **vect)
 {
     char **temp;
@@ -736,6 +743,9 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_fork:
         return sys_fork(regs);
 
+    case SYS_vfork:
+        return sys_vfork(regs);
+
     case SYS_getpid:
         return curproc->p_pid;
 
@@ -1,23 +1,44 @@
 #include "kernel.h"
 #include "util/debug.h"
+#include <drivers/disk/ramdisk.h>
 #include <drivers/disk/sata.h>
 
 #include "drivers/blockdev.h"
+#include "drivers/dev.h"
 
 #include "mm/pframe.h"
+#include "mm/writeback.h"
+
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+
+static long blockdev_get_pframe(mobj_t *mobj, uint64_t pagenum, long forwrite,
+                                pframe_t **pfp);
 
 static long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf);
 
+static long blockdev_fill_pframes(mobj_t *mobj, pframe_t **pfs, size_t npages);
+
 static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf);
 
-static mobj_ops_t blockdev_mobj_ops = {.get_pframe = NULL,
+static long blockdev_flush_pframes(mobj_t *mobj, pframe_t **pfs,
+                                   size_t npages);
+
+static mobj_ops_t blockdev_mobj_ops = {.get_pframe = blockdev_get_pframe,
                                        .fill_pframe = blockdev_fill_pframe,
+                                       .fill_pframes = blockdev_fill_pframes,
                                        .flush_pframe = blockdev_flush_pframe,
+                                       .flush_pframes = blockdev_flush_pframes,
                                        .destructor = NULL};
 
 static list_t blockdevs = LIST_INITIALIZER(blockdevs);
 
-void blockdev_init() { sata_init(); }
+void blockdev_init()
+{
+    sata_init();
+    ramdisk_init();
+}
 
 long blockdev_register(blockdev_t *dev)
 {
@@ -35,6 +56,8 @@ long blockdev_register(blockdev_t *dev)
     }
 
     mobj_init(&dev->bd_mobj, MOBJ_BLOCKDEV, &blockdev_mobj_ops);
+    memset(&dev->bd_ra, 0, sizeof(dev->bd_ra));
+    blockdev_queue_init(&dev->bd_queue);
 
     list_insert_tail(&blockdevs, &dev->bd_link);
     return 0;
@@ -52,13 +75,211 @@ blockdev_t *blockdev_lookup(devid_t id)
     return NULL;
 }
 
+size_t blockdev_info(const void *arg, char *buf, size_t osize)
+{
+    blockdev_t *bd = (blockdev_t *)arg;
+    size_t size = osize;
+    static const char *dirs[] = {"read", "write"};
+
+    blockdev_stats_t st;
+    blockdev_queue_stats(bd, &st);
+
+    iprintf(&buf, &size, "%s%u: %lu blocks\n",
+            MAJOR(bd->bd_id) == DISK_MAJOR ? "disk" : "ram", MINOR(bd->bd_id),
+            bd->bd_nblocks);
+    iprintf(&buf, &size, "  %-6s %9s %9s %7s %7s %9s\n", "", "requests",
+            "blocks", "errors", "merged", "commands");
+    for (long dir = 0; dir < 2; dir++)
+    {
+        iprintf(&buf, &size, "  %-6s %9lu %9lu %7lu %7lu %9lu\n", dirs[dir],
+                st.bs_requests[dir], st.bs_blocks[dir], st.bs_errors[dir],
+                st.bs_merges[dir], st.bs_commands[dir]);
+    }
+    iprintf(&buf, &size,
+            "  queue: %lu pending (peak %lu), %lu in flight (peak %lu)\n",
+            st.bs_pending, st.bs_max_pending, st.bs_inflight,
+            st.bs_max_inflight);
+
+    mobj_lock(&bd->bd_mobj);
+    blockdev_readahead_t ra = bd->bd_ra;
+    mobj_unlock(&bd->bd_mobj);
+    iprintf(&buf, &size,
+            "  readahead: window %lu, %lu reads of %lu blocks, %lu hits\n",
+            ra.ra_window, ra.ra_reads, ra.ra_blocks, ra.ra_hits);
+
+    for (long dir = 0; dir < 2; dir++)
+    {
+        if (!st.bs_requests[dir])
+        {
+            continue;
+        }
+        iprintf(&buf, &size, "  %s latency (us):\n", dirs[dir]);
+        for (size_t i = 0; i < BLOCKDEV_LATENCY_BUCKETS; i++)
+        {
+            size_t count = st.bs_latency[dir][i];
+            if (count)
+            {
+                iprintf(&buf, &size, "    %8lu - %8lu: %9lu\n",
+                        time_cycles_to_us(1UL << i),
+                        time_cycles_to_us(1UL << (i + 1)), count);
+            }
+        }
+    }
+    return size;
+}
+
+size_t blockdev_list_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    list_iterate(&blockdevs, bd, blockdev_t, bd_link)
+    {
+        size_t left = blockdev_info(bd, buf, size);
+        buf += size - left;
+        size = left;
+    }
+    return size;
+}
+
+/*
+ * mobj_default_get_pframe, with readahead (see blockdev_readahead_t). The
+ * readahead window stops short of the first block that is already resident
+ * and of the end of the device, if the driver knows where that is, and the
+ * blocks past the one asked for are left in the page cache unlocked. If
+ * reading the whole window fails, the window is closed and the block is read
+ * on its own.
+ */
+static long blockdev_get_pframe(mobj_t *mobj, uint64_t pagenum, long forwrite,
+                                pframe_t **pfp)
+{
+    blockdev_t *bd = CONTAINER_OF(mobj, blockdev_t, bd_mobj);
+    blockdev_readahead_t *ra = &bd->bd_ra;
+    KASSERT(kmutex_owns_mutex(&mobj->mo_mutex));
+
+    long sequential = pagenum == ra->ra_next;
+    if (pagenum + 1 == ra->ra_next ||
+        radix_tree_lookup(&mobj->mo_pframes, pagenum))
+    {
+        if (pagenum >= ra->ra_start && pagenum < ra->ra_end)
+        {
+            ra->ra_hits += sequential;
+        }
+        ra->ra_next = (blocknum_t)pagenum + 1;
+        return mobj_default_get_pframe(mobj, pagenum, forwrite, pfp);
+    }
+    ra->ra_next = (blocknum_t)pagenum + 1;
+
+    if (sequential)
+    {
+        ra->ra_window = ra->ra_window
+                            ? MIN(2 * ra->ra_window, BLOCKDEV_READAHEAD_MAX)
+                            : BLOCKDEV_READAHEAD_MIN;
+    }
+    else
+    {
+        ra->ra_window /= 2;
+    }
+    /* On SATA, a read past the end fails every command in flight with it */
+    size_t window = ra->ra_window;
+    if (bd->bd_nblocks)
+    {
+        window = pagenum < bd->bd_nblocks
+                     ? MIN(window, bd->bd_nblocks - pagenum)
+                     : 1;
+    }
+    size_t count = 1;
+    while (count < window &&
+           !radix_tree_lookup(&mobj->mo_pframes, pagenum + count))
+    {
+        count++;
+    }
+    if (count == 1)
+    {
+        return mobj_default_get_pframe(mobj, pagenum, forwrite, pfp);
+    }
+
+    pframe_t *pfs[BLOCKDEV_READAHEAD_MAX];
+    long n = mobj_default_get_pframes(mobj, pagenum, count, 0, pfs);
+    if (n < 0)
+    {
+        dbg(DBG_DISK, "readahead of blocks [%lu, %lu) failed: %ld\n", pagenum,
+            pagenum + count, n);
+        ra->ra_window = 0;
+        return mobj_default_get_pframe(mobj, pagenum, forwrite, pfp);
+    }
+    for (long i = 1; i < n; i++)
+    {
+        pframe_release(&pfs[i]);
+    }
+    ra->ra_reads++;
+    ra->ra_blocks += n - 1;
+    ra->ra_start = (blocknum_t)pagenum + 1;
+    ra->ra_end = (blocknum_t)(pagenum + n);
+
+    if (forwrite)
+    {
+        writeback_mark_dirty(pfs[0]);
+    }
+    *pfp = pfs[0];
+    return 0;
+}
+
 static long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf)
 {
     KASSERT(mobj && pf);
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
     blockdev_t *bd = CONTAINER_OF(mobj, blockdev_t, bd_mobj);
-    return bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum,
-                                  1);
+    return blockdev_queue_rw(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum, 1,
+                             0);
+}
+
+/*
+ * The frames have consecutive block numbers; read or write them with one
+ * request per BLOCKDEV_MAX_MERGE frames, wherever their memory is. The
+ * requests are all submitted before waiting for any of them,
+ * BLOCKDEV_FILL_BATCH at a time.
+ */
+#define BLOCKDEV_FILL_BATCH 16
+
+static long blockdev_rw_pframes(blockdev_t *bd, pframe_t **pfs, size_t npages,
+                                long write)
+{
+    KASSERT(pfs && npages);
+    KASSERT(pfs[npages - 1]->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
+    blockdev_request_t reqs[BLOCKDEV_FILL_BATCH];
+    long ret = 0;
+    size_t i = 0;
+    while (i < npages && !ret)
+    {
+        size_t nreqs = 0;
+        blockdev_plug(bd);
+        while (i < npages && nreqs < BLOCKDEV_FILL_BATCH)
+        {
+            size_t count = MIN(npages - i, BLOCKDEV_MAX_MERGE);
+            KASSERT(pfs[i + count - 1]->pf_pagenum ==
+                    pfs[i]->pf_pagenum + count - 1);
+            blockdev_request_init_pframes(&reqs[nreqs], &pfs[i],
+                                          (blocknum_t)pfs[i]->pf_pagenum,
+                                          count, write);
+            blockdev_submit(bd, &reqs[nreqs++]);
+            i += count;
+        }
+        blockdev_unplug(bd);
+
+        for (size_t r = 0; r < nreqs; r++)
+        {
+            long err = blockdev_wait(bd, &reqs[r]);
+            ret = ret ? ret : err;
+        }
+    }
+    return ret;
+}
+
+static long blockdev_fill_pframes(mobj_t *mobj, pframe_t **pfs, size_t npages)
+{
+    KASSERT(mobj);
+    return blockdev_rw_pframes(CONTAINER_OF(mobj, blockdev_t, bd_mobj), pfs,
+                               npages, 0);
 }
 
 static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
@@ -67,6 +288,16 @@ static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
     dbg(DBG_S5FS, "writing disk block %lu\n", pf->pf_pagenum);
     blockdev_t *bd = CONTAINER_OF(mobj, blockdev_t, bd_mobj);
-    return bd->bd_ops->write_block(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum,
-                                   1);
+    return blockdev_queue_rw(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum, 1,
+                             1);
+}
+
+static long blockdev_flush_pframes(mobj_t *mobj, pframe_t **pfs,
+                                   size_t npages)
+{
+    KASSERT(mobj);
+    dbg(DBG_S5FS, "writing disk blocks %lu-%lu\n", pfs[0]->pf_pagenum,
+        pfs[npages - 1]->pf_pagenum);
+    return blockdev_rw_pframes(CONTAINER_OF(mobj, blockdev_t, bd_mobj), pfs,
+                               npages, 1);
 }
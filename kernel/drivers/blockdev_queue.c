@@ -0,0 +1,390 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/blockdev_queue.h"
+
+#include "main/interrupt.h"
+
+#include "mm/pframe.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+/*
+ * Lock ordering: the queue lock is taken with interrupts blocked, since
+ * drivers complete requests from their interrupt handlers. It is held while
+ * calling the driver's submit operation, so drivers must not call back into
+ * the queue from it; they complete requests and kick the queue only after
+ * dropping their own locks.
+ */
+
+void blockdev_queue_init(blockdev_queue_t *q)
+{
+    spinlock_init(&q->bq_lock);
+    list_init(&q->bq_pending);
+    q->bq_inflight = 0;
+    q->bq_next = 0;
+    q->bq_plugged = 0;
+    memset(&q->bq_stats, 0, sizeof(q->bq_stats));
+}
+
+void blockdev_request_init(blockdev_request_t *req, char *buf,
+                           blocknum_t block, size_t count, long write)
+{
+    KASSERT(buf && count);
+    req->br_block = block;
+    req->br_count = count;
+    req->br_buf = buf;
+    req->br_pframes = NULL;
+    req->br_write = write;
+    req->br_done_fn = NULL;
+    req->br_private = NULL;
+    req->br_done = 0;
+    req->br_result = 0;
+    sched_queue_init(&req->br_waitq);
+    list_link_init(&req->br_link);
+    list_init(&req->br_merged);
+    req->br_gcount = count;
+}
+
+void blockdev_request_init_pframes(blockdev_request_t *req, pframe_t **pfs,
+                                   blocknum_t block, size_t count, long write)
+{
+    KASSERT(pfs && count <= BLOCKDEV_MAX_MERGE);
+    blockdev_request_init(req, pfs[0]->pf_addr, block, count, write);
+    req->br_pframes = pfs;
+}
+
+char *blockdev_request_buf(blockdev_request_t *req, size_t i)
+{
+    KASSERT(i < req->br_count);
+    return req->br_pframes ? (char *)req->br_pframes[i]->pf_addr
+                           : req->br_buf + i * BLOCK_SIZE;
+}
+
+static inline uint8_t _blockdev_queue_lock(blockdev_queue_t *q)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->bq_lock);
+    return ipl;
+}
+
+static inline void _blockdev_queue_unlock(blockdev_queue_t *q, uint8_t ipl)
+{
+    spinlock_unlock(&q->bq_lock);
+    intr_setipl(ipl);
+}
+
+/* The queue lock must be held for the following helpers. */
+
+/*
+ * Tries to merge req into the group headed by head, at either end. When req
+ * goes in front, it becomes the head of the group and takes head's place on
+ * the pending list.
+ */
+static long _blockdev_queue_merge(blockdev_request_t *head,
+                                  blockdev_request_t *req)
+{
+    if (head->br_write != req->br_write ||
+        head->br_gcount + req->br_count > BLOCKDEV_MAX_MERGE)
+    {
+        return 0;
+    }
+
+    if (req->br_block == head->br_block + head->br_gcount)
+    {
+        list_insert_tail(&head->br_merged, &req->br_link);
+        head->br_gcount += req->br_count;
+        return 1;
+    }
+
+    if (req->br_block + req->br_count == head->br_block)
+    {
+        list_insert_before(&head->br_link, &req->br_link);
+        list_remove(&head->br_link);
+        list_insert_tail(&req->br_merged, &head->br_link);
+        list_iterate(&head->br_merged, member, blockdev_request_t, br_link)
+        {
+            list_remove(&member->br_link);
+            list_insert_tail(&req->br_merged, &member->br_link);
+        }
+        req->br_gcount = req->br_count + head->br_gcount;
+        return 1;
+    }
+    return 0;
+}
+
+/* Puts req on the pending list in block order, merging it if allowed. */
+static void _blockdev_queue_add(blockdev_queue_t *q, blockdev_request_t *req,
+                                long merge)
+{
+    blockdev_stats_t *stats = &q->bq_stats;
+    list_iterate(&q->bq_pending, head, blockdev_request_t, br_link)
+    {
+        if (merge && _blockdev_queue_merge(head, req))
+        {
+            stats->bs_merges[!!req->br_write]++;
+            return;
+        }
+        if (head->br_block > req->br_block)
+        {
+            list_insert_before(&head->br_link, &req->br_link);
+            goto added;
+        }
+    }
+    list_insert_tail(&q->bq_pending, &req->br_link);
+
+added:
+    stats->bs_pending++;
+    stats->bs_max_pending = MAX(stats->bs_max_pending, stats->bs_pending);
+}
+
+/*
+ * Takes the next group to dispatch in C-SCAN order off the pending list.
+ */
+static blockdev_request_t *_blockdev_queue_next(blockdev_queue_t *q)
+{
+    if (list_empty(&q->bq_pending))
+    {
+        return NULL;
+    }
+    blockdev_request_t *next =
+        list_head(&q->bq_pending, blockdev_request_t, br_link);
+    list_iterate(&q->bq_pending, head, blockdev_request_t, br_link)
+    {
+        if (head->br_block >= q->bq_next)
+        {
+            next = head;
+            break;
+        }
+    }
+    list_remove(&next->br_link);
+    q->bq_stats.bs_pending--;
+    q->bq_next = next->br_block + (blocknum_t)next->br_gcount;
+    return next;
+}
+
+static void _blockdev_request_finish(blockdev_queue_t *q,
+                                     blockdev_request_t *req, long result)
+{
+    blockdev_stats_t *stats = &q->bq_stats;
+    long dir = !!req->br_write;
+    stats->bs_requests[dir]++;
+    if (result)
+    {
+        stats->bs_errors[dir]++;
+    }
+    else
+    {
+        stats->bs_blocks[dir] += req->br_count;
+    }
+    uint64_t cycles = time_cycles() - req->br_submitted;
+    size_t bucket = cycles ? 63 - (size_t)__builtin_clzl(cycles) : 0;
+    stats->bs_latency[dir][MIN(bucket, BLOCKDEV_LATENCY_BUCKETS - 1)]++;
+
+    req->br_result = result;
+    req->br_done = 1;
+    if (req->br_done_fn)
+    {
+        req->br_done_fn(req);
+    }
+    else
+    {
+        sched_broadcast_on(&req->br_waitq);
+    }
+}
+
+/* Called with the group already taken out of bq_inflight. */
+static void _blockdev_queue_finish(blockdev_queue_t *q,
+                                   blockdev_request_t *head, long result)
+{
+    list_iterate(&head->br_merged, member, blockdev_request_t, br_link)
+    {
+        list_remove(&member->br_link);
+        _blockdev_request_finish(q, member, result);
+    }
+    _blockdev_request_finish(q, head, result);
+}
+
+/*
+ * Transfers a group with a blocking driver, one call per stretch of blocks
+ * whose memory is contiguous.
+ */
+static long _blockdev_queue_transfer(blockdev_t *bd, blockdev_request_t *head)
+{
+    long ret = 0;
+    blocknum_t block = head->br_block;
+    blockdev_request_t *req = head;
+    list_link_t *link = head->br_merged.l_next;
+    size_t i = 0;
+    while (!ret && req)
+    {
+        char *buf = blockdev_request_buf(req, i);
+        size_t count = 1;
+        while (i + count < req->br_count &&
+               blockdev_request_buf(req, i + count) == buf + count * BLOCK_SIZE)
+        {
+            count++;
+        }
+        ret = req->br_write
+                  ? bd->bd_ops->write_block(bd, buf, block, count)
+                  : bd->bd_ops->read_block(bd, buf, block, count);
+        block += count;
+        if ((i += count) == req->br_count)
+        {
+            req = link == &head->br_merged
+                      ? NULL
+                      : list_item(link, blockdev_request_t, br_link);
+            link = link->l_next;
+            i = 0;
+        }
+    }
+    return ret;
+}
+
+static inline void _blockdev_queue_count_command(blockdev_queue_t *q,
+                                                 blockdev_request_t *head)
+{
+    q->bq_stats.bs_commands[!!head->br_write]++;
+    q->bq_stats.bs_max_inflight =
+        MAX(q->bq_stats.bs_max_inflight, q->bq_inflight);
+}
+
+/*
+ * Hands queued groups to the driver while it has room. For a blocking driver,
+ * the transfers are done right here, with the lock dropped and the ipl
+ * lowered to the given level.
+ */
+static void _blockdev_queue_dispatch(blockdev_t *bd, uint8_t ipl)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    blockdev_request_t *next;
+    while (!q->bq_plugged && q->bq_inflight < BLOCKDEV_QUEUE_DEPTH &&
+           (next = _blockdev_queue_next(q)))
+    {
+        q->bq_inflight++;
+        dbg(DBG_DISK, "dispatching %s of blocks [%u, %lu)\n",
+            next->br_write ? "write" : "read", next->br_block,
+            next->br_block + next->br_gcount);
+
+        long ret;
+        if (bd->bd_ops->submit)
+        {
+            if (!(ret = bd->bd_ops->submit(bd, next)))
+            {
+                _blockdev_queue_count_command(q, next);
+                continue;
+            }
+            q->bq_inflight--;
+            if (ret == -EBUSY)
+            {
+                /* Out of driver resources: put it back at the front of the
+                 * sweep until the driver kicks the queue. */
+                _blockdev_queue_add(q, next, 0);
+                q->bq_next = next->br_block;
+                break;
+            }
+            _blockdev_queue_finish(q, next, ret);
+            continue;
+        }
+
+        _blockdev_queue_count_command(q, next);
+        _blockdev_queue_unlock(q, ipl);
+        ret = _blockdev_queue_transfer(bd, next);
+        _blockdev_queue_lock(q);
+        q->bq_inflight--;
+        _blockdev_queue_finish(q, next, ret);
+    }
+}
+
+void blockdev_submit(blockdev_t *bd, blockdev_request_t *req)
+{
+    KASSERT(!req->br_done && !list_link_is_linked(&req->br_link));
+    blockdev_queue_t *q = &bd->bd_queue;
+    req->br_submitted = time_cycles();
+    uint8_t ipl = _blockdev_queue_lock(q);
+    _blockdev_queue_add(q, req, 1);
+    _blockdev_queue_dispatch(bd, ipl);
+    _blockdev_queue_unlock(q, ipl);
+}
+
+long blockdev_wait(blockdev_t *bd, blockdev_request_t *req)
+{
+    KASSERT(!req->br_done_fn);
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    while (!req->br_done)
+    {
+        /* A blocking driver only makes progress while someone dispatches. */
+        if (!bd->bd_ops->submit)
+        {
+            _blockdev_queue_dispatch(bd, ipl);
+            if (req->br_done)
+            {
+                break;
+            }
+        }
+        sched_sleep_on(&req->br_waitq, &q->bq_lock);
+        _blockdev_queue_lock(q);
+    }
+    _blockdev_queue_unlock(q, ipl);
+    return req->br_result;
+}
+
+void blockdev_request_complete(blockdev_t *bd, blockdev_request_t *req,
+                               long result)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    KASSERT(q->bq_inflight);
+    q->bq_inflight--;
+    _blockdev_queue_finish(q, req, result);
+    _blockdev_queue_dispatch(bd, ipl);
+    _blockdev_queue_unlock(q, ipl);
+}
+
+void blockdev_queue_kick(blockdev_t *bd)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    _blockdev_queue_dispatch(bd, ipl);
+    _blockdev_queue_unlock(q, ipl);
+}
+
+void blockdev_plug(blockdev_t *bd)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    q->bq_plugged++;
+    _blockdev_queue_unlock(q, ipl);
+}
+
+void blockdev_unplug(blockdev_t *bd)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    KASSERT(q->bq_plugged);
+    q->bq_plugged--;
+    _blockdev_queue_dispatch(bd, ipl);
+    _blockdev_queue_unlock(q, ipl);
+}
+
+void blockdev_queue_stats(blockdev_t *bd, blockdev_stats_t *stats)
+{
+    blockdev_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = _blockdev_queue_lock(q);
+    *stats = q->bq_stats;
+    stats->bs_inflight = q->bq_inflight;
+    _blockdev_queue_unlock(q, ipl);
+}
+
+long blockdev_queue_rw(blockdev_t *bd, char *buf, blocknum_t block,
+                       size_t count, long write)
+{
+    blockdev_request_t req;
+    blockdev_request_init(&req, buf, block, count, write);
+    blockdev_submit(bd, &req);
+    return blockdev_wait(bd, &req);
+}
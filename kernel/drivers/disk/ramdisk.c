@@ -0,0 +1,170 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/dev.h"
+#include "drivers/disk/ramdisk.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#define bdev_to_ramdisk(bd) (CONTAINER_OF((bd), ramdisk_t, rd_bdev))
+
+/* Blocks read from the source device at once by ramdisk_load() */
+#define RAMDISK_LOAD_CHUNK 16
+
+static long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
+                               size_t block_count);
+static long ramdisk_write_block(blockdev_t *bdev, const char *buf,
+                                blocknum_t block, size_t block_count);
+
+/* The transfers are done by the thread submitting or waiting on a request,
+ * so there is no submit operation. */
+static blockdev_ops_t ramdisk_ops = {
+    .read_block = ramdisk_read_block,
+    .write_block = ramdisk_write_block,
+};
+
+void ramdisk_init()
+{
+#if defined(__RAMDISK_BLOCKS__) && __RAMDISK_BLOCKS__ > 0
+    blockdev_t *bd = ramdisk_create(0, __RAMDISK_BLOCKS__);
+    KASSERT(bd && "failed to create ram0");
+#endif
+}
+
+blockdev_t *ramdisk_create(unsigned minor, size_t nblocks)
+{
+    KASSERT(nblocks);
+    ramdisk_t *rd = kmalloc(sizeof(ramdisk_t));
+    if (!rd)
+    {
+        return NULL;
+    }
+    rd->rd_blocks = kmalloc(nblocks * sizeof(char *));
+    if (!rd->rd_blocks)
+    {
+        kfree(rd);
+        return NULL;
+    }
+    memset(rd->rd_blocks, 0, nblocks * sizeof(char *));
+    rd->rd_nblocks = nblocks;
+    kmutex_init(&rd->rd_mutex);
+
+    rd->rd_bdev.bd_id = MKDEVID(RAMDISK_MAJOR, minor);
+    rd->rd_bdev.bd_ops = &ramdisk_ops;
+    rd->rd_bdev.bd_nblocks = nblocks;
+    list_link_init(&rd->rd_bdev.bd_link);
+    if (blockdev_register(&rd->rd_bdev))
+    {
+        kfree(rd->rd_blocks);
+        kfree(rd);
+        return NULL;
+    }
+    dbg(DBG_DISK, "created ram%u with %lu blocks\n", minor, nblocks);
+    return &rd->rd_bdev;
+}
+
+static long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
+                               size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (block + block_count > rd->rd_nblocks)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++, buf += BLOCK_SIZE)
+    {
+        char *page = rd->rd_blocks[block + i];
+        if (page)
+        {
+            memcpy(buf, page, BLOCK_SIZE);
+        }
+        else
+        {
+            memset(buf, 0, BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+static long ramdisk_write_block(blockdev_t *bdev, const char *buf,
+                                blocknum_t block, size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (block + block_count > rd->rd_nblocks)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++, buf += BLOCK_SIZE)
+    {
+        char **page = &rd->rd_blocks[block + i];
+        if (!*page)
+        {
+            /* page_alloc() may block on reclaim, so another writer can get
+             * here first. */
+            kmutex_lock(&rd->rd_mutex);
+            if (!*page && !(*page = page_alloc()))
+            {
+                kmutex_unlock(&rd->rd_mutex);
+                return -ENOSPC;
+            }
+            kmutex_unlock(&rd->rd_mutex);
+        }
+        memcpy(*page, buf, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+static long ramdisk_block_is_zero(const char *buf)
+{
+    const uint64_t *words = (const uint64_t *)buf;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++)
+    {
+        if (words[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+long ramdisk_load(blockdev_t *ramdisk, blockdev_t *src, size_t nblocks)
+{
+    KASSERT(ramdisk->bd_ops == &ramdisk_ops);
+    if (nblocks > bdev_to_ramdisk(ramdisk)->rd_nblocks)
+    {
+        return -ENOSPC;
+    }
+    char *buf = page_alloc_n(RAMDISK_LOAD_CHUNK);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    long ret = 0;
+    size_t nloaded = 0;
+    for (blocknum_t block = 0; block < nblocks && !ret;
+         block += RAMDISK_LOAD_CHUNK)
+    {
+        size_t count = MIN(nblocks - block, RAMDISK_LOAD_CHUNK);
+        ret = blockdev_queue_rw(src, buf, block, count, 0);
+        for (size_t i = 0; i < count && !ret; i++)
+        {
+            char *data = buf + i * BLOCK_SIZE;
+            if (!ramdisk_block_is_zero(data))
+            {
+                ret = ramdisk_write_block(ramdisk, data, block + i, 1);
+                nloaded++;
+            }
+        }
+    }
+    page_free_n(buf, RAMDISK_LOAD_CHUNK);
+
+    dbg(DBG_DISK, "loaded %lu of %lu blocks onto ram%u: %ld\n", nloaded,
+        nblocks, MINOR(ramdisk->bd_id), ret);
+    return ret;
+}
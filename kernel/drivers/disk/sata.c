@@ -23,6 +23,22 @@ static hba_t *hba; /* host bus adapter */
  * If standard, this is an outstanding command slot bitmap. */
 static uint32_t outstanding_requests[AHCI_MAX_NUM_PORTS] = {0};
 
+/* Bitmap of the command slots the HBA implements on every port (see
+ * cap.ncs). Commands are issued on any free slot, so up to that many can be in
+ * flight on a port at once. */
+static uint32_t implemented_slots;
+
+/* Bitmap of the free command slots of each port. A slot is taken when a
+ * command is set up on it, and only given back once the command's result has
+ * been collected, so a synchronous command's slot stays busy until its issuing
+ * thread has run and picked up the result from request_results. */
+static uint32_t free_slots[AHCI_MAX_NUM_PORTS];
+static size_t busy_slot_counts[AHCI_MAX_NUM_PORTS];
+static long request_results[AHCI_MAX_NUM_PORTS][AHCI_COMMAND_HEADERS_PER_LIST];
+
+/* Per-port counters reported by sata_stats(). */
+static sata_stats_t port_stats[AHCI_MAX_NUM_PORTS];
+
 /* Each command slot on each port has a waitqueue for a thread waiting on a
  * command to finish execution. */
 static ktqueue_t outstanding_request_queues[AHCI_MAX_NUM_PORTS]
@@ -35,28 +51,73 @@ static ktqueue_t command_slot_queues[AHCI_MAX_NUM_PORTS];
 /* SMP: Protect access to ports. */
 static spinlock_t port_locks[AHCI_MAX_NUM_PORTS];
 
+/* Asynchronous requests from the block request queue, by the command slot
+ * they were issued on. Slots without one belong to a thread sleeping in
+ * ahci_do_operation(). */
+static blockdev_request_t *slot_requests[AHCI_MAX_NUM_PORTS]
+                                        [AHCI_COMMAND_HEADERS_PER_LIST];
+
+/* The disk behind each port, and whether its request queue is waiting for a
+ * command slot to open up (see sata_submit()). */
+static ata_disk_t *port_disks[AHCI_MAX_NUM_PORTS];
+static long port_queue_stalled[AHCI_MAX_NUM_PORTS];
+
 long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
                      size_t block_count);
 long sata_write_block(blockdev_t *bdev, const char *buf, blocknum_t block,
                       size_t block_count);
+static long sata_submit(blockdev_t *bdev, blockdev_request_t *req);
+static size_t ahci_reap_port(size_t port_index, blockdev_request_t **done,
+                             long *results, size_t *ndone);
+static void ahci_complete_requests(size_t port_index, blockdev_request_t **done,
+                                   long *results, size_t ndone);
 
 /* sata_disk_ops - Block device operations for SATA devices. */
 static blockdev_ops_t sata_disk_ops = {
     .read_block = sata_read_block,
     .write_block = sata_write_block,
+    .submit = sata_submit,
 };
 
-/* find_cmdslot - Checks various bitmaps to find the lowest index command slot
- * that is free for a given port. */
-inline long find_cmdslot(hba_port_t *port)
+/* alloc_cmdslot - Takes the lowest index free command slot of a port, or
+ * returns -1 if they are all busy. The port must be locked. */
+static long alloc_cmdslot(hba_port_t *port)
 {
+    size_t port_index = PORT_INDEX(hba, port);
+    if (!free_slots[port_index])
+    {
+        return -1;
+    }
+    long slot = __builtin_ctz(free_slots[port_index]);
+    free_slots[port_index] &= ~(1U << slot);
+
     /* From 1.3.1: Free command slot will have corresponding bit clear in both
-     * px_sact and px_ci. To be safe, also check against our local copy of
-     * outstanding requests, in case a recently completed command is clear in
-     * the port's actual descriptor, but has not been processed by Weenix yet.
-     */
-    return __builtin_ctz(~(port->px_sact | port->px_ci |
-                           outstanding_requests[PORT_INDEX(hba, port)]));
+     * px_sact and px_ci. */
+    KASSERT(!((port->px_sact | port->px_ci) & (1U << slot)));
+
+    sata_stats_t *stats = &port_stats[port_index];
+    busy_slot_counts[port_index]++;
+    stats->ss_max_inflight =
+        MAX(stats->ss_max_inflight, busy_slot_counts[port_index]);
+    stats->ss_commands++;
+    return slot;
+}
+
+/* free_cmdslot - Gives a command slot back to the port, waking a thread that
+ * is waiting for one. The port must be locked.
+ *
+ * Returns nonzero if the port's request queue is waiting for a slot too, in
+ * which case the caller must kick it once the port is unlocked. */
+static long free_cmdslot(size_t port_index, long slot)
+{
+    KASSERT(!(free_slots[port_index] & (1U << slot)));
+    free_slots[port_index] |= 1U << slot;
+    busy_slot_counts[port_index]--;
+    sched_wakeup_on(command_slot_queues + port_index, NULL);
+
+    long kick = port_queue_stalled[port_index];
+    port_queue_stalled[port_index] = 0;
+    return kick;
 }
 
 /* ensure_mapped - Wrapper for pt_map_range(). */
@@ -68,70 +129,105 @@ void ensure_mapped(void *addr, size_t size)
                  PT_WRITE | PT_PRESENT, PT_WRITE | PT_PRESENT);
 }
 
-kmutex_t because_qemu_doesnt_emulate_ahci_ncq_correctly;
-
-/* ahci_do_operation - Sends a command to the HBA to initiate a disk operation.
- */
-long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
-                       int write)
+/* ahci_use_ncq - Whether commands are issued as NCQ commands. Without NCQ,
+ * commands on different slots are still queued in the HBA, which executes them
+ * in order. */
+static inline long ahci_use_ncq()
 {
-    kmutex_lock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-    KASSERT(count && buf);
-    KASSERT(lba >= 0 && lba < 1L << 23);
+#if ENABLE_NATIVE_COMMAND_QUEUING
+    return hba->ghc.cap.sncq;
+#else
+    return 0;
+#endif
+}
 
-    /* Obtain the port and the physical system memory in question. */
-    size_t port_index = PORT_INDEX(hba, port);
+/* ahci_command_header - Returns the command header of a command slot. */
+static inline command_header_t *ahci_command_header(hba_port_t *port,
+                                                    long command_slot)
+{
+    command_list_t *command_list =
+        (command_list_t *)(port->px_clb + PHYS_OFFSET);
+    return command_list->command_headers + command_slot;
+}
 
-    uint8_t ipl = intr_setipl(IPL_HIGH);
-    spinlock_lock(port_locks + port_index);
+/* ahci_prepare_command - Clears the command header of a free command slot,
+ * leaving its physical region descriptor table empty for ahci_add_buffer().
+ * The port must be locked. */
+static void ahci_prepare_command(hba_port_t *port, long command_slot)
+{
+    command_header_t *command_header = ahci_command_header(port, command_slot);
+    uint64_t ctba = command_header->ctba;
+    memset(command_header, 0, sizeof(command_header_t));
+    command_header->ctba = ctba;
+}
 
-    uint64_t physbuf = pt_virt_to_phys((uintptr_t)buf);
+/* ahci_add_buffer - Appends len bytes of memory at buf to the physical region
+ * descriptor table of the command being set up on a slot. Every page of buf is
+ * translated on its own, so buf need not be physically contiguous; a page that
+ * follows on from the previous descriptor in physical memory just extends it.
+ *
+ * Returns 0, or -EINVAL if the command runs out of descriptors.
+ */
+static long ahci_add_buffer(hba_port_t *port, long command_slot, void *buf,
+                            size_t len)
+{
+    KASSERT(buf && len && !(len % ATA_SECTOR_SIZE));
+    command_header_t *command_header = ahci_command_header(port, command_slot);
+    command_table_t *command_table =
+        (command_table_t *)(command_header->ctba + PHYS_OFFSET);
 
-    /* Get an available command slot. */
-    long command_slot;
-    while ((command_slot = find_cmdslot(port)) == -1)
+    uintptr_t addr = (uintptr_t)buf;
+    while (len)
     {
-        sched_sleep_on(command_slot_queues + port_index,
-                       port_locks + port_index);
-        /* Spinlock is important: find_cmdslot() does not actually reserve the
-         * command slot. */
-        spinlock_lock(port_locks + port_index);
+        size_t seglen = MIN(len, PAGE_SIZE - PAGE_OFFSET(addr));
+        uint64_t physaddr = pt_virt_to_phys(addr);
+
+        prd_t *prd = command_table->prdt + command_header->prdtl;
+        prd_t *last = prd - 1;
+        if (command_header->prdtl && last->dba + last->dbc + 1 == physaddr &&
+            last->dbc + 1 + seglen <= AHCI_MAX_PRDT_SIZE)
+        {
+            last->dbc += seglen;
+        }
+        else if (command_header->prdtl < ACHI_NUM_PRDTS_PER_COMMAND_TABLE)
+        {
+            memset(prd, 0, sizeof(prd_t));
+            prd->dba = physaddr;
+            prd->dbc = (uint32_t)(seglen - 1); /* Counts from 0. */
+            command_header->prdtl++;
+        }
+        else
+        {
+            return -EINVAL;
+        }
+        addr += seglen;
+        len -= seglen;
     }
+    return 0;
+}
 
-    /* Get corresponding command_header in the port's command_list. */
-    command_list_t *command_list =
-        (command_list_t *)(port->px_clb + PHYS_OFFSET);
-    command_header_t *command_header =
-        command_list->command_headers + command_slot;
-    memset(command_header, 0, sizeof(command_header_t));
+/* ahci_issue_command - Finishes setting up the command on a slot, whose memory
+ * has been added with ahci_add_buffer(), and tells the HBA to execute it. The
+ * port must be locked. */
+static void ahci_issue_command(hba_port_t *port, long command_slot,
+                               ssize_t lba, uint16_t count, int write)
+{
+    KASSERT(count);
+    KASSERT(lba >= 0 && lba < 1L << 23);
+
+    size_t port_index = PORT_INDEX(hba, port);
 
     /* Command setup: Header. */
+    command_header_t *command_header = ahci_command_header(port, command_slot);
     command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
     command_header->write = (uint8_t)write;
-    command_header->prdtl = (uint16_t)(
-        ALIGN_UP_POW_2(count, AHCI_SECTORS_PER_PRDT) / AHCI_SECTORS_PER_PRDT);
     KASSERT(command_header->prdtl);
 
-    /* Command setup: Table. */
+    /* Command setup: Table. The physical region descriptors are already in
+     * place. */
     command_table_t *command_table =
         (command_table_t *)(command_header->ctba + PHYS_OFFSET);
-    memset(command_table, 0, sizeof(command_table_t));
-
-    /* Command setup: Physical region descriptor table. */
-    prd_t *prdt = command_table->prdt;
-    /* Note that this loop is only called when the size of the data transfer is
-     * REALLY big. */
-    for (unsigned i = 0; i < command_header->prdtl - 1U; i++)
-    {
-        prdt->dbc = AHCI_MAX_PRDT_SIZE - 1;
-        prdt->dba = physbuf; /* Data from physical buffer. */
-        prdt->i = 1;         /* Set interrupt on completion. */
-        physbuf +=
-            AHCI_MAX_PRDT_SIZE; /* Advance physical buffer for next prd. */
-        prdt++;
-    }
-    prdt->dbc = (uint32_t)(count % AHCI_SECTORS_PER_PRDT) * ATA_SECTOR_SIZE - 1;
-    prdt->dba = (uint64_t)physbuf;
+    memset(&command_table->cfis, 0, sizeof(command_fis_t));
 
     /* Set up the particular h2d_register_fis command (the only one we use). */
     h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
@@ -143,8 +239,7 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
 
     /* NCQ: Allows the hardware to queue commands in its *own* order,
      * independent of software delivery. */
-#if ENABLE_NATIVE_COMMAND_QUEUING
-    if (hba->ghc.cap.sncq)
+    if (ahci_use_ncq())
     {
         /* For NCQ, sector count is stored in features. */
         command_fis->features = (uint8_t)count;
@@ -159,46 +254,120 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
     }
     else
     {
+        /* For regular commands, simply set the command type and the sector
+         * count. */
         command_fis->sector_count = count;
-
         command_fis->command = (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND
                                                : ATA_READ_DMA_EXT_COMMAND);
     }
-#else
-    /* For regular commands, simply set the command type and the sector count.
-     */
-    command_fis->sector_count = count;
-    command_fis->command =
-        (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND : ATA_READ_DMA_EXT_COMMAND);
-#endif
 
     dbg(DBG_DISK, "initiating request on slot %ld to %s sectors [%lu, %lu)\n",
         command_slot, write ? "write" : "read", lba, lba + count);
 
     /* Locally mark that we sent out a command on the given command slot of the
      * given port. */
-    outstanding_requests[port_index] |= (1 << command_slot);
+    outstanding_requests[port_index] |= (1U << command_slot);
+    request_results[port_index][command_slot] = 0;
 
-    /* Explicitly notify the port that a command is available for execution. */
-    port->px_sact |= (1 << command_slot);
-    port->px_ci |= (1 << command_slot);
+    /* Explicitly notify the port that a command is available for execution.
+     * Both registers are write-1-to-set, so only this slot's bit is written.
+     * SACT must only be set for NCQ commands, and before CI. */
+    if (ahci_use_ncq())
+    {
+        port->px_sact = 1U << command_slot;
+    }
+    port->px_ci = 1U << command_slot;
+}
 
-    /* Sleep until the command has been serviced. */
-    spinlock_lock(&curthr->kt_lock);
-    KASSERT(!curthr->kt_retval);
+/* ahci_do_operation - Sends a command to the HBA to initiate a disk operation,
+ * and sleeps until it has completed. Any number of threads may call this at
+ * once; each command takes a free command slot on the port, sleeping until one
+ * opens up if none is free, and the commands are completed independently. */
+long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
+                       int write)
+{
+    size_t port_index = PORT_INDEX(hba, port);
 
-    dbg(DBG_DISK,
-        "initiating request on slot %ld to %s sectors [%lu, %lu)...sleeping\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    sched_sleep_on(outstanding_request_queues[port_index] + command_slot,
-                   port_locks + port_index);
-    intr_setipl(ipl);
-    dbg(DBG_DISK, "completed request on slot %ld to %s sectors [%lu, %lu)\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    kmutex_unlock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(port_locks + port_index);
+
+    /* Get an available command slot. */
+    long command_slot;
+    while ((command_slot = alloc_cmdslot(port)) == -1)
+    {
+        port_stats[port_index].ss_slot_waits++;
+        sched_sleep_on(command_slot_queues + port_index,
+                       port_locks + port_index);
+        intr_setipl(IPL_HIGH);
+        spinlock_lock(port_locks + port_index);
+    }
+    ahci_prepare_command(port, command_slot);
+    long ret = ahci_add_buffer(port, command_slot, buf,
+                               (size_t)count * ATA_SECTOR_SIZE);
+    if (ret)
+    {
+        long kick = free_cmdslot(port_index, command_slot);
+        spinlock_unlock(port_locks + port_index);
+        if (kick)
+        {
+            blockdev_queue_kick(&port_disks[port_index]->bdev);
+        }
+        intr_setipl(ipl);
+        return ret;
+    }
+    ahci_issue_command(port, command_slot, lba, count, write);
+
+    /* In polling mode, spin for a while in the hope that the command finishes
+     * soon, and complete it ourselves rather than waiting for the interrupt
+     * and the context switches on either side of it. */
+    blockdev_request_t *done[AHCI_COMMAND_HEADERS_PER_LIST];
+    long results[AHCI_COMMAND_HEADERS_PER_LIST];
+    size_t ndone = 0;
+    if (port_disks[port_index]->completion & SATA_COMPLETION_POLL)
+    {
+        for (unsigned spin = 0; spin < SATA_POLL_SPINS; spin++)
+        {
+            uint32_t active = ahci_use_ncq() ? port->px_sact : port->px_ci;
+            if (!(active & (1U << command_slot)) || port->px_is.bits.tfes)
+            {
+                ahci_reap_port(port_index, done, results, &ndone);
+                break;
+            }
+        }
+    }
 
-    long ret = (long)curthr->kt_retval;
-    spinlock_unlock(&curthr->kt_lock);
+    if (outstanding_requests[port_index] & (1U << command_slot))
+    {
+        /* Sleep until the command has been serviced. The interrupt handler
+         * stores the result and wakes us up. */
+        dbg(DBG_DISK,
+            "initiating request on slot %ld to %s sectors [%lu, "
+            "%lu)...sleeping\n",
+            command_slot, write ? "write" : "read", lba, lba + count);
+        sched_sleep_on(outstanding_request_queues[port_index] + command_slot,
+                       port_locks + port_index);
+        intr_setipl(IPL_HIGH);
+        spinlock_lock(port_locks + port_index);
+    }
+    else
+    {
+        port_stats[port_index].ss_polled++;
+    }
+
+    /* Collect the result and release the slot to the next waiting thread. */
+    KASSERT(!(outstanding_requests[port_index] & (1U << command_slot)));
+    ret = request_results[port_index][command_slot];
+    long kick = free_cmdslot(port_index, command_slot);
+    spinlock_unlock(port_locks + port_index);
+    ahci_complete_requests(port_index, done, results, ndone);
+    if (kick)
+    {
+        blockdev_queue_kick(&port_disks[port_index]->bdev);
+    }
+    intr_setipl(ipl);
+    dbg(DBG_DISK,
+        "completed request on slot %ld to %s sectors [%lu, %lu): %ld\n",
+        command_slot, write ? "write" : "read", lba, lba + count, ret);
 
     return ret;
 }
@@ -223,6 +392,72 @@ static inline void stop_cmd(hba_port_t *port)
         ; /* Wait for FIS receive DMA to stop running. */
 }
 
+/* Words of the IDENTIFY DEVICE data holding the number of addressable
+ * sectors: 28-bit addressing, and 48-bit if the disk supports it (ATA Command
+ * Set 4, 7.12.7). */
+#define ATA_IDENTIFY_SECTORS_28 60
+#define ATA_IDENTIFY_SECTORS_48 100
+
+/* Times ahci_identify() polls the port before giving up on the disk. */
+#define SATA_IDENTIFY_SPINS (1UL << 24)
+
+/* ahci_identify - Asks the disk on a freshly started port how many sectors it
+ * has. The port isn't in use yet, so the command goes on slot 0 and is polled
+ * for, with the port's interrupts held off.
+ *
+ * Returns the number of sectors, or 0 if the disk didn't say. */
+static uint64_t ahci_identify(hba_port_t *port)
+{
+    uint16_t *data = page_alloc();
+    if (!data)
+    {
+        return 0;
+    }
+    px_interrupt_enable_t ie = port->px_ie;
+    port->px_ie.value = 0;
+
+    ahci_prepare_command(port, 0);
+    ahci_add_buffer(port, 0, data, ATA_SECTOR_SIZE);
+    command_header_t *command_header = ahci_command_header(port, 0);
+    command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
+    command_table_t *command_table =
+        (command_table_t *)(command_header->ctba + PHYS_OFFSET);
+    memset(&command_table->cfis, 0, sizeof(command_fis_t));
+    h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
+    command_fis->fis_type = fis_type_h2d_register;
+    command_fis->c = 1;
+    command_fis->command = ATA_IDENTIFY_DEVICE_COMMAND;
+    port->px_ci = 1U;
+
+    uint64_t nsectors = 0;
+    for (size_t spin = 0; spin < SATA_IDENTIFY_SPINS; spin++)
+    {
+        if (port->px_is.bits.tfes)
+        {
+            dbg(DBG_DISK, "\tIDENTIFY DEVICE failed, serr 0x%x\n",
+                port->px_serr);
+            stop_cmd(port);
+            port->px_serr = port->px_serr;
+            start_cmd(port);
+            break;
+        }
+        if (!(port->px_ci & 1U))
+        {
+            nsectors = *(uint64_t *)(data + ATA_IDENTIFY_SECTORS_48);
+            if (!nsectors)
+            {
+                nsectors = *(uint32_t *)(data + ATA_IDENTIFY_SECTORS_28);
+            }
+            break;
+        }
+    }
+
+    port->px_is = px_interrupt_status_clear;
+    port->px_ie = ie;
+    page_free(data);
+    return nsectors;
+}
+
 /* ahci_initialize_port */
 static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
                                  uintptr_t ahci_base)
@@ -271,6 +506,7 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
 
     /* Start the queue to wait for an open command slot. */
     sched_queue_init(command_slot_queues + port_number);
+    free_slots[port_number] = implemented_slots;
 
     spinlock_init(port_locks + port_number);
 
@@ -282,9 +518,12 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
         disk->port = port;
         disk->bdev.bd_id = MKDEVID(DISK_MAJOR, port_number);
         disk->bdev.bd_ops = &sata_disk_ops;
+        disk->bdev.bd_nblocks = 0; /* Filled in once the port is started */
+        disk->completion = SATA_COMPLETION_INTERRUPT;
         list_link_init(&disk->bdev.bd_link);
         long ret = blockdev_register(&disk->bdev);
         KASSERT(!ret);
+        port_disks[port_number] = disk;
     }
     else
     {
@@ -296,6 +535,17 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
     /* Start the port's DMA engines and allow it to start servicing commands. */
     start_cmd(port);
 
+    /* Reads past the end of the disk fail with a task file error, which fails
+     * every other command in flight on the port too, so the block layer is
+     * told where the end is. */
+    if (port_disks[port_number])
+    {
+        uint64_t nsectors = ahci_identify(port);
+        port_disks[port_number]->bdev.bd_nblocks =
+            (size_t)(nsectors / SATA_SECTORS_PER_BLOCK);
+        dbg(DBG_DISK, "\tdisk has %lu sectors\n", nsectors);
+    }
+
     /* RWC: Write back to clear errors one more time. FLAG: WHY?! */
     // port->px_serr = port->px_serr;
 }
@@ -304,8 +554,6 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
  */
 void ahci_initialize_hba()
 {
-    kmutex_init(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-
     /* Get the HBA controller for the SATA device. */
     pcie_device_t *dev =
         pcie_lookup(SATA_PCI_CLASS, SATA_PCI_SUBCLASS, SATA_AHCI_INTERFACE);
@@ -379,8 +627,11 @@ void ahci_initialize_hba()
     /* Temporarily clear Interrupt Enable bit before setting up ports. */
     hba->ghc.ghc.ie = 0;
 
-    dbg(DBG_DISK, "ahci ncq supported: %s\n",
-        hba->ghc.cap.sncq ? "true" : "false");
+    unsigned nslots = hba->ghc.cap.ncs + 1U;
+    implemented_slots =
+        nslots >= 32 ? (uint32_t)-1 : (uint32_t)((1U << nslots) - 1);
+    dbg(DBG_DISK, "ahci ncq supported: %s, %u command slots per port\n",
+        hba->ghc.cap.sncq ? "true" : "false", nslots);
 
     /* Initialize each of the available ports. */
     uint32_t ports_implemented = hba->ghc.pi;
@@ -399,6 +650,98 @@ void ahci_initialize_hba()
     hba->ghc.ghc.ie = 1;
 }
 
+/* ahci_reap_port - Completes every command on a port that the HBA has
+ * finished, whether or not its interrupt has been serviced yet, and clears the
+ * port's interrupt status. Threads waiting on synchronous commands are woken
+ * up. The block requests behind asynchronous commands are appended to done,
+ * with their results in results, for the caller to complete once it has
+ * unlocked the port. The port must be locked.
+ *
+ * Returns the number of commands completed.
+ */
+static size_t ahci_reap_port(size_t port_index, blockdev_request_t **done,
+                             long *results, size_t *ndone)
+{
+    hba_port_t *port = hba->ports + port_index;
+
+    /* Beware: If a register is marked "RWC" in the spec, you must clear it
+     * by writing 1. This is rather understated in the specification. */
+
+    /* Clear the cause of the interrupt.
+     * See 5.6.2 and 5.6.4 in the 1.3.1 spec for confirmation of the FIS and
+     * corresponding interrupt that are used depending on the type of
+     * command.
+     */
+
+    px_interrupt_status_t status = {.value = port->px_is.value};
+    port->px_is.value = status.value;
+
+    /* Get the list of commands still outstanding. Several commands may
+     * finish between two interrupts, so every slot that is no longer
+     * active is completed, whichever FIS raised the interrupt. */
+    uint32_t active = ahci_use_ncq() ? port->px_sact : port->px_ci;
+    long result = 0;
+    if (status.bits.tfes)
+    {
+        /* The port stops processing commands after an error, and we have
+         * no way of telling which command failed; fail all of them, and
+         * restart the port, which clears PxCI and PxSACT (10.4.2). */
+        dbg(DBG_DISK, "task file error on port %lu, serr 0x%x\n",
+            port_index, port->px_serr);
+        stop_cmd(port);
+        port->px_serr = port->px_serr;
+        port->px_is = px_interrupt_status_clear;
+        start_cmd(port);
+        active = 0;
+        result = -EIO;
+    }
+
+    /* Compare the active commands against those we actually sent out to get
+     * completed commands. */
+    uint32_t completed = outstanding_requests[port_index] & ~active;
+    size_t ncompleted = 0;
+    /* Handle each completed command: */
+    while (completed)
+    {
+        uint32_t slot = __builtin_ctz(completed);
+        completed &= ~(1U << slot);
+        ncompleted++;
+
+        /* An asynchronous request gives its slot straight back; completing
+         * it also dispatches more of the queue if it was waiting for a
+         * slot. */
+        outstanding_requests[port_index] &= ~(1U << slot);
+        blockdev_request_t *req = slot_requests[port_index][slot];
+        if (req)
+        {
+            slot_requests[port_index][slot] = NULL;
+            done[*ndone] = req;
+            results[(*ndone)++] = result;
+            free_cmdslot(port_index, slot);
+            continue;
+        }
+
+        /* Hand the slot over to the thread waiting on that command, which
+         * releases it once it has picked up the result. */
+        request_results[port_index][slot] = result;
+        sched_wakeup_on(&outstanding_request_queues[port_index][slot], NULL);
+    }
+    return ncompleted;
+}
+
+/* ahci_complete_requests - Completes the asynchronous requests picked up by
+ * ahci_reap_port(), with the port unlocked. */
+static void ahci_complete_requests(size_t port_index, blockdev_request_t **done,
+                                   long *results, size_t ndone)
+{
+    /* Completing a request dispatches more of the queue to us. */
+    for (size_t i = 0; i < ndone; i++)
+    {
+        blockdev_request_complete(&port_disks[port_index]->bdev, done[i],
+                                  results[i]);
+    }
+}
+
 /* ahci_interrupt_handler - Service an interrupt that was raised by the HBA.
  */
 static long ahci_interrupt_handler(regs_t *regs)
@@ -408,77 +751,131 @@ static long ahci_interrupt_handler(regs_t *regs)
     {
         /* Get a port from the global interrupt status bitmap. */
         unsigned port_index = __builtin_ctz(hba->ghc.is);
-
-        /* Get the port descriptor from the HBA's ports array. */
-        hba_port_t *port = hba->ports + port_index;
         spinlock_lock(port_locks + port_index);
 
-        /* Beware: If a register is marked "RWC" in the spec, you must clear it
-         * by writing 1. This is rather understated in the specification. */
-
-        /* Clear the cause of the interrupt.
-         * See 5.6.2 and 5.6.4 in the 1.3.1 spec for confirmation of the FIS and
-         * corresponding interrupt that are used depending on the type of
-         * command.
-         */
-
-#if ENABLE_NATIVE_COMMAND_QUEUING
-        if (hba->ghc.cap.sncq)
-        {
-            KASSERT(port->px_is.bits.sdbs);
-            port->px_is.bits.sdbs = 1;
-        }
-        else
-        {
-            KASSERT(port->px_is.bits.dhrs);
-            port->px_is.bits.dhrs = 1;
-        }
-#else
-        KASSERT(port->px_is.bits.dhrs);
-        port->px_is.bits.dhrs = 1;
-#endif
-
         /* Clear the port's bit on the global interrupt status bitmap, to
          * indicate we have handled it. */
         /* Note: Changed from ~ to regular, because this register is RWC. */
-        hba->ghc.is &= (1 << port_index);
+        hba->ghc.is = 1U << port_index;
+
+        /* No new command can be issued on the port while we hold its lock, so
+         * no more than one request per slot can complete here. */
+        blockdev_request_t *done[AHCI_COMMAND_HEADERS_PER_LIST];
+        long results[AHCI_COMMAND_HEADERS_PER_LIST];
+        size_t ndone = 0;
+        size_t ncompleted = ahci_reap_port(port_index, done, results, &ndone);
+
+        /* In batching mode, stay a little longer to pick up the commands that
+         * finish in the meantime, rather than taking an interrupt for each. */
+        ata_disk_t *disk = port_disks[port_index];
+        if (disk && (disk->completion & SATA_COMPLETION_BATCH))
+        {
+            for (unsigned spin = 0;
+                 spin < SATA_BATCH_SPINS && outstanding_requests[port_index];
+                 spin++)
+            {
+                ncompleted +=
+                    ahci_reap_port(port_index, done, results, &ndone);
+            }
+        }
+        port_stats[port_index].ss_interrupts++;
+        port_stats[port_index].ss_irq_completions += ncompleted;
 
-        /* Get the list of commands still outstanding. */
-#if ENABLE_NATIVE_COMMAND_QUEUING
-        /* If NCQ, use SACT register. */
-        uint32_t active = hba->ghc.cap.sncq ? port->px_sact : port->px_ci;
-#else
-        /* If not NCQ, use CI register. */
-        uint32_t active = port->px_ci;
-#endif
+        spinlock_unlock(port_locks + port_index);
+        ahci_complete_requests(port_index, done, results, ndone);
+    }
+    return 0;
+}
 
-        /* Compare the active commands against those we actually sent out to get
-         * completed commands. */
-        uint32_t completed = outstanding_requests[port_index] &
-                             ~(outstanding_requests[port_index] & active);
-        /* Handle each completed command: */
-        while (completed)
+/* sata_add_request - Adds the memory of every block of a request to the PRDT
+ * of the command being set up on a slot. */
+static long sata_add_request(hba_port_t *port, long command_slot,
+                             blockdev_request_t *req)
+{
+    for (size_t i = 0; i < req->br_count; i++)
+    {
+        long ret = ahci_add_buffer(port, command_slot,
+                                   blockdev_request_buf(req, i), BLOCK_SIZE);
+        if (ret)
         {
-            uint32_t slot = __builtin_ctz(completed);
+            return ret;
+        }
+    }
+    return 0;
+}
 
-            /* Wake up the thread that was waiting on that command. */
-            kthread_t *thr;
-            sched_wakeup_on(&outstanding_request_queues[port_index][slot],
-                            &thr);
+/* sata_submit - Starts the transfer for a request from the disk's request
+ * queue, on a free command slot of its port. The request is completed by the
+ * interrupt handler. Called with the queue locked, at IPL_HIGH.
+ *
+ * The request heads a group of requests for consecutive blocks, whose memory
+ * may be scattered anywhere; the command gets a PRD for each physically
+ * contiguous piece of it.
+ *
+ * Returns -EBUSY if every command slot is taken; the queue is then kicked when
+ * a slot is released.
+ */
+static long sata_submit(blockdev_t *bdev, blockdev_request_t *req)
+{
+    ata_disk_t *disk = bdev_to_ata_disk(bdev);
+    size_t port_index = PORT_INDEX(hba, disk->port);
 
-            /* Mark the command as available. */
-            completed &= ~(1 << slot);
-            outstanding_requests[port_index] &= ~(1 << slot);
+    spinlock_lock(port_locks + port_index);
+    long command_slot = alloc_cmdslot(disk->port);
+    if (command_slot == -1)
+    {
+        port_stats[port_index].ss_slot_busy++;
+        port_queue_stalled[port_index] = 1;
+        spinlock_unlock(port_locks + port_index);
+        return -EBUSY;
+    }
 
-            /* TODO: Wake up threads that were waiting for a command slot to
-             * free up on the port. */
+    ahci_prepare_command(disk->port, command_slot);
+    long ret = sata_add_request(disk->port, command_slot, req);
+    list_iterate(&req->br_merged, member, blockdev_request_t, br_link)
+    {
+        if (ret)
+        {
+            break;
         }
-
+        ret = sata_add_request(disk->port, command_slot, member);
+    }
+    if (ret)
+    {
+        /* Nobody can be waiting for the slot: the queue is locked, and a
+         * thread in ahci_do_operation() would have taken it. */
+        free_cmdslot(port_index, command_slot);
         spinlock_unlock(port_locks + port_index);
+        return ret;
     }
+
+    slot_requests[port_index][command_slot] = req;
+    ahci_issue_command(disk->port, command_slot,
+                       (ssize_t)req->br_block * SATA_SECTORS_PER_BLOCK,
+                       (uint16_t)(req->br_gcount * SATA_SECTORS_PER_BLOCK),
+                       (int)req->br_write);
+    spinlock_unlock(port_locks + port_index);
     return 0;
 }
 
+void sata_stats(blockdev_t *bdev, sata_stats_t *stats)
+{
+    size_t port_index = PORT_INDEX(hba, bdev_to_ata_disk(bdev)->port);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(port_locks + port_index);
+    *stats = port_stats[port_index];
+    spinlock_unlock(port_locks + port_index);
+    intr_setipl(ipl);
+}
+
+long sata_set_completion(blockdev_t *bdev, long completion)
+{
+    ata_disk_t *disk = bdev_to_ata_disk(bdev);
+    long old = disk->completion;
+    disk->completion = completion;
+    return old;
+}
+
 void sata_init()
 {
     intr_register(INTR_DISK_PRIMARY, ahci_interrupt_handler);
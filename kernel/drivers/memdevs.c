@@ -6,7 +6,9 @@
 
 #include "mm/kmalloc.h"
 #include "mm/mobj.h"
+#include "mm/page.h"
 
+#include "drivers/blockdev.h"
 #include "drivers/chardev.h"
 
 #include "vm/anon.h"
@@ -22,6 +24,12 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count);
 
 static long zero_mmap(vnode_t *file, mobj_t **ret);
 
+static ssize_t iostat_read(chardev_t *dev, size_t pos, void *buf,
+                           size_t count);
+
+static ssize_t iostat_write(chardev_t *dev, size_t pos, const void *buf,
+                            size_t count);
+
 chardev_ops_t null_dev_ops = {.read = null_read,
                               .write = null_write,
                               .mmap = NULL,
@@ -34,6 +42,12 @@ chardev_ops_t zero_dev_ops = {.read = zero_read,
                               .fill_pframe = NULL,
                               .flush_pframe = NULL};
 
+chardev_ops_t iostat_dev_ops = {.read = iostat_read,
+                                .write = iostat_write,
+                                .mmap = NULL,
+                                .fill_pframe = NULL,
+                                .flush_pframe = NULL};
+
 /**
  * The char device code needs to know about these mem devices, so create
  * chardev_t's for null and zero, fill them in, and register them.
@@ -54,6 +68,12 @@ void memdevs_init()
     zero_dev->cd_ops=&zero_dev_ops;
     list_link_init(&zero_dev->cd_link);
     chardev_register(zero_dev);
+
+    chardev_t *iostat_dev = kmalloc(sizeof(chardev_t));
+    iostat_dev->cd_id = MEM_IOSTAT_DEVID;
+    iostat_dev->cd_ops = &iostat_dev_ops;
+    list_link_init(&iostat_dev->cd_link);
+    chardev_register(iostat_dev);
     // NOT_YET_IMPLEMENTED("DRIVERS: memdevs_init");
 }
 
@@ -133,3 +153,38 @@ static long zero_mmap(vnode_t *file, mobj_t **ret)
     // NOT_YET_IMPLEMENTED("VM: zero_mmap");
     return 0;
 }
+
+/**
+ * Reads the I/O statistics of every block device, as text, starting at the
+ * given offset. The text is regenerated on every read, so reading it in
+ * pieces may mix up two snapshots.
+ *
+ * @param  dev   the iostat device
+ * @param  pos   the offset into the text to start reading from
+ * @param  buf   the buffer to write to
+ * @param  count the maximum number of bytes to read
+ * @return       the number of bytes read, 0 at the end of the text, or
+ *               -ENOMEM
+ */
+static ssize_t iostat_read(chardev_t *dev, size_t pos, void *buf, size_t count)
+{
+    char *text = page_alloc();
+    if (!text)
+    {
+        return -ENOMEM;
+    }
+    size_t len = PAGE_SIZE - blockdev_list_info(NULL, text, PAGE_SIZE);
+    count = pos < len ? MIN(count, len - pos) : 0;
+    memcpy(buf, text + pos, count);
+    page_free(text);
+    return (ssize_t)count;
+}
+
+/**
+ * The iostat device is read-only.
+ */
+static ssize_t iostat_write(chardev_t *dev, size_t pos, const void *buf,
+                            size_t count)
+{
+    return -EINVAL;
+}
@@ -122,15 +122,24 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
 long s5fs_mount(fs_t *fs)
 {
     int num;
+    devid_t devid;
 
     KASSERT(fs);
 
-    if (sscanf(fs->fs_dev, "disk%d", &num) != 1)
+    if (sscanf(fs->fs_dev, "disk%d", &num) == 1)
+    {
+        devid = MKDEVID(DISK_MAJOR, num);
+    }
+    else if (sscanf(fs->fs_dev, "ram%d", &num) == 1)
+    {
+        devid = MKDEVID(RAMDISK_MAJOR, num);
+    }
+    else
     {
         return -EINVAL;
     }
 
-    blockdev_t *dev = blockdev_lookup(MKDEVID(DISK_MAJOR, num));
+    blockdev_t *dev = blockdev_lookup(devid);
     if (!dev)
         return -EINVAL;
 
@@ -313,13 +322,18 @@ static void s5fs_sync(fs_t *fs)
 
     mobj_lock(mobj);
 
+    /* The superblock's free list and counts describe the rest of the disk, so
+     * write everything else out first. mobj_flush() waits for those writes,
+     * so the superblock can't reach the disk ahead of them. */
+    mobj_flush(mobj);
+
     pframe_t *pf;
     mobj_get_pframe(mobj, S5_SUPER_BLOCK, 1, &pf);
     memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
+    mobj_flush_pframe(mobj, pf);
     pframe_release(&pf);
 
-    mobj_flush(S5FS_TO_VMOBJ(s5fs));
-    mobj_unlock(S5FS_TO_VMOBJ(s5fs));
+    mobj_unlock(mobj);
 }
 
 /* Wrapper around s5_read_file. */
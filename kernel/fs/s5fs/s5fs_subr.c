@@ -216,6 +216,53 @@ long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
     //return 0;
 }
 
+/* Maximum number of disk blocks s5_prefetch_file_blocks reads at once */
+#define S5_READ_BATCH 16
+
+/* Bring the disk blocks backing file blocks first through last into the block
+ * device's page cache, reading each run of consecutive disk blocks with one
+ * multi-block request instead of one request per block. Sparse blocks are
+ * skipped, and errors are ignored: the caller gets every block again through
+ * s5_get_file_block, which reads anything that didn't make it in.
+ */
+static void s5_prefetch_file_blocks(s5_node_t *sn, size_t first, size_t last)
+{
+    mobj_t *mobj = S5FS_TO_VMOBJ(VNODE_TO_S5FS(&sn->vnode));
+    long locs[S5_READ_BATCH];
+    pframe_t *pfs[S5_READ_BATCH];
+
+    for (size_t base = first; base <= last; base += S5_READ_BATCH)
+    {
+        size_t nblocks = MIN(S5_READ_BATCH, last - base + 1);
+        for (size_t i = 0; i < nblocks; i++)
+        {
+            locs[i] = s5_file_block_to_disk_block(sn, base + i, 0);
+        }
+
+        for (size_t i = 0; i < nblocks;)
+        {
+            size_t count = 1;
+            while (locs[i] > 0 && i + count < nblocks &&
+                   locs[i + count] == locs[i] + (long)count)
+            {
+                count++;
+            }
+            if (count > 1)
+            {
+                mobj_lock(mobj);
+                long n = mobj_get_pframes(mobj, (uint64_t)locs[i], count, 0,
+                                          pfs);
+                mobj_unlock(mobj);
+                for (long j = 0; j < n; j++)
+                {
+                    pframe_release(&pfs[j]);
+                }
+            }
+            i += count;
+        }
+    }
+}
+
 /* Read from a file.
  *
  *  sn  - The s5_node representing the file to read from
@@ -249,6 +296,9 @@ ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
     if (end > sn->vnode.vn_len) {
         end = sn->vnode.vn_len;
     }
+    if (S5_DATA_BLOCK(end - 1) > S5_DATA_BLOCK(pos)) {
+        s5_prefetch_file_blocks(sn, S5_DATA_BLOCK(pos), S5_DATA_BLOCK(end - 1));
+    }
 
     while(start+total_read_bytes<end){
         size_t block_offset=S5_DATA_OFFSET(pos);    // Obtain the offset within a block         
@@ -449,10 +499,13 @@ static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
     KASSERT(blockno);
     KASSERT(s->s5s_nfree < S5_NBLKS_PER_FNODE);
 
+    /* Only dirty the block if it is about to hold the free list; taking it
+     * for write and cleaning it by hand would leave it on the dirty list. */
+    long forwrite = s->s5s_nfree == S5_NBLKS_PER_FNODE - 1;
     pframe_t *pf;
-    s5_get_disk_block(s5fs, blockno, 1, &pf);
+    s5_get_disk_block(s5fs, blockno, forwrite, &pf);
 
-    if (s->s5s_nfree == S5_NBLKS_PER_FNODE - 1)
+    if (forwrite)
     {
         memcpy(pf->pf_addr, s->s5s_free_blocks, sizeof(s->s5s_free_blocks));
 
@@ -462,7 +515,6 @@ static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
     else
     {
         s->s5s_free_blocks[s->s5s_nfree++] = blockno;
-        pf->pf_dirty = 0;
     }
     s5_release_disk_block(&pf);
     s5_unlock_super(s5fs);
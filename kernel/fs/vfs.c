@@ -10,6 +10,7 @@
 
 #include "mm/kmalloc.h"
 #include "mm/slab.h"
+#include "mm/writeback.h"
 #include "util/debug.h"
 
 #ifdef __S5FS__
@@ -102,10 +103,12 @@ void vfs_init()
 }
 
 /*
- * Wrapper around the sync call() to vfs_root_fs using fs_ops
+ * Write back every dirty page, then call sync() on vfs_root_fs using fs_ops so
+ * that it can write out its own metadata
  */
 void do_sync()
 {
+    writeback_sync();
     vfs_root_fs.fs_ops->sync(&vfs_root_fs);
 #ifdef __MOUNTING__
     // if implementing mounting, just sync() all the mounted FS's as well
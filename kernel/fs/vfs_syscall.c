@@ -7,6 +7,7 @@
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/writeback.h"
 #include "util/debug.h"
 #include "util/string.h"
 #include <limits.h>
@@ -73,6 +74,7 @@ ssize_t do_write(int fd, const void *buf, size_t len)
     curproc->p_files[fd]->f_pos+=tmp; // Update position
     vunlock(curproc->p_files[fd]->f_vnode);
     fput(&tmp_file);
+    writeback_throttle(); // Don't let a writer get too far ahead of the disk
     // NOT_YET_IMPLEMENTED("VFS: do_write");
     return tmp;
 }
@@ -244,6 +244,8 @@ static void vnode_destructor(mobj_t *o)
     {
         vn->vn_fs->fs_ops->delete_vnode(vn->vn_fs, vn);
     }
+    /* the frames are on the page cache LRU, so they must not outlive us */
+    mobj_free_pframes(o);
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
     vunlock(vn);
 
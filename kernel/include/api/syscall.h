@@ -2,12 +2,15 @@
 
 /* Kernel and user header (via symlink) */
 
+/* Only the syscall numbers are visible to assembly (see vfork.S) */
+#ifndef __ASSEMBLY__
 #ifdef __KERNEL__
 #include "types.h"
 #else
 
 #include "sys/types.h"
 
+#endif
 #endif
 
 /* Trap number for syscalls */
@@ -60,6 +63,7 @@
 #define SYS_stat 47
 #define SYS_time 48
 #define SYS_usleep 49
+#define SYS_vfork 50
 
 /*
  * ... what does the scouter say about his syscall?
@@ -69,6 +73,8 @@
 #define SYS_debug 9001
 #define SYS_kshell 9002
 
+#ifndef __ASSEMBLY__
+
 struct regs;
 struct stat;
 
@@ -194,3 +200,5 @@ typedef struct usleep_args
 } usleep_args_t;
 
 struct utsname;
+
+#endif /* __ASSEMBLY__ */
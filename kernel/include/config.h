@@ -40,7 +40,14 @@
 #define NFILES 32       /* maximum number of open files */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
+#ifdef __RAMDISK_ROOT__
+#if __RAMDISK_BLOCKS__ < __DISK_BLOCKS__
+#error "RAMDISK_ROOT needs a ramdisk at least as large as the disk"
+#endif
+#define VFS_ROOTFS_DEV "ram0" /* copied from disk0 at boot */
+#else
 #define VFS_ROOTFS_DEV "disk0" /* device containing root filesystem */
+#endif
 
 /* root filesystem type - either "ramfs" or "s5fs" */
 #ifdef __S5FS__
@@ -7,6 +7,7 @@
 
 #include "types.h"
 
+#include "drivers/blockdev_queue.h"
 #include "drivers/dev.h"
 #include "util/list.h"
 
@@ -17,6 +18,29 @@
 
 struct blockdev_ops;
 
+/* Bounds on the number of blocks read at once when bd_mobj is being read
+ * sequentially; the most is kept within one driver command. */
+#define BLOCKDEV_READAHEAD_MIN 4
+#define BLOCKDEV_READAHEAD_MAX 32
+
+/*
+ * Readahead state of a block device's page cache. A miss on the block right
+ * after the last one looked up reads the missing block and the ones following
+ * it together, in a window that doubles with each such miss; a miss anywhere
+ * else halves the window, so that random access soon stops reading ahead.
+ */
+typedef struct blockdev_readahead
+{
+    blocknum_t ra_next;   /* the block after the last one looked up */
+    size_t ra_window;     /* blocks to read on the next sequential miss */
+    blocknum_t ra_start;  /* blocks [ra_start, ra_end) were last read ahead */
+    blocknum_t ra_end;
+
+    size_t ra_reads;  /* misses that read ahead */
+    size_t ra_blocks; /* blocks read ahead by them */
+    size_t ra_hits;   /* lookups that found a block read ahead */
+} blockdev_readahead_t;
+
 /*
  * Represents a Weenix block device.
  */
@@ -27,9 +51,18 @@ typedef struct blockdev
 
     struct blockdev_ops *bd_ops;
 
+    /* Number of blocks on the device, or 0 if unknown */
+    size_t bd_nblocks;
+
     /* Fields that should be ignored by drivers: */
     mobj_t bd_mobj;
 
+    /* Protected by bd_mobj's mutex */
+    blockdev_readahead_t bd_ra;
+
+    /* Requests on their way to bd_ops (see drivers/blockdev_queue.h) */
+    blockdev_queue_t bd_queue;
+
     /* Link on the list of block-oriented devices */
     list_link_t bd_link;
 } blockdev_t;
@@ -61,6 +94,21 @@ typedef struct blockdev_ops
      */
     long (*write_block)(blockdev_t *bdev, const char *buf, blocknum_t loc,
                         size_t block_count);
+
+    /**
+     * Optional: starts reading or writing the br_gcount blocks at br_block
+     * described by a request, and returns without waiting for the transfer.
+     * Once it is done, the driver must call blockdev_request_complete() on
+     * the request, usually from its interrupt handler. Called with the
+     * request queue locked and interrupts blocked, so it must not block.
+     *
+     * @param bdev the block device
+     * @param req the request to start
+     * @return 0 if the transfer was started, -EBUSY if the driver has no room
+     *      for it right now (it must then call blockdev_queue_kick() once it
+     *      does), or another -errno to fail the request
+     */
+    long (*submit)(blockdev_t *bdev, struct blockdev_request *req);
 } blockdev_ops_t;
 
 /**
@@ -84,6 +132,15 @@ long blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * Writes the I/O counters and latency histograms of a block device (arg) into
+ * buf, or those of every block device for blockdev_list_info().
+ *
+ * @return the space left in buf, as with iprintf()
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+size_t blockdev_list_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
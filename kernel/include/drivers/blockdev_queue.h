@@ -0,0 +1,194 @@
+#pragma once
+
+#include "types.h"
+
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "util/list.h"
+
+struct blockdev;
+struct blockdev_request;
+struct pframe;
+
+/*
+ * The block I/O request queue that sits between a block device's page cache
+ * and its driver.
+ *
+ * I/O is described by a blockdev_request_t, which is submitted with
+ * blockdev_submit() and completes asynchronously: blockdev_wait() sleeps until
+ * it is done, and br_done_fn, if set, is called on completion. The memory for
+ * a request is either one buffer or a vector of page frames, one per block,
+ * which may be anywhere in memory. A request is queued in ascending block
+ * order, and merged into a queued request for the neighbouring blocks when
+ * both go the same way, so that the driver sees one multi-block command
+ * instead of several; it is up to the driver to gather the scattered memory of
+ * the group (see blockdev_request_buf()). Queued requests are dispatched in
+ * C-SCAN order: the lowest-numbered request at or after the end of the last
+ * one dispatched, wrapping around to the lowest-numbered request once the
+ * sweep runs out.
+ *
+ * Up to BLOCKDEV_QUEUE_DEPTH requests are handed to the driver at once. A
+ * driver with a submit operation starts each one and completes it later,
+ * usually from its interrupt handler, with blockdev_request_complete(), which
+ * also dispatches the next queued request; no thread waits on the device. For
+ * a driver with only the blocking read_block/write_block operations, whichever
+ * thread submits or waits does the transfer itself, with one call for each
+ * stretch of the group whose memory is contiguous.
+ *
+ * A thread about to submit a batch of requests can plug the queue first, so
+ * that nothing is dispatched until it unplugs it and the batch has had the
+ * chance to be merged and sorted.
+ *
+ * Each queue counts the requests that go through it, and keeps a histogram of
+ * how long they take from submission to completion (see blockdev_stats_t).
+ */
+
+/* Requests handed to the driver at once, per device */
+#define BLOCKDEV_QUEUE_DEPTH 32
+
+/* Largest number of blocks merged into a single driver command */
+#define BLOCKDEV_MAX_MERGE 64
+
+/* Latency histogram buckets: bucket i counts the requests that took at least
+ * 2^i and less than 2^(i+1) time stamp counter cycles (see time_cycles()). */
+#define BLOCKDEV_LATENCY_BUCKETS 40
+
+/* Called when a request completes, possibly from interrupt context and with
+ * the queue lock held: it must not block or submit more I/O. */
+typedef void (*blockdev_done_fn_t)(struct blockdev_request *req);
+
+typedef struct blockdev_request
+{
+    blocknum_t br_block;
+    size_t br_count;
+    char *br_buf;                  /* either this... */
+    struct pframe **br_pframes;    /* ...or one frame per block */
+    long br_write;
+
+    blockdev_done_fn_t br_done_fn; /* optional */
+    void *br_private;              /* for br_done_fn */
+
+    long br_done;        /* set once the result is in */
+    long br_result;      /* 0 or -errno */
+    ktqueue_t br_waitq;  /* threads in blockdev_wait() */
+    uint64_t br_submitted; /* time_cycles() when it was submitted */
+
+    /* While queued, the first request of each merged group is on the queue's
+     * pending list, with br_gcount covering the whole group, and the others
+     * are on its br_merged list in block order. */
+    list_link_t br_link;
+    list_t br_merged;
+    size_t br_gcount;
+} blockdev_request_t;
+
+/* Counters, indexed by direction where there are two: [0] for reads and [1]
+ * for writes. */
+typedef struct blockdev_stats
+{
+    size_t bs_requests[2]; /* requests completed */
+    size_t bs_blocks[2];   /* blocks transferred by them */
+    size_t bs_errors[2];   /* requests that failed */
+    size_t bs_merges[2];   /* requests merged into a queued one */
+    size_t bs_commands[2]; /* merged groups handed to the driver */
+    size_t bs_latency[2][BLOCKDEV_LATENCY_BUCKETS];
+    size_t bs_pending;      /* groups waiting to be dispatched */
+    size_t bs_max_pending;
+    size_t bs_inflight;     /* groups with the driver */
+    size_t bs_max_inflight;
+} blockdev_stats_t;
+
+typedef struct blockdev_queue
+{
+    spinlock_t bq_lock;
+    list_t bq_pending;     /* first requests of each group, by block */
+    size_t bq_inflight;    /* groups handed to the driver */
+    blocknum_t bq_next;    /* where the C-SCAN sweep continues from */
+    size_t bq_plugged;     /* dispatch is held off while nonzero */
+    blockdev_stats_t bq_stats;
+} blockdev_queue_t;
+
+/**
+ * Initializes an empty request queue.
+ */
+void blockdev_queue_init(blockdev_queue_t *q);
+
+/**
+ * Initializes a request to read or write count blocks starting at block. The
+ * caller may set br_done_fn and br_private before submitting it.
+ *
+ * @param buf the memory to transfer to or from (must be page-aligned)
+ * @param write nonzero to write, zero to read
+ */
+void blockdev_request_init(blockdev_request_t *req, char *buf,
+                           blocknum_t block, size_t count, long write);
+
+/**
+ * Like blockdev_request_init(), but the memory for the i-th block is the page
+ * of pfs[i]. At most BLOCKDEV_MAX_MERGE blocks can be transferred this way,
+ * and pfs must stay allocated until the request has completed.
+ */
+void blockdev_request_init_pframes(blockdev_request_t *req,
+                                   struct pframe **pfs, blocknum_t block,
+                                   size_t count, long write);
+
+/**
+ * Returns the memory for the i-th block of req (not of its group).
+ */
+char *blockdev_request_buf(blockdev_request_t *req, size_t i);
+
+/**
+ * Queues req on bd, dispatching queued requests to the driver if it has room.
+ * req must stay allocated until it has completed. Must be called from thread
+ * context; with a driver that has no submit operation, this may block while
+ * doing the transfer.
+ */
+void blockdev_submit(struct blockdev *bd, blockdev_request_t *req);
+
+/**
+ * Sleeps until req has completed. Requests with a br_done_fn belong to that
+ * function once they complete, and can't be waited for.
+ *
+ * @return the result of the request: 0 on success, -errno on failure
+ */
+long blockdev_wait(struct blockdev *bd, blockdev_request_t *req);
+
+/**
+ * Called by drivers when a request they were handed through their submit
+ * operation has finished. Completes every request merged into it and
+ * dispatches more. May be called from interrupt context.
+ */
+void blockdev_request_complete(struct blockdev *bd, blockdev_request_t *req,
+                               long result);
+
+/**
+ * Dispatches queued requests, if the driver has room for them. Drivers call
+ * this when room opens up other than by completing a request, after their
+ * submit operation has returned -EBUSY.
+ */
+void blockdev_queue_kick(struct blockdev *bd);
+
+/**
+ * Holds off dispatching bd's queued requests until the matching call to
+ * blockdev_unplug(). Plugs nest.
+ */
+void blockdev_plug(struct blockdev *bd);
+
+/**
+ * Undoes blockdev_plug(), dispatching the queued requests once the last plug
+ * is gone.
+ */
+void blockdev_unplug(struct blockdev *bd);
+
+/**
+ * Copies out the counters of bd's request queue.
+ */
+void blockdev_queue_stats(struct blockdev *bd, blockdev_stats_t *stats);
+
+/**
+ * Reads or writes count blocks starting at block through bd's request queue,
+ * sleeping until the transfer is complete.
+ *
+ * @return 0 on success, -errno on failure
+ */
+long blockdev_queue_rw(struct blockdev *bd, char *buf, blocknum_t block,
+                       size_t count, long write);
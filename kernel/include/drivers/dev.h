@@ -41,9 +41,12 @@
 #define NULL_DEVID (MKDEVID(0, 0))
 #define MEM_NULL_DEVID (MKDEVID(1, 0))
 #define MEM_ZERO_DEVID (MKDEVID(1, 1))
+#define MEM_IOSTAT_DEVID (MKDEVID(1, 2))
 
 #define DISK_MAJOR 1
+#define RAMDISK_MAJOR 2
 
 #define MEM_MAJOR 1
 #define MEM_NULL_MINOR 0
 #define MEM_ZERO_MINOR 1
+#define MEM_IOSTAT_MINOR 2
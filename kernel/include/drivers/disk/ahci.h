@@ -18,8 +18,10 @@
 #define AHCI_SECTORS_PER_PRDT (AHCI_MAX_PRDT_SIZE / ATA_SECTOR_SIZE)
 #define AHCI_MAX_SECTORS_PER_COMMAND \
     (1 << 16) /* FLAG: Where does this come from? */
-#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE \
-    (AHCI_MAX_SECTORS_PER_COMMAND / AHCI_SECTORS_PER_PRDT)
+/* Each physically contiguous segment of a command's memory takes a PRD, so
+ * there is room for one page-sized segment for each block of the largest
+ * request the block request queue hands to the driver (BLOCKDEV_MAX_MERGE). */
+#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE 64
 
 #define AHCI_MAX_NUM_PORTS 32
 #define AHCI_COMMAND_HEADERS_PER_LIST 32
@@ -60,7 +62,9 @@ typedef enum fis_type
 
 /* Command codes used when forming the host-to-device FIS (see: ATA Command Set
  * 4). The first two are standard commands. The second two are for NCQ commands.
+ * IDENTIFY DEVICE is only issued once per disk, when its port is set up.
  */
+#define ATA_IDENTIFY_DEVICE_COMMAND 0xec
 #define ATA_READ_DMA_EXT_COMMAND 0x25
 #define ATA_WRITE_DMA_EXT_COMMAND 0x35
 #define ATA_READ_FPDMA_QUEUED_COMMAND 0x60
@@ -214,7 +218,10 @@ typedef union px_interrupt_status {
         uint8_t dps : 1; /* Interrupt set upon completing an FIS that requested
                           * an interrupt upon completion.
                           * Currently doesn't seem to be working... */
-        uint32_t : 26;
+        uint32_t : 24;
+        uint8_t tfes : 1; /* Task File Error Status: the device reported an
+                           * error for one of the port's commands. */
+        uint8_t : 1;
     } bits;
     uint32_t value;
 } packed px_interrupt_status_t;
@@ -241,7 +248,9 @@ typedef struct hba_ghc
 {
     struct
     {
-        uint32_t : 30;
+        uint8_t : 8;
+        uint8_t ncs : 5; /* Number of Command Slots per port, minus one. */
+        uint32_t : 17;
         uint8_t sncq : 1; /* Supports Native Command Queueing. */
         uint8_t : 1;
     } packed cap;
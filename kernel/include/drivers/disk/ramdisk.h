@@ -0,0 +1,46 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+
+#include "proc/kmutex.h"
+
+/*
+ * A block device kept in memory, for measuring the page cache and file systems
+ * apart from the cost of the emulated disk.
+ *
+ * Blocks are backed by pages allocated on their first write; a block that has
+ * never been written reads as zeros, so an unused ramdisk costs only its table
+ * of pages. When the kernel is built with RAMDISK_BLOCKS set, ram0 is created
+ * at boot, and with RAMDISK_ROOT, disk0 is copied onto it and the root file
+ * system is mounted from it instead (see Config.mk).
+ */
+
+typedef struct ramdisk
+{
+    blockdev_t rd_bdev;
+    size_t rd_nblocks;
+    char **rd_blocks; /* one page per block, NULL until first written */
+    kmutex_t rd_mutex; /* serializes allocating blocks */
+} ramdisk_t;
+
+/**
+ * Creates the ramdisks configured at compile time.
+ */
+void ramdisk_init();
+
+/**
+ * Creates and registers a ramdisk with the given number of blocks, as
+ * MKDEVID(RAMDISK_MAJOR, minor).
+ *
+ * @return the new ramdisk's block device, or NULL if it could not be allocated
+ *      or the device id is already taken
+ */
+blockdev_t *ramdisk_create(unsigned minor, size_t nblocks);
+
+/**
+ * Copies the first nblocks blocks of src onto a ramdisk, leaving blocks that
+ * are all zeros unallocated. Must be called from thread context.
+ *
+ * @return 0 on success, -errno on failure
+ */
+long ramdisk_load(blockdev_t *ramdisk, blockdev_t *src, size_t nblocks);
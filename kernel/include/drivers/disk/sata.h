@@ -7,8 +7,46 @@
 
 void sata_init();
 
+/* How a disk's commands are completed (see sata_set_completion()). */
+#define SATA_COMPLETION_INTERRUPT 0x0
+#define SATA_COMPLETION_POLL 0x1  /* synchronous commands poll for a while */
+#define SATA_COMPLETION_BATCH 0x2 /* an interrupt waits for more completions */
+
+/* Times a thread polls the port for its command before going to sleep, and
+ * times the interrupt handler rechecks the port for more completions in
+ * batching mode. Each is an uncached register read. */
+#define SATA_POLL_SPINS 2048
+#define SATA_BATCH_SPINS 256
+
 typedef struct ata_disk
 {
     hba_port_t *port;
     blockdev_t bdev;
+    long completion; /* SATA_COMPLETION_* flags */
 } ata_disk_t;
+
+typedef struct sata_stats
+{
+    size_t ss_commands;        /* commands issued */
+    size_t ss_slot_waits;      /* times a thread slept for a free slot */
+    size_t ss_slot_busy;       /* queued requests bounced for lack of a slot */
+    size_t ss_max_inflight;    /* most commands in flight on the port at once */
+    size_t ss_interrupts;      /* interrupts serviced for the port */
+    size_t ss_irq_completions; /* commands completed by those interrupts */
+    size_t ss_polled;          /* commands whose thread never had to sleep */
+} sata_stats_t;
+
+/* Copies out the command slot counters of the port behind a SATA disk. */
+void sata_stats(blockdev_t *bdev, sata_stats_t *stats);
+
+/* Sets the SATA_COMPLETION_* flags of a SATA disk and returns the old ones.
+ *
+ * By default, every command is completed by the interrupt it raises, waking
+ * the thread waiting on it. With SATA_COMPLETION_POLL, a thread issuing a
+ * synchronous command first spins on the port, and completes the command
+ * itself if it finishes quickly enough, which saves the interrupt latency and
+ * two context switches on small reads. With SATA_COMPLETION_BATCH, the
+ * interrupt handler keeps checking the port for a while after completing what
+ * has finished, so that under load a single interrupt completes many
+ * commands. */
+long sata_set_completion(blockdev_t *bdev, long completion);
@@ -5,3 +5,7 @@
 void *kmalloc(size_t size);
 
 void kfree(void *addr);
+
+/* Returns the number of pages held by kmalloc allocations too large for the
+ * size classes, which come straight from the page allocator. */
+size_t kmalloc_page_count();
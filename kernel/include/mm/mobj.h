@@ -3,6 +3,7 @@
 #include "proc/kmutex.h"
 #include "util/atomic.h"
 #include "util/list.h"
+#include "util/radix.h"
 struct pframe;
 
 struct mobj;
@@ -22,8 +23,18 @@ typedef struct mobj_ops
 
     long (*fill_pframe)(struct mobj *o, struct pframe *pf);
 
+    /* Optional: fills npages locked frames with consecutive page numbers,
+     * so that the backing store can be read in one transfer. If not given,
+     * fill_pframe is called on each frame. */
+    long (*fill_pframes)(struct mobj *o, struct pframe **pfs, size_t npages);
+
     long (*flush_pframe)(struct mobj *o, struct pframe *pf);
 
+    /* Optional: writes back npages locked, dirty frames with consecutive page
+     * numbers, so that they reach the backing store in one transfer. If not
+     * given, flush_pframe is called on each frame. */
+    long (*flush_pframes)(struct mobj *o, struct pframe **pfs, size_t npages);
+
     void (*destructor)(struct mobj *o);
 } mobj_ops_t;
 
@@ -32,10 +43,22 @@ typedef struct mobj
     long mo_type;
     struct mobj_ops mo_ops;
     atomic_t mo_refcount;
-    list_t mo_pframes;
+    radix_tree_t mo_pframes; /* resident pframes, indexed by pf_pagenum */
     kmutex_t mo_mutex;
+
+    /* dirty pframes in the order they were dirtied (see mm/writeback.h) */
+    list_t mo_dirty;
+    size_t mo_ndirty;
+    list_link_t mo_dirty_link; /* on the writeback list while mo_ndirty > 0 */
 } mobj_t;
 
+/* Only the frames of objects with a backing store can be written back or
+ * evicted, so only they are kept on the page cache LRU and dirty lists. */
+static inline long mobj_has_backing_store(mobj_t *o)
+{
+    return o->mo_type == MOBJ_VNODE || o->mo_type == MOBJ_BLOCKDEV;
+}
+
 void mobj_init(mobj_t *o, long type, mobj_ops_t *ops);
 
 void mobj_lock(mobj_t *o);
@@ -51,15 +74,25 @@ void mobj_put_locked(mobj_t **op);
 long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                      struct pframe **pfp);
 
+long mobj_get_pframes(mobj_t *o, uint64_t pagenum, size_t npages,
+                      long forwrite, struct pframe **pfs);
+
 void mobj_find_pframe(mobj_t *o, uint64_t pagenum, struct pframe **pfp);
 
 long mobj_flush_pframe(mobj_t *o, struct pframe *pf);
 
+long mobj_flush_pframes(mobj_t *o, struct pframe **pfs, size_t npages);
+
 long mobj_flush(mobj_t *o);
 
 long mobj_free_pframe(mobj_t *o, struct pframe **pfp);
 
+long mobj_free_pframes(mobj_t *o);
+
 long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              struct pframe **pfp);
 
+long mobj_default_get_pframes(mobj_t *o, uint64_t pagenum, size_t npages,
+                              long forwrite, struct pframe **pfs);
+
 void mobj_default_destructor(mobj_t *o);
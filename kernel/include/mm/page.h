@@ -108,10 +108,43 @@ void page_free(void *addr);
  * allocated */
 void *page_alloc_n(size_t npages);
 
+/* page_alloc and page_alloc_n fall back to synchronously evicting clean page
+ * cache frames (see mm/pageout.h) when memory is exhausted. This variant does
+ * not, for callers that may hold a lock reclaim needs (e.g. the slab
+ * allocator, which reclaim frees pframes into). */
+void *page_alloc_n_noreclaim(size_t npages);
+
 void *page_alloc_n_bounded(size_t npages, void *max_paddr);
 
 void page_free_n(void *start, size_t npages);
 
+/* Blocks of up to 2^PAGE_CPU_CACHE_MAX_ORDER pages are allocated from and
+ * freed to small per-core caches, which are refilled from and drained to the
+ * global allocator PAGE_CPU_CACHE_BATCH blocks at a time. */
+#define PAGE_CPU_CACHE_MAX_ORDER 2
+#define PAGE_CPU_CACHE_SIZE 32
+#define PAGE_CPU_CACHE_BATCH 16
+
+typedef struct page_cpu_cache_stats
+{
+    size_t pccs_alloc_hits;   /* allocations served from the cache */
+    size_t pccs_alloc_misses; /* allocations that needed a refill */
+    size_t pccs_free_hits;    /* frees absorbed by the cache */
+    size_t pccs_free_drains;  /* frees that needed a drain */
+} page_cpu_cache_stats_t;
+
+/* Enables the per-core caches. Must be called after core_init(). */
+void page_cpu_cache_init();
+
+/* Returns all of the current core's cached pages to the global allocator. */
+void page_cpu_cache_drain();
+
+/* Returns the cached pages of every core to the global allocator. */
+void page_cpu_cache_drain_all();
+
+/* Copies out the current core's cache counters. */
+void page_cpu_cache_stats(page_cpu_cache_stats_t *stats);
+
 void page_add_range(void *start, void *end);
 
 void page_mark_reserved(void *paddr);
@@ -119,6 +152,10 @@ void page_mark_reserved(void *paddr);
 void page_init_finish();
 
 /* Returns the number of free pages remaining in the
- * system. Note that calls to page_alloc_n(npages) may
- * fail even if page_free_count() >= npages. */
+ * system, including those in per-core caches. Note that
+ * calls to page_alloc_n(npages) may fail even if
+ * page_free_count() >= npages. */
 size_t page_free_count();
+
+/* Returns the number of pages managed by the allocator, free or not. */
+size_t page_total_count();
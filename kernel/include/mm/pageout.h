@@ -0,0 +1,105 @@
+#pragma once
+
+#include "types.h"
+
+struct pframe;
+
+/*
+ * The page cache LRU and reclaim daemon.
+ *
+ * Every pframe belonging to a memory object with a backing store (vnodes and
+ * block devices) sits on one of two global lists. New frames start on the
+ * inactive list; a frame referenced again while inactive is promoted to the
+ * active list, and the active list is aged back onto the inactive list
+ * whenever it grows larger. Reclaim takes frames from the head (oldest end) of
+ * the inactive list, giving referenced frames a second chance.
+ *
+ * Anonymous and shadow frames have nowhere to be written back to, so they are
+ * never reclaimed. Neither are frames while they are mapped into a user
+ * address space: there is no reverse mapping to unmap them with. pf_mapped
+ * counts the page table entries that map a frame; reclaim drops a frame that
+ * it finds mapped from the LRU, and pframe_unmapped() puts it back once the
+ * last of those entries has been removed.
+ *
+ * When page_free_count() drops below the low watermark, the allocator wakes
+ * the "pageout" kernel thread, which frees empty slabs, then writes back dirty
+ * frames and evicts clean ones until the high watermark is reached. If an
+ * allocation fails outright, page_alloc_n() frees empty slabs and reclaims
+ * clean frames synchronously before giving up.
+ */
+
+/* Frames reclaimed by the pageout thread per pass */
+#define PAGEOUT_BATCH 32
+
+/* The low watermark is this fraction of the memory free at boot, with a floor
+ * of PAGEOUT_MIN_WATERMARK pages; the high watermark is twice the low one */
+#define PAGEOUT_WATERMARK_DIVISOR 64
+#define PAGEOUT_MIN_WATERMARK 64
+
+/**
+ * Initializes the LRU lists. Must be called before any pframe is created.
+ */
+void pageout_init();
+
+/**
+ * Computes the watermarks and starts the pageout thread. Must be called after
+ * the idle process has been set up.
+ */
+void pageout_thread_init();
+
+/**
+ * Puts a newly created pframe on the inactive list, if its memory object
+ * has a backing store. pf must be locked and have pf_obj set.
+ */
+void pageout_lru_add(struct pframe *pf);
+
+/**
+ * Takes pf off whichever LRU list it is on, if any. pf must be locked.
+ */
+void pageout_lru_remove(struct pframe *pf);
+
+/**
+ * Puts pf back on the active list when the last of its mappings has gone, if
+ * reclaim took it off while it was mapped. pf must be locked.
+ */
+void pageout_lru_unmapped(struct pframe *pf);
+
+/**
+ * Records an access to pf, promoting it to the active list if it was already
+ * referenced while inactive. pf must be locked.
+ */
+void pageout_mark_accessed(struct pframe *pf);
+
+/**
+ * Tries to free up to target pages by evicting frames from the inactive list.
+ *
+ * Only memory objects and frames that can be locked without blocking are
+ * considered. If writeback is set, dirty frames are flushed first (which
+ * blocks on I/O); otherwise they are skipped. Must be called from thread
+ * context, without holding the mutex of any frame on the LRU.
+ *
+ * @return the number of pages freed
+ */
+size_t pageout_reclaim(size_t target, long writeback);
+
+/**
+ * Wakes the pageout thread if free memory has dropped below the low
+ * watermark. Called by the page allocator.
+ */
+void pageout_wakeup_check();
+
+typedef struct pageout_stats
+{
+    size_t pos_active;         /* frames on the active list */
+    size_t pos_inactive;       /* frames on the inactive list */
+    size_t pos_low_watermark;  /* in pages */
+    size_t pos_high_watermark; /* in pages */
+    size_t pos_wakeups;        /* times the pageout thread has run */
+    size_t pos_reclaim_calls;  /* calls to pageout_reclaim */
+    size_t pos_reclaimed;      /* frames evicted by those calls */
+} pageout_stats_t;
+
+/**
+ * Copies out the sizes of the LRU lists and the reclaim counters.
+ */
+void pageout_stats(pageout_stats_t *stats);
@@ -91,4 +91,11 @@ void pt_unmap(pml4_t *pml4, uintptr_t vaddr);
 
 void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
 
+size_t pt_write_protect_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
+
+size_t pt_map_batch(pml4_t *pml4, uintptr_t vaddr, uintptr_t *paddrs,
+                    size_t npages, uint32_t ptflags);
+
+uintptr_t pt_lookup(pml4_t *pml4, uintptr_t vaddr);
+
 void check_invalid_mappings(pml4_t *pml4, vmmap_t *vmmap, char *prompt);
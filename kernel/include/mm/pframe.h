@@ -4,13 +4,33 @@
 #include "proc/kmutex.h"
 #include "types.h"
 
+/* Which page-cache LRU list (see mm/pageout.h) a pframe is on, if any */
+typedef enum
+{
+    PF_LRU_NONE = 0,
+    PF_LRU_ACTIVE,
+    PF_LRU_INACTIVE,
+} pframe_lru_t;
+
 typedef struct pframe
 {
     size_t pf_pagenum;
     void *pf_addr;
     long pf_dirty;
     kmutex_t pf_mutex;
-    list_link_t pf_link;
+
+    struct mobj *pf_obj; /* the mobj whose mo_pframes holds this pframe */
+    long pf_mapped;      /* page table entries mapping it into user space */
+
+    /* page-cache LRU state, protected by the LRU lock in mm/pageout.c */
+    pframe_lru_t pf_lru;
+    long pf_referenced;
+    list_link_t pf_lru_link;
+
+    /* dirty list state, protected by the mutex of pf_obj (see mm/writeback.h) */
+    list_link_t pf_dirty_link;
+    uint64_t pf_dirtied; /* jiffies when the frame was last made dirty */
+    long pf_kept_dirty;  /* written back while mapped, so left on the list */
 } pframe_t;
 
 void pframe_init();
@@ -20,3 +40,5 @@ pframe_t *pframe_create();
 void pframe_release(pframe_t **pfp);
 
 void pframe_free(pframe_t **pfp);
+
+void pframe_unmapped(pframe_t *pf);
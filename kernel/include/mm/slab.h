@@ -85,12 +85,49 @@ void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
 
 /**
- * Reclaims memory from unused slabs. 
+ * Reclaims memory from unused slabs. The calling core's magazines and every
+ * allocator's depot are emptied back into the slabs first, and then empty
+ * slabs are returned to the page allocator.
  * 
- * NOTE: This is not currently implemented.
+ * Called by the page allocator when an allocation fails, and by the pageout
+ * thread when free memory drops below its low watermark.
  * 
  * @param target Target number of pages to reclaim. If negative, reclaim as many
  *  as possible
  * @return long Number of pages freed
  */
-long slab_allocators_reclaim(long target);
\ No newline at end of file
+long slab_allocators_reclaim(long target);
+
+typedef struct slab_reclaim_stats
+{
+    size_t srs_calls;     /* calls to slab_allocators_reclaim */
+    size_t srs_pages;     /* pages returned to the page allocator */
+    size_t srs_slabs;     /* empty slabs freed */
+    size_t srs_magazines; /* magazines emptied back into their slabs */
+} slab_reclaim_stats_t;
+
+/**
+ * Copies out the running totals of what slab_allocators_reclaim has freed.
+ */
+void slab_reclaim_stats(slab_reclaim_stats_t *stats);
+
+typedef struct slab_allocator_stats
+{
+    const char *sas_name;
+    size_t sas_objsize;    /* object size, including red-zones */
+    size_t sas_inuse;      /* objects allocated and not yet freed */
+    size_t sas_cached;     /* free objects sitting in magazines */
+    size_t sas_slabs;      /* slabs currently held */
+    size_t sas_pages;      /* pages used by those slabs */
+    size_t sas_peak_pages; /* high-water mark of sas_pages */
+    size_t sas_allocs;     /* total successful allocations */
+    size_t sas_frees;      /* total frees */
+} slab_allocator_stats_t;
+
+/**
+ * Fills in the counters of up to max slab allocators, most recently created
+ * first.
+ *
+ * @return the total number of slab allocators, which may be more than max
+ */
+size_t slab_allocators_stats(slab_allocator_stats_t *stats, size_t max);
\ No newline at end of file
@@ -4,6 +4,61 @@
 #include "types.h"
 
 #include "mm/page.h"
+#include "mm/pagetable.h"
+
+/*
+ * Invalidating user mappings.
+ *
+ * The inline functions below only act on the local TLB and the current
+ * address space. Code that changes or removes user mappings uses
+ * tlb_shootdown() (or a tlb_batch_t, for several ranges at once) instead,
+ * naming the page table it changed: every core that may hold entries for it
+ * is taken care of, with a single IPI each for a whole batch, including this
+ * one when the address space isn't the current one here.
+ *
+ * Where the CPU has process-context identifiers, each core keeps the TLB
+ * entries of the last TLB_NPCIDS address spaces it has run, each under a PCID
+ * of its own, so that switching back to one of them doesn't start with an
+ * empty TLB (see tlb_load()). Those cores are among the ones a shootdown has to
+ * reach; a core drops the PCID of an address space that is shot down while
+ * not current there, so that it is flushed when loaded again.
+ */
+
+/* Invalidating more pages than this one at a time costs more than refilling
+ * the whole TLB afterwards */
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+/* Address spaces each core keeps TLB entries for when it has PCIDs */
+#define TLB_NPCIDS 16
+
+/* Separate ranges a tlb_batch_t holds before it gives up on invalidating them
+ * one by one, and flushes everything */
+#define TLB_BATCH_RANGES 8
+
+/* npages for tlb_shootdown() that invalidates the whole address space */
+#define TLB_SHOOTDOWN_ALL ((size_t)-1)
+
+/* Invalidations of one address space, gathered while unmapping to be done at
+ * once by tlb_batch_flush(). */
+typedef struct tlb_batch
+{
+    pml4_t *tb_pml4; /* NULL if nothing needs invalidating */
+    size_t tb_npages;
+    size_t tb_nranges;
+    uintptr_t tb_vaddr[TLB_BATCH_RANGES];
+    size_t tb_count[TLB_BATCH_RANGES];
+} tlb_batch_t;
+
+typedef struct tlb_stats
+{
+    size_t ts_loads;      /* page tables loaded by tlb_load() */
+    size_t ts_pcid_hits;  /* ...whose TLB entries were still there */
+    size_t ts_pages;      /* pages invalidated one at a time */
+    size_t ts_full;       /* whole address spaces flushed instead */
+    size_t ts_dropped;    /* PCIDs dropped by shootdowns */
+    size_t ts_ipis;       /* shootdown IPIs sent to other cores */
+    long ts_pcid;         /* whether this core uses PCIDs */
+} tlb_stats_t;
 
 /* Invalidates any entries from the TLB which contain
  * mappings for the given virtual address. */
@@ -16,15 +71,22 @@ static inline void tlb_flush(uintptr_t vaddr)
  * vaddr from the TLB. If this range is very large it may
  * be more efficient to call tlb_flush_all to invalidate
  * the entire TLB. */
+static inline void tlb_flush_all();
 static inline void tlb_flush_range(uintptr_t vaddr, size_t count)
 {
+    if (count > TLB_FLUSH_ALL_THRESHOLD)
+    {
+        tlb_flush_all();
+        return;
+    }
     for (size_t i = 0; i < count; i++, vaddr += PAGE_SIZE)
     {
         tlb_flush(vaddr);
     }
 }
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB (all but the global pages, and with PCIDs, for
+ * the current address space only). */
 static inline void tlb_flush_all()
 {
     uintptr_t pdir;
@@ -33,3 +95,50 @@ static inline void tlb_flush_all()
     __asm__ volatile("movq %0, %%cr3" ::"r"(pdir)
                      : "memory");
 }
+
+/**
+ * Sets up the TLB handling of the current core, using PCIDs if the CPU has
+ * them. Called once per core, from core_init().
+ */
+void tlb_init();
+
+/**
+ * Makes pml4 the current page table, keeping its TLB entries from when this
+ * core last ran it, if it still has them. Context switches go through here.
+ */
+void tlb_load(pml4_t *pml4);
+
+/**
+ * Invalidates npages pages from vaddr in the address space of pml4, on every
+ * core that may have TLB entries for it. With more than
+ * TLB_FLUSH_ALL_THRESHOLD pages, or TLB_SHOOTDOWN_ALL, the whole address
+ * space is flushed instead.
+ */
+void tlb_shootdown(pml4_t *pml4, uintptr_t vaddr, size_t npages);
+
+static inline void tlb_shootdown_all(pml4_t *pml4)
+{
+    tlb_shootdown(pml4, 0, TLB_SHOOTDOWN_ALL);
+}
+
+/**
+ * Starts a batch of invalidations in the address space of pml4, which may be
+ * NULL if the mappings were never loaded anywhere.
+ */
+void tlb_batch_init(tlb_batch_t *tb, pml4_t *pml4);
+
+/**
+ * Adds npages pages from vaddr to the batch.
+ */
+void tlb_batch_add(tlb_batch_t *tb, uintptr_t vaddr, size_t npages);
+
+/**
+ * Does the batch's invalidations, as one shootdown. Pages that were unmapped
+ * must not be freed before this.
+ */
+void tlb_batch_flush(tlb_batch_t *tb);
+
+/**
+ * Copies out the current core's TLB counters.
+ */
+void tlb_stats(tlb_stats_t *stats);
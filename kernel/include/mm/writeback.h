@@ -0,0 +1,147 @@
+#pragma once
+
+#include "types.h"
+
+struct mobj;
+struct pframe;
+
+/*
+ * Dirty page tracking and background writeback.
+ *
+ * Every dirty pframe belonging to a memory object with a backing store (vnodes
+ * and block devices) sits on its mobj's mo_dirty list, in the order the frames
+ * were first dirtied, and every mobj with at least one dirty frame sits on a
+ * global list. Flushing a mobj therefore only visits the frames that actually
+ * need to be written.
+ *
+ * The "writeback" kernel thread is woken by a periodic timer. Each pass, it
+ * goes over the dirty mobjs in turn and writes back up to WRITEBACK_BATCH
+ * frames from each that have been dirty for at least WRITEBACK_EXPIRE_MS, so
+ * that dirty data trickles out to disk instead of piling up until sync() or
+ * reclaim. do_sync() (the sync system call) writes back everything at once.
+ *
+ * Either way, the frames of a mobj are written back in batches sorted by page
+ * number, and each run of consecutive frames goes to the mobj's flush_pframes
+ * in one call, which block devices turn into one multi-block write.
+ *
+ * The amount of dirty data is bounded: once more than
+ * WRITEBACK_DIRTY_BACKGROUND frames are dirty, the writeback thread is woken
+ * to write back frames regardless of their age, and a thread that calls
+ * writeback_throttle() while more than WRITEBACK_DIRTY_LIMIT are dirty waits
+ * for it to catch up.
+ *
+ * Frames mapped into a user address space (pf_mapped) can be written through
+ * their mappings without faulting, and there is no reverse map to find and
+ * write-protect those mappings again. So a frame that is written back while
+ * mapped stays on the dirty list, marked pf_kept_dirty: mobj_flush() and
+ * writeback_sync() write it out every time they run, and the writeback thread
+ * leaves it alone instead of rewriting it every WRITEBACK_EXPIRE_MS. Kept
+ * frames are counted apart from the other dirty frames (wbs_kept), and don't
+ * count towards WRITEBACK_DIRTY_BACKGROUND or WRITEBACK_DIRTY_LIMIT, since
+ * writing them back wouldn't bring the count down. A kept frame that is
+ * dirtied again through the kernel counts as dirty again, and once its last
+ * mapping goes away the writeback thread writes it back one final time and it
+ * comes off the list.
+ *
+ * Anonymous and shadow frames have nowhere to be written back to; their
+ * pf_dirty flag is kept up to date, but they are not tracked.
+ */
+
+/* How often the writeback thread runs */
+#define WRITEBACK_INTERVAL_MS 1000
+
+/* How long a frame may stay dirty before the writeback thread flushes it */
+#define WRITEBACK_EXPIRE_MS 3000
+
+/* Frames written back per mobj per pass */
+#define WRITEBACK_BATCH 64
+
+/* Dirty frames sorted and coalesced at a time when flushing a mobj */
+#define WRITEBACK_GATHER 128
+
+/* Dirty frames past which writers are throttled */
+#define WRITEBACK_DIRTY_LIMIT 2048
+
+/* Dirty frames past which the writeback thread ignores WRITEBACK_EXPIRE_MS */
+#define WRITEBACK_DIRTY_BACKGROUND (WRITEBACK_DIRTY_LIMIT / 2)
+
+/**
+ * Initializes the dirty mobj list. Must be called before any pframe is
+ * dirtied.
+ */
+void writeback_init();
+
+/**
+ * Starts the writeback thread and its timer. Must be called after the idle
+ * process has been set up.
+ */
+void writeback_thread_init();
+
+/**
+ * Sets pf_dirty and, if pf's memory object has a backing store and pf was
+ * clean, puts it at the tail of the object's dirty list. pf and its mobj must
+ * be locked.
+ */
+void writeback_mark_dirty(struct pframe *pf);
+
+/**
+ * Clears pf_dirty and takes pf off its memory object's dirty list, if it is on
+ * it. pf and its mobj must be locked.
+ */
+void writeback_mark_clean(struct pframe *pf);
+
+/**
+ * Called once pf has been written back. Clears pf_dirty and takes pf off its
+ * memory object's dirty list, unless pf is mapped into a user address space
+ * and its object has a backing store; then it is kept dirty (see above). pf
+ * and its mobj must be locked.
+ */
+void writeback_mark_written(struct pframe *pf);
+
+/**
+ * Writes back up to max of o's dirty frames that were dirtied at or before
+ * the given time (in jiffies), sorted and coalesced as described above. A run
+ * that fails doesn't stop the others; the frames that couldn't be written stay
+ * dirty. o must be locked.
+ *
+ * @param skip_kept if nonzero, frames kept dirty that are still mapped are
+ * left out
+ * @param nwritten if not NULL, set to the number of frames written back
+ * @return 0 on success, or the first -errno a run failed with
+ */
+long writeback_flush_mobj(struct mobj *o, uint64_t dirtied_before, size_t max,
+                          long skip_kept, size_t *nwritten);
+
+/**
+ * Waits for the writeback thread while more than WRITEBACK_DIRTY_LIMIT frames
+ * are dirty, or until it stops making progress. Called by threads that have
+ * just dirtied data, without holding any locks.
+ */
+void writeback_throttle();
+
+/**
+ * Writes back every dirty frame of every tracked memory object. Blocks on
+ * I/O, and on the mutexes of the objects and frames involved, so it must not
+ * be called while holding any of them.
+ *
+ * @return 0 if every frame was written back, nonzero otherwise
+ */
+long writeback_sync();
+
+typedef struct writeback_stats
+{
+    size_t wbs_dirty;     /* dirty frames currently tracked */
+    size_t wbs_kept;      /* frames kept dirty because they were mapped */
+    size_t wbs_mobjs;     /* mobjs with at least one dirty frame */
+    size_t wbs_wakeups;   /* times the writeback thread has run */
+    size_t wbs_written;   /* frames written back by the writeback thread */
+    size_t wbs_syncs;     /* calls to writeback_sync */
+    size_t wbs_synced;    /* frames written back by those calls */
+    size_t wbs_runs;      /* runs of consecutive frames written back */
+    size_t wbs_throttled; /* times a writer waited in writeback_throttle */
+} writeback_stats_t;
+
+/**
+ * Copies out the number of dirty frames and the writeback counters.
+ */
+void writeback_stats(writeback_stats_t *stats);
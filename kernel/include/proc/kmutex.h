@@ -44,6 +44,16 @@ void kmutex_init(kmutex_t *mtx);
  */
 void kmutex_lock(kmutex_t *mtx);
 
+/**
+ * Locks the specified mutex if it is not currently held, without blocking.
+ *
+ * Note: Fails if curthr already holds the mutex.
+ *
+ * @param mtx the mutex to lock
+ * @return 1 if the mutex was acquired, 0 otherwise
+ */
+long kmutex_trylock(kmutex_t *mtx);
+
 /**
  * Unlocks the specified mutex.
  *
@@ -71,6 +71,16 @@ typedef struct proc
     void *p_start_brk;     /* Initial value of process break */
     struct vmmap *p_vmmap; /* List of areas mapped into process's
                               user address space. */
+
+    /*
+     * A child created by vfork(2) runs in its parent's address space, with
+     * p_vmmap and p_pml4 pointing at the parent's, until it execs or exits.
+     * Meanwhile p_vfork_parent is set and the parent sleeps on the child's
+     * p_vfork_wait. p_vfork_parent is cleared and tested under the parent's
+     * p_children_lock, so that the wakeup can't be lost.
+     */
+    struct proc *p_vfork_parent;
+    ktqueue_t p_vfork_wait;
 } proc_t;
 
 /*==========
@@ -100,6 +110,25 @@ void initproc_finish();
  */
 proc_t *proc_create(const char *name);
 
+/**
+ * Like proc_create(), but the new process borrows curproc's address space
+ * instead of getting a copy of it, until it calls proc_vfork_release().
+ *
+ * @param name the name to give the newly created process
+ * @return the newly created process
+ */
+proc_t *proc_create_vfork(const char *name);
+
+/**
+ * Ends the current process's use of its parent's address space after a
+ * vfork(2), and wakes the parent. The process is left with no vmmap; pml4 is
+ * its own page table to switch to, or NULL if it is exiting, in which case it
+ * finishes on the kernel's page table.
+ *
+ * @param pml4 the page table the process runs on from now on
+ */
+void proc_vfork_release(pml4_t *pml4);
+
 /**
  * Frees all the resources associated with a process.
  *
@@ -161,6 +190,16 @@ pid_t do_waitpid(pid_t pid, int *status, int options);
 struct regs;
 long do_fork(struct regs *regs);
 
+/**
+ * This function implements the vfork(2) system call: the child runs in the
+ * parent's address space, and the parent is suspended until the child execs
+ * or exits.
+ *
+ * @param regs the register state at the time of the system call
+ * @return the child's pid, or -errno on failure
+ */
+long do_vfork(struct regs *regs);
+
 /*===========
  * Miscellany
  *==========*/
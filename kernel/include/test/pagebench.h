@@ -0,0 +1,3 @@
+#pragma once
+
+long pagebench_main(long arg1, void *arg2);
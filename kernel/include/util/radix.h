@@ -0,0 +1,100 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A sparse, integer-keyed radix tree. Each interior node fans out over
+ * RADIX_TREE_MAP_SHIFT bits of the key, and the tree only grows as tall as
+ * the largest key inserted requires, so lookups of small keys (e.g. the page
+ * numbers of a memory object) take only a couple of node hops.
+ *
+ * Items are opaque, non-NULL pointers. The tree does no locking of its own;
+ * callers must serialize access (for memory objects, this is mo_mutex).
+ */
+
+#define RADIX_TREE_MAP_SHIFT 6
+#define RADIX_TREE_MAP_SIZE (1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK (RADIX_TREE_MAP_SIZE - 1)
+
+/* Enough levels to cover a full 64-bit key. */
+#define RADIX_TREE_MAX_HEIGHT \
+    ((64 + RADIX_TREE_MAP_SHIFT - 1) / RADIX_TREE_MAP_SHIFT)
+
+typedef struct radix_node
+{
+    uint64_t rn_bitmap; /* bit i is set iff rn_slots[i] is non-NULL */
+    void *rn_slots[RADIX_TREE_MAP_SIZE];
+} radix_node_t;
+
+typedef struct radix_tree
+{
+    radix_node_t *rt_root; /* NULL iff the tree is empty */
+    unsigned rt_height;    /* number of node levels below (and incl.) root */
+    size_t rt_count;       /* number of items in the tree */
+} radix_tree_t;
+
+#define RADIX_TREE_INITIALIZER \
+    {                          \
+        .rt_root = NULL, .rt_height = 0, .rt_count = 0 \
+    }
+
+/**
+ * Initializes the allocator for radix tree nodes. Must be called after
+ * slab_init() and before any tree is inserted into.
+ */
+void radix_init();
+
+/**
+ * Initializes an empty tree.
+ */
+void radix_tree_init(radix_tree_t *tree);
+
+/**
+ * Returns the item stored at index, or NULL if there is none.
+ */
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t index);
+
+/**
+ * Stores item at index. There must not already be an item at index.
+ *
+ * @return 0 on success, -ENOMEM if a node could not be allocated (in which
+ *  case the tree is unchanged)
+ */
+long radix_tree_insert(radix_tree_t *tree, uint64_t index, void *item);
+
+/**
+ * Removes and returns the item at index, or returns NULL if there is none.
+ * Interior nodes that become empty are freed.
+ */
+void *radix_tree_remove(radix_tree_t *tree, uint64_t index);
+
+/**
+ * Finds the item with the smallest index >= start.
+ *
+ * Removing the returned item before calling again with *indexp + 1 is
+ * allowed, which makes this suitable for in-order iteration with deletion.
+ *
+ * @param indexp if non-NULL and an item is found, set to its index
+ * @return the item, or NULL if there is no item at or above start
+ */
+void *radix_tree_next(radix_tree_t *tree, uint64_t start, uint64_t *indexp);
+
+/**
+ * Frees every interior node of the tree, leaving it empty. Items themselves
+ * are not touched.
+ */
+void radix_tree_destroy(radix_tree_t *tree);
+
+/**
+ * Iterate over every item in tree in ascending index order, in the style of
+ * list_iterate. The current item may be removed from the tree inside the loop
+ * body, and `break` leaves the iteration as usual.
+ */
+#define radix_tree_iterate(tree, var, type)                                  \
+    for (uint64_t __idx_##var = 0, __done_##var = 0, __once_##var = 1;      \
+         __once_##var; __once_##var = 0)                                      \
+        for (type *var;                                                      \
+             !__done_##var &&                                                \
+             (var = (type *)radix_tree_next((tree), __idx_##var,             \
+                                            &__idx_##var));                  \
+             __done_##var = (__idx_##var == (uint64_t)-1), __idx_##var++)
@@ -20,6 +20,14 @@ long do_usleep(useconds_t usec);
 
 time_t core_uptime();
 
+uint64_t time_ms_to_jiffies(time_t ms);
+
+/* Reads the CPU's time stamp counter, for timing short intervals. */
+uint64_t time_cycles();
+
+/* Converts a number of time stamp counter cycles to microseconds. */
+uint64_t time_cycles_to_us(uint64_t cycles);
+
 time_t do_time();
 
 size_t time_stats(char *buf, size_t len);
@@ -8,4 +8,22 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC 0x10
 
+/* A read fault also maps whatever is resident, and already mapped by some
+ * process, of the aligned window of this many pages around it, so that
+ * programs touching shared text and data in order take one fault per window
+ * rather than per page. Must divide the 512 pages of
+ * a page table; 1 turns fault-around off. */
+#define FAULT_AROUND_PAGES 16
+
+typedef struct pagefault_stats
+{
+    size_t pfs_faults; /* user page faults handled */
+    size_t pfs_around; /* pages mapped around them */
+} pagefault_stats_t;
+
 void handle_pagefault(uintptr_t vaddr, uintptr_t cause);
+
+/**
+ * Copies out the page fault counters.
+ */
+void pagefault_stats(pagefault_stats_t *stats);
@@ -8,4 +8,10 @@ mobj_t *shadow_create(mobj_t *shadowed);
 
 void shadow_collapse(mobj_t *o);
 
+void shadow_find_resident_pframe(mobj_t *o, size_t pagenum,
+                                 struct pframe **pfp);
+
+struct pframe *shadow_find_mapped_pframe(mobj_t *o, size_t pagenum,
+                                         uintptr_t paddr);
+
 extern int shadow_count;
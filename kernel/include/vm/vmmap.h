@@ -11,10 +11,28 @@ struct mobj;
 struct proc;
 struct vnode;
 
+struct vmarea;
+
+/*
+ * Besides being on vmm_list in address order, the areas of a map are indexed
+ * by a balanced (AVL) tree ordered by vma_start, so that looking up an address
+ * takes time logarithmic in the number of areas. Each area also records the
+ * free gap between it and the area before it, and each subtree the largest
+ * such gap within it, so that vmmap_find_range() can skip whole subtrees that
+ * have no room. The free space above the last area is not in the tree; it is
+ * checked separately. vmmap_lookup() tries the area it returned last before
+ * searching the tree, since consecutive faults and copies tend to hit the same
+ * area.
+ *
+ * Code that moves the start or end of an area in a map (without making it
+ * overlap another) must call vmmap_update_area() afterwards.
+ */
 typedef struct vmmap
 {
     list_t vmm_list;       /* list of virtual memory areas */
     struct proc *vmm_proc; /* the process that corresponds to this vmmap */
+    struct vmarea *vmm_root;  /* root of the tree of areas */
+    struct vmarea *vmm_cache; /* area last returned by vmmap_lookup() */
 } vmmap_t;
 
 /* Make sure you understand why mapping boundaries are in terms of frame
@@ -36,6 +54,14 @@ typedef struct vmarea
     struct vmmap *vma_vmmap; /* address space that this area belongs to */
     struct mobj *vma_obj;    /* the memory object that corresponds to this address region */
     list_link_t vma_plink;   /* link on process vmmap maps list */
+
+    /* node in vma_vmmap's tree */
+    struct vmarea *vma_parent;
+    struct vmarea *vma_left;
+    struct vmarea *vma_right;
+    long vma_height;     /* of the subtree rooted here */
+    size_t vma_gap;      /* free pages between the previous area and this one */
+    size_t vma_max_gap;  /* largest vma_gap in the subtree rooted here */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -57,6 +83,10 @@ long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages);
 
 void vmmap_insert(vmmap_t *map, vmarea_t *new_vma); 
 
+void vmmap_remove_area(vmmap_t *map, vmarea_t *vma);
+
+void vmmap_update_area(vmmap_t *map, vmarea_t *vma);
+
 ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir);
 
 long vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
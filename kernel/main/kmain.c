@@ -7,7 +7,9 @@
 #include <drivers/tty/vterminal.h>
 #include <main/io.h>
 #include <mm/mm.h>
+#include <mm/pageout.h>
 #include <mm/slab.h>
+#include <mm/writeback.h>
 #include <test/kshell/kshell.h>
 #include <util/time.h>
 #include <vm/anon.h>
@@ -16,6 +18,7 @@
 #include "util/debug.h"
 #include "util/gdb.h"
 #include "util/printf.h"
+#include "util/radix.h"
 #include "util/string.h"
 
 #include "main/acpi.h"
@@ -23,6 +26,7 @@
 #include "main/inits.h"
 
 #include "drivers/dev.h"
+#include "drivers/disk/ramdisk.h"
 #include "drivers/pcie.h"
 
 #include "api/syscall.h"
@@ -56,8 +60,12 @@ static init_func_t init_funcs[] = {
     acpi_init,
     apic_init,
     core_init,
+    page_cpu_cache_init,
     slab_init,
+    radix_init,
     pframe_init,
+    pageout_init,
+    writeback_init,
     pci_init,
     vga_init,
 #ifdef __VM__
@@ -82,6 +90,8 @@ static init_func_t init_funcs[] = {
 #endif
 
     proc_idleproc_init,
+    pageout_thread_init,
+    writeback_thread_init,
 };
 
 
@@ -116,6 +126,8 @@ static void make_devices()
     KASSERT(!status || status == -EEXIST);
     status = do_mknod("/dev/zero", S_IFCHR, MEM_ZERO_DEVID);
     KASSERT(!status || status == -EEXIST);
+    status = do_mknod("/dev/iostat", S_IFCHR, MEM_IOSTAT_DEVID);
+    KASSERT(!status || status == -EEXIST);
     
     char path[32] = {0};
     for (long i = 0; i < __NTERMS__; i++)
@@ -133,6 +145,11 @@ static void make_devices()
         status = do_mknod(path, S_IFBLK, MKDEVID(DISK_MAJOR, i));
         KASSERT(!status || status == -EEXIST);
     }
+
+#if __RAMDISK_BLOCKS__ > 0
+    status = do_mknod("/dev/ram0", S_IFBLK, MKDEVID(RAMDISK_MAJOR, 0));
+    KASSERT(!status || status == -EEXIST);
+#endif
 }
 
 /*
@@ -163,6 +180,13 @@ static void *initproc_run(long arg1, void *arg2)
    //proctest_main(arg1,arg2); // For test
    //driverstest_main(0, NULL); // For test
 #ifdef __VFS__
+#ifdef __RAMDISK_ROOT__
+    dbg(DBG_INIT, "Copying disk0 onto ram0...\n");
+    long err = ramdisk_load(blockdev_lookup(MKDEVID(RAMDISK_MAJOR, 0)),
+                            blockdev_lookup(MKDEVID(DISK_MAJOR, 0)),
+                            __DISK_BLOCKS__);
+    KASSERT(!err && "failed to copy disk0 onto ram0");
+#endif
     dbg(DBG_INIT, "Initializing VFS...\n");
     vfs_init();
     make_devices();
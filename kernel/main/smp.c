@@ -77,6 +77,7 @@ void core_init()
     curcore.kc_csdpaddr = csd_paddr;
 
     intr_init();
+    tlb_init();
     gdt_init();
 
     apic_enable();
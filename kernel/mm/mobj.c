@@ -1,7 +1,10 @@
 #include "errno.h"
 
 #include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pageout.h"
 #include "mm/pframe.h"
+#include "mm/writeback.h"
 
 #include "util/debug.h"
 #include <util/string.h>
@@ -32,7 +35,10 @@ void mobj_init(mobj_t *o, long type, mobj_ops_t *ops)
     kmutex_init(&o->mo_mutex);
 
     o->mo_refcount = ATOMIC_INIT(1);
-    list_init(&o->mo_pframes);
+    radix_tree_init(&o->mo_pframes);
+    list_init(&o->mo_dirty);
+    o->mo_ndirty = 0;
+    list_link_init(&o->mo_dirty_link);
 }
 
 /*
@@ -84,24 +90,21 @@ void mobj_put(mobj_t **op)
 }
 
 /*
- * Find a pframe that already exists in the memory object's mo_pframes list.
+ * Find a pframe that already exists in the memory object's mo_pframes index.
  * If a pframe is found, it must be locked upon return from this function using
  * pf_mutex.
  */
 void mobj_find_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
 {
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    pframe_t *pf = radix_tree_lookup(&o->mo_pframes, pagenum);
+    if (pf)
     {
-        if (pf->pf_pagenum == pagenum)
-        {
-            KASSERT(!kmutex_owns_mutex(&pf->pf_mutex));
-            kmutex_lock(&pf->pf_mutex);
-            *pfp = pf;
-            return;
-        }
+        KASSERT(pf->pf_pagenum == pagenum);
+        KASSERT(!kmutex_owns_mutex(&pf->pf_mutex));
+        kmutex_lock(&pf->pf_mutex);
     }
-    *pfp = NULL;
+    *pfp = pf;
 }
 
 /*
@@ -119,8 +122,10 @@ long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
 }
 
 /*
- * Create and initialize a pframe and add it to the mobj's mo_pframes list.
- * Upon successful return, the pframe's pf_mutex is locked.
+ * Create and initialize a pframe and add it to the mobj's mo_pframes index
+ * and to the page cache LRU. Upon successful return, the pframe's pf_mutex is
+ * locked. If either the pframe or the index node for it cannot be allocated,
+ * *pfp is set to NULL.
  */
 static void mobj_create_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
 {
@@ -131,12 +136,104 @@ static void mobj_create_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
         kmutex_lock(&pf->pf_mutex);
 
         pf->pf_pagenum = pagenum;
-        list_insert_tail(&o->mo_pframes, &pf->pf_link);
+        pf->pf_obj = o;
+        if (radix_tree_insert(&o->mo_pframes, pagenum, pf))
+        {
+            pframe_free(&pf);
+        }
+        else
+        {
+            pageout_lru_add(pf);
+        }
     }
     KASSERT(!pf || kmutex_owns_mutex(&pf->pf_mutex));
     *pfp = pf;
 }
 
+/*
+ * Wrapper around get_pframe for a run of npages consecutive pages starting at
+ * pagenum. Objects using the default get_pframe, and block devices, whose
+ * get_pframe only adds readahead to it, get and fill the whole run at once (see
+ * mobj_default_get_pframes); for the others, get_pframe is called on each page
+ * in turn.
+ *
+ * Returns the number of pframes obtained, which may be fewer than npages, or
+ * an error if not even the first could be. The pframes are stored in pfs and
+ * are all locked upon return.
+ */
+long mobj_get_pframes(mobj_t *o, uint64_t pagenum, size_t npages,
+                      long forwrite, pframe_t **pfs)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(npages);
+    if (o->mo_ops.get_pframe == mobj_default_get_pframe ||
+        o->mo_type == MOBJ_BLOCKDEV)
+    {
+        return mobj_default_get_pframes(o, pagenum, npages, forwrite, pfs);
+    }
+
+    size_t n = 0;
+    long ret = 0;
+    while (n < npages &&
+           !(ret = mobj_get_pframe(o, pagenum + n, forwrite, &pfs[n])))
+    {
+        n++;
+    }
+    return n ? (long)n : ret;
+}
+
+/*
+ * Allocate memory for and fill a run of non-resident, locked pframes with
+ * consecutive page numbers. Each frame gets a page of its own; fill_pframes
+ * hands the device the frames themselves, so their memory need not be
+ * contiguous.
+ *
+ * On failure, every pframe in the run is left without memory.
+ */
+static long mobj_fill_pframes(mobj_t *o, pframe_t **pfs, size_t npages)
+{
+    for (size_t i = 0; i < npages; i++)
+    {
+        KASSERT(!pfs[i]->pf_addr && !pfs[i]->pf_dirty &&
+                "dirtied page doesn't have a physical address");
+        pfs[i]->pf_addr = page_alloc();
+        if (!pfs[i]->pf_addr)
+        {
+            while (i--)
+            {
+                page_free(pfs[i]->pf_addr);
+                pfs[i]->pf_addr = NULL;
+            }
+            return -ENOMEM;
+        }
+    }
+
+    dbg(DBG_PFRAME, "filling %lu pframes (mobj 0x%p pages %lu-%lu)\n", npages,
+        o, pfs[0]->pf_pagenum, pfs[npages - 1]->pf_pagenum);
+    long ret = 0;
+    if (o->mo_ops.fill_pframes)
+    {
+        ret = o->mo_ops.fill_pframes(o, pfs, npages);
+    }
+    else
+    {
+        KASSERT(o->mo_ops.fill_pframe);
+        for (size_t i = 0; i < npages && !ret; i++)
+        {
+            ret = o->mo_ops.fill_pframe(o, pfs[i]);
+        }
+    }
+    if (ret)
+    {
+        for (size_t i = 0; i < npages; i++)
+        {
+            page_free(pfs[i]->pf_addr);
+            pfs[i]->pf_addr = NULL;
+        }
+    }
+    return ret;
+}
+
 /*
  * The default get pframe that is at the center of the mobj/pframe subsystem.
  * This is the routine that is used when the memory object does not have a 
@@ -161,50 +258,92 @@ static void mobj_create_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
 long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              pframe_t **pfp)
 {
-    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
     *pfp = NULL;
-    pframe_t *pf = NULL;
-    mobj_find_pframe(o, pagenum, &pf);
-    if (!pf)
+    long ret = mobj_default_get_pframes(o, pagenum, 1, forwrite, pfp);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * mobj_default_get_pframe for a run of npages consecutive pages. Pframes are
+ * found or created for the whole run first, and then each stretch of them
+ * that isn't resident is filled with a single call to fill_pframes.
+ *
+ * Returns the number of pframes obtained, stopping short at the first one that
+ * can't be created or filled, or an error if that is the first one. The
+ * pframes are stored in pfs and are all locked upon return.
+ */
+long mobj_default_get_pframes(mobj_t *o, uint64_t pagenum, size_t npages,
+                              long forwrite, pframe_t **pfs)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    size_t n;
+    for (n = 0; n < npages; n++)
     {
-        mobj_create_pframe(o, pagenum, &pf);
+        if (!n)
+        {
+            mobj_find_pframe(o, pagenum, &pfs[0]);
+        }
+        else if ((pfs[n] = radix_tree_lookup(&o->mo_pframes, pagenum + n)) &&
+                 !kmutex_trylock(&pfs[n]->pf_mutex))
+        {
+            /* Don't block on the rest of the run while holding its start. */
+            break;
+        }
+        if (!pfs[n])
+        {
+            mobj_create_pframe(o, pagenum + n, &pfs[n]);
+        }
+        if (!pfs[n])
+        {
+            break;
+        }
+        KASSERT(kmutex_owns_mutex(&pfs[n]->pf_mutex));
     }
-    if (!pf)
+    if (!n)
     {
         return -ENOMEM;
     }
-    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
-    if (!pf->pf_addr)
+
+    long ret = 0;
+    size_t filled = 0;
+    while (filled < n)
     {
-        KASSERT(!pf->pf_dirty &&
-                "dirtied page doesn't have a physical address");
-        pf->pf_addr = page_alloc();
-        if (!pf->pf_addr)
+        size_t run = 0;
+        while (filled + run < n && !pfs[filled + run]->pf_addr)
         {
-            return -ENOMEM;
+            run++;
+        }
+        if (run && (ret = mobj_fill_pframes(o, &pfs[filled], run)))
+        {
+            break;
         }
+        filled += run ? run : 1;
+    }
+    for (size_t i = filled; i < n; i++)
+    {
+        pframe_release(&pfs[i]);
+    }
+    if (!filled)
+    {
+        return ret;
+    }
 
-        dbg(DBG_PFRAME, "filling pframe 0x%p (mobj 0x%p page %lu)\n", pf, o,
-            pf->pf_pagenum);
-        KASSERT(o->mo_ops.fill_pframe);
-        long ret = o->mo_ops.fill_pframe(o, pf);
-        if (ret)
+    for (size_t i = 0; i < filled; i++)
+    {
+        if (forwrite)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
-            kmutex_unlock(&pf->pf_mutex);
-            return ret;
+            writeback_mark_dirty(pfs[i]);
         }
+        pageout_mark_accessed(pfs[i]);
     }
-    pf->pf_dirty |= forwrite;
-    *pfp = pf;
-    return 0;
+    return (long)filled;
 }
 
 /*
  * If the pframe is dirty, call the mobj's flush_pframe; if flush_pframe returns
- * successfully, clear pf_dirty flag and return 0. Otherwise, return what
- * flush_pframe returned.
+ * successfully, clear pf_dirty flag (unless the frame is mapped, see
+ * writeback_mark_written) and return 0. Otherwise, return what flush_pframe
+ * returned.
  *
  * Both o and pf must be locked when calling this function
  */
@@ -220,15 +359,60 @@ long mobj_flush_pframe(mobj_t *o, pframe_t *pf)
         long ret = o->mo_ops.flush_pframe(o, pf);
         if (ret)
             return ret;
-        pf->pf_dirty = 0;
+        writeback_mark_written(pf);
+    }
+    KASSERT(!pf->pf_dirty || pf->pf_mapped);
+    return 0;
+}
+
+/*
+ * mobj_flush_pframe for a run of npages dirty pframes with consecutive page
+ * numbers, written back with a single call to the mobj's flush_pframes if it
+ * has one. If that fails, every pframe in the run stays dirty.
+ *
+ * o and all of the pframes must be locked when calling this function
+ */
+long mobj_flush_pframes(mobj_t *o, pframe_t **pfs, size_t npages)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(npages);
+    if (npages == 1 || !o->mo_ops.flush_pframes)
+    {
+        long ret = 0;
+        for (size_t i = 0; i < npages; i++)
+        {
+            ret |= mobj_flush_pframe(o, pfs[i]);
+        }
+        return ret;
+    }
+
+    for (size_t i = 0; i < npages; i++)
+    {
+        KASSERT(kmutex_owns_mutex(&pfs[i]->pf_mutex));
+        KASSERT(pfs[i]->pf_addr && pfs[i]->pf_dirty);
+        KASSERT(pfs[i]->pf_pagenum == pfs[0]->pf_pagenum + i);
+    }
+    dbg(DBG_PFRAME, "flushing %lu pframes (mobj 0x%p pages %lu-%lu)\n", npages,
+        o, pfs[0]->pf_pagenum, pfs[npages - 1]->pf_pagenum);
+    long ret = o->mo_ops.flush_pframes(o, pfs, npages);
+    if (ret)
+    {
+        return ret;
+    }
+    for (size_t i = 0; i < npages; i++)
+    {
+        writeback_mark_written(pfs[i]);
     }
-    KASSERT(!pf->pf_dirty);
     return 0;
 }
 
 /*
- * Iterate through the pframes of the mobj and try to flush each one.
- * If any of them fail, let that reflect in the return value.
+ * Iterate through the dirty pframes of the mobj and try to flush each one.
+ * If any of them fail, let that reflect in the return value, but go on with
+ * the rest. The dirty frames of objects with a backing store are written back
+ * in block order, with runs of consecutive frames coalesced (see
+ * writeback_flush_mobj). Objects without a backing store don't keep a dirty
+ * list, so all of their pframes are visited.
  *
  * The mobj o must be locked when calling this function
  */
@@ -236,7 +420,11 @@ long mobj_flush(mobj_t *o)
 {
     long ret = 0;
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    if (mobj_has_backing_store(o))
+    {
+        return writeback_flush_mobj(o, (uint64_t)-1, (size_t)-1, 0, NULL);
+    }
+    radix_tree_iterate(&o->mo_pframes, pf, pframe_t)
     {
         kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
         if (pf->pf_addr)
@@ -251,7 +439,7 @@ long mobj_flush(mobj_t *o)
 /*
  * Attempt to flush the pframe. If the flush succeeds, then free the pframe's
  * contents (pf->pf_addr) using page_free, remove the pframe from the mobj's
- * list and call pframe_free.
+ * index and the page cache LRU, and call pframe_free.
  *
  * Upon successful return, *pfp MUST be null. If the function returns an error
  * code, *pfp must be unchanged.
@@ -265,6 +453,7 @@ long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
         long ret = mobj_flush_pframe(o, pf);
         if (ret)
             return ret;
+        writeback_mark_clean(pf);
 
         // [+] TODO REMOVE THIS SECTION WHEN FLUSH DOES IT (I.E. WHEN WE HAVE
         // SUPPORT FOR FREEING PFRAME'S IN USE BY UNMAPPING THEM FROM PAGE
@@ -276,26 +465,49 @@ long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
         }
     }
     *pfp = NULL;
-    list_remove(&pf->pf_link);
+    radix_tree_remove(&o->mo_pframes, pf->pf_pagenum);
+    pageout_lru_remove(pf);
     pframe_free(&pf);
     return 0;
 }
 
 /*
- * Simply flush the memory object
+ * Free every pframe of the mobj. A pframe that cannot be flushed is dropped
+ * from the mobj, the LRU and the dirty list anyway, leaking its memory; in
+ * that case a nonzero value is returned.
+ *
+ * The mobj o must be locked when calling this function
  */
-void mobj_default_destructor(mobj_t *o)
+long mobj_free_pframes(mobj_t *o)
 {
-    mobj_lock(o);
-    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-
     long ret = 0;
-    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    radix_tree_iterate(&o->mo_pframes, pf, pframe_t)
     {
         kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
-        ret |= mobj_free_pframe(o, &pf);
+        long err = mobj_free_pframe(o, &pf);
+        if (err)
+        {
+            pageout_lru_remove(pf);
+            writeback_mark_clean(pf);
+            pframe_release(&pf);
+            ret |= err;
+        }
     }
+    radix_tree_destroy(&o->mo_pframes);
+    KASSERT(!o->mo_ndirty);
+    return ret;
+}
+
+/*
+ * Simply flush the memory object
+ */
+void mobj_default_destructor(mobj_t *o)
+{
+    mobj_lock(o);
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
 
+    long ret = mobj_free_pframes(o);
     if (ret)
     {
         dbg(DBG_MM,
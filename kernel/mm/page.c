@@ -1,5 +1,6 @@
 // SMP.1 + SMP.3
 // spinlocks + mask interrupts
+#include "globals.h"
 #include "kernel.h"
 #include "types.h"
 #include <boot/multiboot_macros.h>
@@ -8,6 +9,11 @@
 
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pageout.h"
+#include "mm/slab.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
 
 #include "util/debug.h"
 #include "util/gdb.h"
@@ -17,13 +23,16 @@
 
 // BTREE === Binary Tree (not an actual B-Tree)
 
-// Algorithmic optimization ideas
-// have a "min free idx" pointer for each order (have a "count free" at each
-// order) delay cascading availability bits up the tree until needed; would
-// prevent state "thrashing"
-//      can do this with a cascaded_order flag that equals the highest order
-//      which we have cascaed up to. For a given allocation, if the required
-//      order is > cascaded_order, then we cascade up to the required order
+// Algorithmic optimizations
+// each order has a "min free idx" pointer and a "count free", and the next
+// free index in a row is found a word at a time with clz rather than bit by
+// bit.
+// cascading availability bits up the tree is delayed until needed, which
+// prevents state "thrashing" (an alloc/free pair splitting and re-merging the
+// same block every time): freeing a block never merges it with its buddy.
+// btree_uncoalesced_order is the lowest order at which two buddies may both
+// be available; when an allocation cannot be satisfied we cascade from that
+// order all the way up and try again.
 
 // get ready for bit manipulation heaven :)
 
@@ -97,6 +106,7 @@ GDB_DEFINE_HOOK(page_free, void *addr, size_t npages)
 static spinlock_t page_spinlock;
 
 static size_t page_freecount;
+static size_t page_managed_count; // pages ever handed to the allocator
 
 // if you rename these variables, update them in the macros above
 static size_t
@@ -106,6 +116,7 @@ static size_t max_order; // max depth of binary tree
 static btree_word *btree;
 static uintptr_t *min_available_idx_by_order;
 static size_t *count_available_by_order;
+static size_t btree_uncoalesced_order; // max_order when fully coalesced
 
 static char *type_strings[] = {"ERROR: type = 0", "Available", "Reserved",
                                "ACPI Reclaimable", "ACPI NVS", "GRUB Bad Ram"};
@@ -266,6 +277,7 @@ void page_init()
     memset(count_available_by_order, 0, sizeof(size_t) * (max_order + 1));
 
     page_freecount = 0;
+    btree_uncoalesced_order = max_order;
 
     uintptr_t reserved_ram_start = KERNEL_PHYS_BASE;
     uintptr_t reserved_ram_end =
@@ -340,61 +352,40 @@ void page_init_finish()
         (uintptr_t *)((uintptr_t)count_available_by_order + PHYS_OFFSET);
 }
 
-static void _btree_update_metadata_after_removal(size_t order, size_t idx)
+// returns the first available index in [idx, end), or end if there is none.
+// availability bits are stored most significant bit first, so the lowest
+// available index in a word is its leading set bit.
+static uintptr_t _btree_find_available(uintptr_t idx, uintptr_t end)
 {
-    // [+] TODO Intel-specific optimizations, see BSF, BSR, REPE CMPS/SCAS
-    if (count_available_by_order[order])
+    if (idx >= end)
     {
-        if (idx == min_available_idx_by_order[order])
+        return end;
+    }
+    uintptr_t word_idx = BTREE_WORD_POS(idx);
+    btree_word word = btree[word_idx] & (~(btree_word)0 >> BTREE_BIT_POS(idx));
+    while (!word)
+    {
+        if (++word_idx * BTREE_NUM_BITS >= end)
         {
-            uintptr_t word_idx = BTREE_WORD_POS(idx);
-            if (btree[word_idx] &&
-                word_idx == BTREE_WORD_POS(BTREE_ROW_START_INDEX(order)))
-            {
-                // mask off bits to the left of BTREE_BIT_POS(idx); i.e.
-                // consider only positions > than BTREE_BIT_POS(idx) in
-                // btree[word_idx] when idx is the old index of the first
-                // available node for the given order. This is to avoid setting
-                // min available for an order x to be an index that actually
-                // belongs to order (x + 1) (in the row above).
-                btree_word copy =
-                    btree[word_idx] &
-                    ((1UL << (BTREE_NUM_BITS - BTREE_BIT_POS(idx))) - 1);
-                unsigned bit_idx = BTREE_NUM_BITS;
-                while (copy != 0 && bit_idx > BTREE_BIT_POS(idx))
-                {
-                    bit_idx--;
-                    copy = copy >> 1;
-                }
-                if (BTREE_IS_AVAILABLE(word_idx * BTREE_NUM_BITS + bit_idx))
-                {
-                    min_available_idx_by_order[order] =
-                        word_idx * BTREE_NUM_BITS + bit_idx;
-                    return;
-                }
-                word_idx++;
-            }
-            while (!btree[word_idx])
-                word_idx++;
-            btree_word copy = btree[word_idx];
-            unsigned bit_idx = BTREE_NUM_BITS;
-            while (copy != 0)
-            {
-                bit_idx--;
-                copy = copy >> 1;
-            }
-            uintptr_t min_available = word_idx * BTREE_NUM_BITS + bit_idx;
-            if (min_available > BTREE_ROW_END_INDEX(order))
-            {
-                min_available = BTREE_ROW_END_INDEX(order);
-            }
-            min_available_idx_by_order[order] = min_available;
+            return end;
         }
+        word = btree[word_idx];
     }
-    else
+    uintptr_t found = word_idx * BTREE_NUM_BITS + __builtin_clzl(word);
+    return found < end ? found : end;
+}
+
+static void _btree_update_metadata_after_removal(size_t order, size_t idx)
+{
+    if (!count_available_by_order[order])
     {
         min_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
     }
+    else if (idx == min_available_idx_by_order[order])
+    {
+        min_available_idx_by_order[order] =
+            _btree_find_available(idx + 1, BTREE_ROW_END_INDEX(order));
+    }
 }
 
 static void _btree_mark_available(uintptr_t idx, size_t order)
@@ -413,23 +404,55 @@ static void _btree_mark_available(uintptr_t idx, size_t order)
         min_available_idx_by_order[order] = idx;
     }
 
-    while (idx > 0 && BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
+    // merging with the buddy is left to _btree_cascade()
+    if (idx > 0 && order < btree_uncoalesced_order &&
+        BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
     {
-        BTREE_MARK_UNAVAILABLE(idx);
-        BTREE_MARK_UNAVAILABLE(BTREE_SIBLING(idx));
-
-        count_available_by_order[order] -= 2;
-        _btree_update_metadata_after_removal(order, BTREE_LEFT_SIBLING(idx));
+        btree_uncoalesced_order = order;
+    }
+}
 
-        idx = BTREE_PARENT(idx);
-        order++;
-        BTREE_MARK_AVAILABLE(idx);
-        count_available_by_order[order]++;
-        if (idx < min_available_idx_by_order[order])
+// merge every pair of available buddies, from btree_uncoalesced_order up
+static void _btree_cascade()
+{
+    dbgq(DBG_MM, "cascading availability from order %lu\n",
+         btree_uncoalesced_order);
+    for (size_t order = btree_uncoalesced_order; order < max_order; order++)
+    {
+        uintptr_t end = BTREE_ROW_END_INDEX(order);
+        uintptr_t min_available = end;
+        uintptr_t idx = min_available_idx_by_order[order];
+        while (idx < end)
         {
-            min_available_idx_by_order[order] = idx;
+            if (BTREE_IS_LEFT_CHILD(idx) &&
+                BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
+            {
+                BTREE_MARK_UNAVAILABLE(idx);
+                BTREE_MARK_UNAVAILABLE(BTREE_SIBLING(idx));
+                count_available_by_order[order] -= 2;
+
+                uintptr_t parent = BTREE_PARENT(idx);
+                BTREE_MARK_AVAILABLE(parent);
+                count_available_by_order[order + 1]++;
+                if (parent < min_available_idx_by_order[order + 1])
+                {
+                    min_available_idx_by_order[order + 1] = parent;
+                }
+                idx = _btree_find_available(BTREE_SIBLING(idx) + 1, end);
+            }
+            else
+            {
+                if (min_available == end)
+                {
+                    min_available = idx;
+                }
+                idx = _btree_find_available(idx + 1, end);
+            }
         }
+        min_available_idx_by_order[order] = min_available;
     }
+    btree_uncoalesced_order = max_order;
+    _btree_expensive_sanity_check();
 }
 
 static void _btree_mark_range_available(uintptr_t leaf_idx, size_t npages)
@@ -471,6 +494,7 @@ void page_add_range(void *start, void *end)
     size_t npages = ((uintptr_t)end - (uintptr_t)start) >> PAGE_SHIFT;
     _btree_mark_range_available(BTREE_ADDR_TO_LEAF_INDEX(start), npages);
     page_freecount += npages;
+    page_managed_count += npages;
     _btree_expensive_sanity_check();
 }
 
@@ -546,9 +570,214 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
     return (void *)(addr + PHYS_OFFSET);
 }
 
+/*
+ * Per-core caches ("magazines") of free blocks of 2^order pages, for orders
+ * up to PAGE_CPU_CACHE_MAX_ORDER. Most allocations are single pages (page
+ * tables, pframes, slabs) or small kernel stacks, and the magazines let them
+ * skip page_spinlock: a magazine is refilled from, or drained to, the btree
+ * PAGE_CPU_CACHE_BATCH blocks at a time.
+ *
+ * A magazine is used by its own core, with interrupts masked and its pcc_lock
+ * held. Other cores only take the lock to drain it, when an allocation has
+ * failed (see page_cpu_cache_drain_all()), so it is hardly ever contended.
+ * Pages sitting in a magazine are allocated as far as the btree is
+ * concerned, but are counted as free by page_free_count().
+ */
+typedef struct page_cpu_cache
+{
+    spinlock_t pcc_lock; /* taken before page_spinlock */
+    size_t pcc_count[PAGE_CPU_CACHE_MAX_ORDER + 1];
+    void *pcc_blocks[PAGE_CPU_CACHE_MAX_ORDER + 1][PAGE_CPU_CACHE_SIZE];
+    page_cpu_cache_stats_t pcc_stats;
+} page_cpu_cache_t;
+
+static page_cpu_cache_t page_cpu_cache CORE_SPECIFIC_DATA;
+
+// core-specific data is only valid once core_init() has mapped it in
+static long page_cpu_cache_enabled;
+
+// pages currently held by all magazines; updated atomically
+static size_t page_cpu_cached_count;
+
+static void *_page_alloc_locked(size_t npages, void *max_paddr);
+static void _page_free_locked(void *addr, size_t npages);
+
+void page_cpu_cache_init() { page_cpu_cache_enabled = 1; }
+
+// returns the magazine order for a block of npages, or -1 if it isn't cached
+static inline long _page_cpu_cache_order(size_t npages)
+{
+    if (!page_cpu_cache_enabled || npages & (npages - 1) ||
+        npages > (1UL << PAGE_CPU_CACHE_MAX_ORDER))
+    {
+        return -1;
+    }
+    return __builtin_ctzl(npages);
+}
+
+static void *_page_cpu_cache_alloc(long order)
+{
+    page_cpu_cache_t *pcc = &page_cpu_cache;
+    size_t npages = 1UL << order;
+    void *addr = NULL;
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&pcc->pcc_lock);
+    if (pcc->pcc_count[order])
+    {
+        pcc->pcc_stats.pccs_alloc_hits++;
+    }
+    else
+    {
+        pcc->pcc_stats.pccs_alloc_misses++;
+        spinlock_lock(&page_spinlock);
+        while (pcc->pcc_count[order] < PAGE_CPU_CACHE_BATCH)
+        {
+            void *block = _page_alloc_locked(npages, (void *)~0UL);
+            if (!block)
+            {
+                break;
+            }
+            pcc->pcc_blocks[order][pcc->pcc_count[order]++] = block;
+        }
+        spinlock_unlock(&page_spinlock);
+        __sync_add_and_fetch(&page_cpu_cached_count,
+                             pcc->pcc_count[order] * npages);
+    }
+    if (pcc->pcc_count[order])
+    {
+        addr = pcc->pcc_blocks[order][--pcc->pcc_count[order]];
+        __sync_sub_and_fetch(&page_cpu_cached_count, npages);
+    }
+    spinlock_unlock(&pcc->pcc_lock);
+    intr_setipl(ipl);
+    return addr;
+}
+
+static void _page_cpu_cache_free(void *addr, long order)
+{
+    page_cpu_cache_t *pcc = &page_cpu_cache;
+    size_t npages = 1UL << order;
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&pcc->pcc_lock);
+    if (pcc->pcc_count[order] == PAGE_CPU_CACHE_SIZE)
+    {
+        // give back the oldest blocks, which are the least likely to still
+        // be in the CPU cache
+        pcc->pcc_stats.pccs_free_drains++;
+        spinlock_lock(&page_spinlock);
+        for (size_t i = 0; i < PAGE_CPU_CACHE_BATCH; i++)
+        {
+            _page_free_locked(pcc->pcc_blocks[order][i], npages);
+        }
+        spinlock_unlock(&page_spinlock);
+        for (size_t i = PAGE_CPU_CACHE_BATCH; i < PAGE_CPU_CACHE_SIZE; i++)
+        {
+            pcc->pcc_blocks[order][i - PAGE_CPU_CACHE_BATCH] =
+                pcc->pcc_blocks[order][i];
+        }
+        pcc->pcc_count[order] -= PAGE_CPU_CACHE_BATCH;
+        __sync_sub_and_fetch(&page_cpu_cached_count,
+                             PAGE_CPU_CACHE_BATCH * npages);
+    }
+    else
+    {
+        pcc->pcc_stats.pccs_free_hits++;
+    }
+    pcc->pcc_blocks[order][pcc->pcc_count[order]++] = addr;
+    __sync_add_and_fetch(&page_cpu_cached_count, npages);
+    spinlock_unlock(&pcc->pcc_lock);
+    intr_setipl(ipl);
+}
+
+static void _page_cpu_cache_drain(page_cpu_cache_t *pcc)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&pcc->pcc_lock);
+    spinlock_lock(&page_spinlock);
+    for (long order = 0; order <= PAGE_CPU_CACHE_MAX_ORDER; order++)
+    {
+        while (pcc->pcc_count[order])
+        {
+            _page_free_locked(pcc->pcc_blocks[order][--pcc->pcc_count[order]],
+                              1UL << order);
+            __sync_sub_and_fetch(&page_cpu_cached_count, 1UL << order);
+        }
+    }
+    spinlock_unlock(&page_spinlock);
+    spinlock_unlock(&pcc->pcc_lock);
+    intr_setipl(ipl);
+}
+
+void page_cpu_cache_drain()
+{
+    if (page_cpu_cache_enabled)
+    {
+        _page_cpu_cache_drain(&page_cpu_cache);
+    }
+}
+
+void page_cpu_cache_drain_all()
+{
+    if (!page_cpu_cache_enabled)
+    {
+        return;
+    }
+#ifdef __SMP__
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (csd_vaddr_table[core])
+        {
+            _page_cpu_cache_drain(
+                GET_CSD(core, page_cpu_cache_t, page_cpu_cache));
+        }
+    }
+#else
+    _page_cpu_cache_drain(&page_cpu_cache);
+#endif
+}
+
+void page_cpu_cache_stats(page_cpu_cache_stats_t *stats)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    *stats = page_cpu_cache.pcc_stats;
+    intr_setipl(ipl);
+}
+
 void *page_alloc_n(size_t npages)
 {
-    return page_alloc_n_bounded(npages, (void *)~0UL);
+    void *addr = page_alloc_n_noreclaim(npages);
+    if (!addr)
+    {
+        // empty slabs and the magazines of every core may be sitting on the
+        // pages (or the buddies of the pages) we need. slabs go first since
+        // the pages they free may land in the magazines
+        slab_allocators_reclaim(npages);
+        page_cpu_cache_drain_all();
+        addr = page_alloc_n_noreclaim(npages);
+    }
+    if (!addr && pageout_reclaim(npages, 0))
+    {
+        addr = page_alloc_n_noreclaim(npages);
+    }
+    return addr;
+}
+
+void *page_alloc_n_noreclaim(size_t npages)
+{
+    void *addr = NULL;
+    long order = _page_cpu_cache_order(npages);
+    if (order >= 0)
+    {
+        addr = _page_cpu_cache_alloc(order);
+    }
+    if (!addr)
+    {
+        addr = page_alloc_n_bounded(npages, (void *)~0UL);
+    }
+    pageout_wakeup_check();
+    return addr;
 }
 
 // this is really only used for setting up initial page tables
@@ -556,6 +785,13 @@ void *page_alloc_n(size_t npages)
 void *page_alloc_n_bounded(size_t npages, void *max_paddr)
 {
     spinlock_lock(&page_spinlock);
+    void *ret = _page_alloc_locked(npages, max_paddr);
+    spinlock_unlock(&page_spinlock);
+    return ret;
+}
+
+static void *_page_alloc_locked(size_t npages, void *max_paddr)
+{
     KASSERT(npages > 0 && npages <= (1UL << max_order));
     if (npages > page_freecount)
     {
@@ -569,53 +805,70 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
     uintptr_t max_page_number =
         ((uintptr_t)max_paddr >> PAGE_SHIFT) - npages + 1;
 
-    // [+] TODO intel-specific optimization possible here?
-    size_t smallest_order = 0;
-    while ((1UL << smallest_order) < npages)
-        smallest_order++;
+    size_t smallest_order =
+        npages == 1 ? 0 : BTREE_NUM_BITS - __builtin_clzl(npages - 1);
 
-    for (size_t actual_order = smallest_order; actual_order <= max_order;
-         actual_order++)
+    for (;;)
     {
-        if (!count_available_by_order[actual_order])
+        for (size_t actual_order = smallest_order; actual_order <= max_order;
+             actual_order++)
         {
-            continue;
+            if (!count_available_by_order[actual_order])
+            {
+                continue;
+            }
+            uintptr_t idx = min_available_idx_by_order[actual_order];
+            KASSERT(idx >= BTREE_ROW_START_INDEX(actual_order) &&
+                    idx < BTREE_ROW_END_INDEX(actual_order));
+            if ((idx - BTREE_ROW_START_INDEX(actual_order)) *
+                    (1 << actual_order) <
+                max_page_number)
+            {
+                KASSERT((idx - BTREE_ROW_START_INDEX(actual_order)) *
+                            (1 << actual_order) <
+                        max_pages);
+
+                void *ret =
+                    _btree_alloc(npages, idx, smallest_order, actual_order);
+                KASSERT(((uintptr_t)ret + (npages << PAGE_SHIFT)) <=
+                        (uintptr_t)physmap_end());
+                return ret;
+            }
         }
-        uintptr_t idx = min_available_idx_by_order[actual_order];
-        KASSERT(idx >= BTREE_ROW_START_INDEX(actual_order) &&
-                idx < BTREE_ROW_END_INDEX(actual_order));
-        if ((idx - BTREE_ROW_START_INDEX(actual_order)) * (1 << actual_order) <
-            max_page_number)
+        if (btree_uncoalesced_order >= max_order)
         {
-            KASSERT((idx - BTREE_ROW_START_INDEX(actual_order)) *
-                        (1 << actual_order) <
-                    max_pages);
-
-            void *ret = _btree_alloc(npages, idx, smallest_order, actual_order);
-            KASSERT(((uintptr_t)ret + (npages << PAGE_SHIFT)) <=
-                    (uintptr_t)physmap_end());
-            spinlock_unlock(&page_spinlock);
-            return ret;
+            return 0;
         }
+        _btree_cascade();
     }
-    spinlock_unlock(&page_spinlock);
-    return 0;
 }
 
 void page_free_n(void *addr, size_t npages)
 {
+    GDB_CALL_HOOK(page_free, addr, npages);
+    KASSERT(npages > 0 && npages <= (1UL << max_order) && PAGE_ALIGNED(addr));
+    long order = _page_cpu_cache_order(npages);
+    if (order >= 0)
+    {
+        _page_cpu_cache_free(addr, order);
+        return;
+    }
+
     spinlock_lock(&page_spinlock);
+    _page_free_locked(addr, npages);
+    spinlock_unlock(&page_spinlock);
+}
+
+static void _page_free_locked(void *addr, size_t npages)
+{
     dbgq(DBG_MM, "page_free_n(%lu): [0x%p, 0x%p)\t\t%lu pages remain\n", npages,
          addr, (void *)((uintptr_t)addr + (npages << PAGE_SHIFT)),
          page_freecount);
-    GDB_CALL_HOOK(page_free, addr, npages);
-    KASSERT(npages > 0 && npages <= (1UL << max_order) && PAGE_ALIGNED(addr));
     uintptr_t idx = BTREE_ADDR_TO_LEAF_INDEX((uintptr_t)addr - PHYS_OFFSET);
     KASSERT(idx + npages - BTREE_LEAF_START_INDEX <= max_pages);
     _btree_mark_range_available(idx, npages);
     page_freecount += npages;
     _btree_expensive_sanity_check();
-    spinlock_unlock(&page_spinlock);
 }
 
 void page_mark_reserved(void *paddr)
@@ -661,9 +914,12 @@ void page_mark_reserved(void *paddr)
         still_available_leaf_idx_end - unavailable_leaf_idx - 1);
 
     page_freecount--;
+    page_managed_count--;
 
     _btree_expensive_sanity_check();
     spinlock_unlock(&page_spinlock);
 }
 
-size_t page_free_count() { return page_freecount; }
+size_t page_free_count() { return page_freecount + page_cpu_cached_count; }
+
+size_t page_total_count() { return page_managed_count; }
@@ -0,0 +1,315 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pageout.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+
+/*
+ * Lock ordering: the LRU lock may be held while *trying* to lock a mobj or
+ * pframe mutex, but never while blocking on one, and it is always dropped
+ * before a frame is flushed or freed.
+ */
+static spinlock_t pageout_lru_lock;
+static list_t pageout_active_list;
+static list_t pageout_inactive_list;
+static size_t pageout_nactive;
+static size_t pageout_ninactive;
+
+static size_t pageout_low_watermark;
+static size_t pageout_high_watermark;
+
+static ktqueue_t pageout_waitq;
+static kthread_t *pageout_thread;
+
+static pageout_stats_t pageout_totals;
+
+void pageout_init()
+{
+    spinlock_init(&pageout_lru_lock);
+    list_init(&pageout_active_list);
+    list_init(&pageout_inactive_list);
+    pageout_nactive = 0;
+    pageout_ninactive = 0;
+    sched_queue_init(&pageout_waitq);
+}
+
+/* The LRU lock must be held for the following helpers. */
+
+static void _pageout_lru_insert(pframe_t *pf, pframe_lru_t lru)
+{
+    KASSERT(pf->pf_lru == PF_LRU_NONE);
+    if (lru == PF_LRU_ACTIVE)
+    {
+        list_insert_tail(&pageout_active_list, &pf->pf_lru_link);
+        pageout_nactive++;
+    }
+    else
+    {
+        list_insert_tail(&pageout_inactive_list, &pf->pf_lru_link);
+        pageout_ninactive++;
+    }
+    pf->pf_lru = lru;
+}
+
+static void _pageout_lru_delete(pframe_t *pf)
+{
+    if (pf->pf_lru == PF_LRU_NONE)
+    {
+        return;
+    }
+    list_remove(&pf->pf_lru_link);
+    if (pf->pf_lru == PF_LRU_ACTIVE)
+    {
+        pageout_nactive--;
+    }
+    else
+    {
+        pageout_ninactive--;
+    }
+    pf->pf_lru = PF_LRU_NONE;
+}
+
+static void _pageout_lru_move(pframe_t *pf, pframe_lru_t lru)
+{
+    _pageout_lru_delete(pf);
+    _pageout_lru_insert(pf, lru);
+}
+
+void pageout_lru_add(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_obj);
+    if (!mobj_has_backing_store(pf->pf_obj))
+    {
+        return;
+    }
+
+    spinlock_lock(&pageout_lru_lock);
+    pf->pf_referenced = 0;
+    _pageout_lru_insert(pf, PF_LRU_INACTIVE);
+    spinlock_unlock(&pageout_lru_lock);
+}
+
+void pageout_lru_remove(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    spinlock_lock(&pageout_lru_lock);
+    _pageout_lru_delete(pf);
+    spinlock_unlock(&pageout_lru_lock);
+}
+
+void pageout_lru_unmapped(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (!mobj_has_backing_store(pf->pf_obj))
+    {
+        return;
+    }
+
+    spinlock_lock(&pageout_lru_lock);
+    if (pf->pf_lru == PF_LRU_NONE)
+    {
+        /* It was in use until just now */
+        pf->pf_referenced = 0;
+        _pageout_lru_insert(pf, PF_LRU_ACTIVE);
+    }
+    spinlock_unlock(&pageout_lru_lock);
+}
+
+void pageout_mark_accessed(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    spinlock_lock(&pageout_lru_lock);
+    if (pf->pf_lru == PF_LRU_INACTIVE && pf->pf_referenced)
+    {
+        pf->pf_referenced = 0;
+        _pageout_lru_move(pf, PF_LRU_ACTIVE);
+    }
+    else
+    {
+        pf->pf_referenced = 1;
+    }
+    spinlock_unlock(&pageout_lru_lock);
+}
+
+/*
+ * Move frames that have not been referenced since the last pass from the head
+ * of the active list to the inactive list, until the inactive list is at
+ * least as large. Referenced frames have their bit cleared and are rotated.
+ */
+static void _pageout_age_active()
+{
+    size_t nscan = pageout_nactive;
+    while (nscan-- && pageout_nactive > pageout_ninactive)
+    {
+        pframe_t *pf =
+            list_head(&pageout_active_list, pframe_t, pf_lru_link);
+        if (pf->pf_referenced)
+        {
+            pf->pf_referenced = 0;
+            _pageout_lru_move(pf, PF_LRU_ACTIVE);
+        }
+        else
+        {
+            _pageout_lru_move(pf, PF_LRU_INACTIVE);
+        }
+    }
+}
+
+size_t pageout_reclaim(size_t target, long writeback)
+{
+    if (!curthr)
+    {
+        return 0;
+    }
+
+    size_t nfreed = 0;
+    spinlock_lock(&pageout_lru_lock);
+    _pageout_age_active();
+
+    size_t nscan = pageout_ninactive;
+    while (nfreed < target && nscan--)
+    {
+        pframe_t *pf =
+            list_head(&pageout_inactive_list, pframe_t, pf_lru_link);
+        mobj_t *o = pf->pf_obj;
+
+        if (pf->pf_mapped)
+        {
+            /* Can't be evicted until it is unmapped, which puts it back on the
+             * LRU; stop scanning it until then. */
+            _pageout_lru_delete(pf);
+            continue;
+        }
+        if (pf->pf_referenced)
+        {
+            pf->pf_referenced = 0;
+            _pageout_lru_move(pf, PF_LRU_ACTIVE);
+            continue;
+        }
+
+        /* A mobj with no references left is being torn down by its
+         * destructor, which will free this frame itself. */
+        if (!o->mo_refcount || !kmutex_trylock(&o->mo_mutex))
+        {
+            _pageout_lru_move(pf, PF_LRU_INACTIVE);
+            continue;
+        }
+        if (!kmutex_trylock(&pf->pf_mutex))
+        {
+            kmutex_unlock(&o->mo_mutex);
+            _pageout_lru_move(pf, PF_LRU_INACTIVE);
+            continue;
+        }
+        if (pf->pf_mapped)
+        {
+            /* Mapped by a fault since it was checked above */
+            _pageout_lru_delete(pf);
+            kmutex_unlock(&pf->pf_mutex);
+            kmutex_unlock(&o->mo_mutex);
+            continue;
+        }
+        _pageout_lru_delete(pf);
+        spinlock_unlock(&pageout_lru_lock);
+
+        long ret = 0;
+        if (pf->pf_dirty)
+        {
+            ret = writeback && o->mo_ops.flush_pframe
+                      ? mobj_flush_pframe(o, pf)
+                      : -EBUSY;
+        }
+        if (!ret)
+        {
+            dbg(DBG_PFRAME, "evicting pframe 0x%p (mobj 0x%p page %lu)\n", pf,
+                o, pf->pf_pagenum);
+            ret = mobj_free_pframe(o, &pf);
+        }
+
+        spinlock_lock(&pageout_lru_lock);
+        if (ret)
+        {
+            _pageout_lru_insert(pf, PF_LRU_INACTIVE);
+            kmutex_unlock(&pf->pf_mutex);
+        }
+        else
+        {
+            nfreed++;
+        }
+        kmutex_unlock(&o->mo_mutex);
+    }
+    pageout_totals.pos_reclaim_calls++;
+    pageout_totals.pos_reclaimed += nfreed;
+    spinlock_unlock(&pageout_lru_lock);
+
+    dbg(DBG_MM, "reclaimed %lu of %lu requested pages (writeback %ld)\n",
+        nfreed, target, writeback);
+    return nfreed;
+}
+
+void pageout_wakeup_check()
+{
+    if (pageout_thread && page_free_count() < pageout_low_watermark)
+    {
+        sched_wakeup_on(&pageout_waitq, NULL);
+    }
+}
+
+static void *pageout_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        sched_sleep_on(&pageout_waitq, NULL);
+
+        dbg(DBG_MM, "pageout woken with %lu free pages\n", page_free_count());
+        pageout_totals.pos_wakeups++;
+        /* Empty slabs cost nothing to give back, so they go first. */
+        size_t nfree = page_free_count();
+        if (nfree < pageout_high_watermark)
+        {
+            slab_allocators_reclaim(pageout_high_watermark - nfree);
+        }
+        while (page_free_count() < pageout_high_watermark &&
+               pageout_reclaim(PAGEOUT_BATCH, 1))
+            ;
+    }
+    return NULL;
+}
+
+void pageout_stats(pageout_stats_t *stats)
+{
+    spinlock_lock(&pageout_lru_lock);
+    *stats = pageout_totals;
+    stats->pos_active = pageout_nactive;
+    stats->pos_inactive = pageout_ninactive;
+    stats->pos_low_watermark = pageout_low_watermark;
+    stats->pos_high_watermark = pageout_high_watermark;
+    spinlock_unlock(&pageout_lru_lock);
+}
+
+void pageout_thread_init()
+{
+    pageout_low_watermark = page_free_count() / PAGEOUT_WATERMARK_DIVISOR;
+    if (pageout_low_watermark < PAGEOUT_MIN_WATERMARK)
+    {
+        pageout_low_watermark = PAGEOUT_MIN_WATERMARK;
+    }
+    pageout_high_watermark = 2 * pageout_low_watermark;
+
+    kthread_t *thr = kthread_create(&idleproc, pageout_run, 0, NULL);
+    KASSERT(thr && "failed to create the pageout thread");
+    sched_make_runnable(thr);
+    pageout_thread = thr;
+
+    dbg(DBG_MM, "pageout watermarks: low %lu, high %lu pages\n",
+        pageout_low_watermark, pageout_high_watermark);
+}
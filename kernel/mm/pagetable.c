@@ -5,6 +5,7 @@
 
 #include "mm/mm.h"
 #include "mm/pframe.h"
+#include "mm/tlb.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -40,7 +41,8 @@ inline pml4_t *pt_get()
     uintptr_t pml4;
     __asm__ volatile("movq %%cr3, %0"
                      : "=r"(pml4));
-    return (pml4_t *)(pml4 + PHYS_OFFSET);
+    /* the low bits hold the PCID, if there is one (see tlb_load()) */
+    return (pml4_t *)((pml4 & PAGE_MASK) + PHYS_OFFSET);
 }
 
 vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
@@ -602,7 +604,13 @@ void pt_destroy_helper(pt_t *pt, long depth)
     page_free(pt);
 }
 
-void pt_destroy(pml4_t *pml4) { pt_destroy_helper(pml4, 4); }
+void pt_destroy(pml4_t *pml4)
+{
+    /* so that no core keeps entries for the page table's PCID, which a new
+     * page table allocated at the same address would otherwise pick up */
+    tlb_shootdown_all(pml4);
+    pt_destroy_helper(pml4, 4);
+}
 
 void pt_unmap(pml4_t *pml4, uintptr_t vaddr)
 {
@@ -743,6 +751,144 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
     KASSERT(_vaddr_status(pml4, vaddr_start) == UNMAPPED);
 }
 
+/*
+ * Clears PT_WRITE in every present mapping in [vaddr, vmax), leaving the
+ * mappings themselves in place, so that the next write to any of them faults.
+ * Only 4KB mappings are expected, as for user memory. Returns the number of
+ * mappings that were writable.
+ */
+size_t pt_write_protect_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+{
+    dbg(DBG_PGTBL, "virt[0x%p, 0x%p); pml4: 0x%p\n", (void *)vaddr,
+        (void *)vmax, pml4);
+    KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
+
+    size_t count = 0;
+    while (vaddr < vmax)
+    {
+        uint64_t idx = PML4E(vaddr);
+        pml4_t *table = pml4;
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_512GB(vaddr + 1);
+            continue;
+        }
+        table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        idx = PDPE(vaddr);
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_1GB(vaddr + 1);
+            continue;
+        }
+        KASSERT(!IS_1GB_PAGE(table->phys[idx]));
+        table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        idx = PDE(vaddr);
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_2MB(vaddr + 1);
+            continue;
+        }
+        KASSERT(!IS_2MB_PAGE(table->phys[idx]));
+        table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        // The rest of the range covered by this page table
+        uintptr_t end = MIN(vmax, PAGE_ALIGN_UP_2MB(vaddr + 1));
+        for (; vaddr < end; vaddr += PAGE_SIZE)
+        {
+            uintptr_t *pte = &table->phys[PTE(vaddr)];
+            if (IS_PRESENT(*pte) && (*pte & PT_WRITE))
+            {
+                *pte &= ~(uintptr_t)PT_WRITE;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Returns the physical page that vaddr is mapped to with a 4KB page, or 0 if
+ * it isn't mapped.
+ */
+uintptr_t pt_lookup(pml4_t *pml4, uintptr_t vaddr)
+{
+    KASSERT(PAGE_ALIGNED(vaddr));
+    pml4_t *table = pml4;
+    uint64_t idx = PML4E(vaddr);
+    if (!IS_PRESENT(table->phys[idx]))
+    {
+        return 0;
+    }
+    table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    idx = PDPE(vaddr);
+    if (!IS_PRESENT(table->phys[idx]))
+    {
+        return 0;
+    }
+    KASSERT(!IS_1GB_PAGE(table->phys[idx]));
+    table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    idx = PDE(vaddr);
+    if (!IS_PRESENT(table->phys[idx]))
+    {
+        return 0;
+    }
+    KASSERT(!IS_2MB_PAGE(table->phys[idx]));
+    table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    uintptr_t pte = table->phys[PTE(vaddr)];
+    return IS_PRESENT(pte) ? pte & PAGE_MASK : 0;
+}
+
+/*
+ * Maps the npages pages from vaddr to the physical pages in paddrs, with a
+ * single walk: they must all be covered by one page table, which must already
+ * exist (as it does once any page in its 2MB has been mapped by pt_map()).
+ * Pages that are already mapped, and those whose paddrs entry is 0, are left
+ * alone, and their paddrs entries are 0 on return. Returns the number of pages
+ * mapped.
+ */
+size_t pt_map_batch(pml4_t *pml4, uintptr_t vaddr, uintptr_t *paddrs,
+                    size_t npages, uint32_t ptflags)
+{
+    dbg(DBG_PGTBL, "%lu pages from 0x%p; pml4: 0x%p\n", npages, (void *)vaddr,
+        pml4);
+    KASSERT(PAGE_ALIGNED(vaddr) && npages);
+    KASSERT(PTE(vaddr) + npages <= PT_ENTRY_COUNT);
+    KASSERT((ptflags & PAGE_MASK) == 0 && !(ptflags & PT_SIZE));
+
+    pml4_t *table = pml4;
+    uint64_t idx = PML4E(vaddr);
+    KASSERT(IS_PRESENT(table->phys[idx]));
+    table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    idx = PDPE(vaddr);
+    KASSERT(IS_PRESENT(table->phys[idx]) && !IS_1GB_PAGE(table->phys[idx]));
+    table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    idx = PDE(vaddr);
+    KASSERT(IS_PRESENT(table->phys[idx]) && !IS_2MB_PAGE(table->phys[idx]));
+    table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    size_t count = 0;
+    uintptr_t *pte = &table->phys[PTE(vaddr)];
+    for (size_t i = 0; i < npages; i++)
+    {
+        if (!paddrs[i] || IS_PRESENT(pte[i]))
+        {
+            paddrs[i] = 0;
+            continue;
+        }
+        KASSERT(PAGE_ALIGNED(paddrs[i]));
+        pte[i] = paddrs[i] | ptflags;
+        count++;
+    }
+    return count;
+}
+
 static char *entry_strings[] = {
     "4KB",
     "2MB",
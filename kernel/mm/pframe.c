@@ -1,5 +1,6 @@
 #include "globals.h"
 
+#include "mm/pageout.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
 
@@ -26,7 +27,8 @@ pframe_t *pframe_create()
     }
     memset(pf, 0, sizeof(pframe_t));
     kmutex_init(&pf->pf_mutex);
-    list_link_init(&pf->pf_link);
+    list_link_init(&pf->pf_lru_link);
+    list_link_init(&pf->pf_dirty_link);
     return pf;
 }
 
@@ -34,19 +36,41 @@ pframe_t *pframe_create()
  * Free the pframe (don't forget to unlock the mutex) and set *pfp = NULL
  *
  * The pframe must be locked, its contents not in memory (pf->pf_addr == NULL),
- * have a pincount of 0, and not be linked into a memory object's list.
+ * have a pincount of 0, and already be removed from its memory object's
+ * mo_pframes index and from the page cache LRU.
  */
 void pframe_free(pframe_t **pfp)
 {
     KASSERT(kmutex_owns_mutex(&(*pfp)->pf_mutex));
     KASSERT(!(*pfp)->pf_addr);
     KASSERT(!(*pfp)->pf_dirty);
-    KASSERT(!list_link_is_linked(&(*pfp)->pf_link));
+    KASSERT((*pfp)->pf_lru == PF_LRU_NONE);
+    KASSERT(!list_link_is_linked(&(*pfp)->pf_dirty_link));
+    KASSERT(!(*pfp)->pf_kept_dirty);
     kmutex_unlock(&(*pfp)->pf_mutex);
     slab_obj_free(pframe_allocator, *pfp);
     *pfp = NULL;
 }
 
+/*
+ * Drop one of the page table entries counted in pf_mapped, once it is gone from
+ * every TLB too. A frame that is no longer mapped anywhere can be evicted
+ * again, so it goes back on the page cache LRU.
+ *
+ * The pframe must not be locked, and its memory object must not go away in
+ * the meantime (the vmarea being unmapped still holds a reference to it).
+ */
+void pframe_unmapped(pframe_t *pf)
+{
+    kmutex_lock(&pf->pf_mutex);
+    KASSERT(pf->pf_mapped > 0);
+    if (!--pf->pf_mapped)
+    {
+        pageout_lru_unmapped(pf);
+    }
+    pframe_release(&pf);
+}
+
 /*
  * Unlock the pframe and set *pfp = NULL
  */
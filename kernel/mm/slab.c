@@ -13,18 +13,33 @@
  * preemptible kernels!
  *
  * darmanio: ^ lol, look at me now :D
+ *
+ * In front of the slabs sits a per-core object cache, after Bonwick and
+ * Adams' "Magazines and Vmem". Each core has a "loaded" and a "previous"
+ * magazine (a small stack of free objects) per allocator, and allocates from
+ * and frees to them with only interrupts blocked. When both are exhausted the
+ * core trades one with the allocator's depot of full and empty magazines, and
+ * only when the depot can't help does it go to the slab layer. Slabs are kept
+ * on partial, full and empty lists so that the slab layer never scans.
  */
 
+#include "globals.h"
 #include "types.h"
 
+#include "main/apic.h"
+#include "main/interrupt.h"
+
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pageout.h"
 #include "mm/slab.h"
 
 #include "proc/spinlock.h"
 
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/list.h"
+#include "util/radix.h"
 #include "util/string.h"
 
 #ifdef SLAB_REDZONE
@@ -48,21 +63,53 @@
 
 struct slab
 {
-    struct slab *s_next; /* link on list of slabs */
-    size_t s_inuse;      /* number of allocated objs */
-    void *s_free;        /* head of obj free list */
-    void *s_addr;        /* start address */
+    list_link_t s_link; /* link on one of the allocator's slab lists */
+    size_t s_inuse;     /* number of allocated objs */
+    void *s_free;       /* head of obj free list */
+    void *s_addr;       /* start address */
 };
 
+/* Number of objects a magazine holds; the whole magazine is 16 words */
+#define SLAB_MAGAZINE_SIZE 14
+
+typedef struct slab_magazine
+{
+    struct slab_magazine *m_next; /* link on a depot list */
+    size_t m_rounds;              /* number of objects in m_objs */
+    void *m_objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+/* A core's magazines for one allocator. Either may be NULL, and the previous
+ * magazine is always completely full or completely empty. sc_lock is taken
+ * by the core itself, and by slab_allocators_reclaim() on any core; it comes
+ * before sa_lock. */
+typedef struct slab_cpu
+{
+    spinlock_t sc_lock;
+    slab_magazine_t *sc_loaded;
+    slab_magazine_t *sc_previous;
+    size_t sc_allocs; /* successful slab_obj_alloc calls on this core */
+    size_t sc_frees;  /* slab_obj_free calls on this core */
+} slab_cpu_t;
+
 typedef struct slab_allocator
 {
     const char *sa_name;            /* user-provided name */
     size_t sa_objsize;              /* object size */
-    struct slab *sa_slabs;          /* head of slab list */
+    list_t sa_partial_slabs;        /* slabs with free and allocated objs */
+    list_t sa_full_slabs;           /* slabs with no free objs */
+    list_t sa_empty_slabs;          /* slabs with no allocated objs */
     size_t sa_order;                /* npages = (1 << order) */
     size_t sa_slab_nobjs;           /* number of objs per slab */
     struct slab_allocator *sa_next; /* link on global list of allocators */
-    spinlock_t sa_lock;
+    long sa_magazines;              /* whether objs are cached per core */
+    slab_magazine_t *sa_depot_full; /* full magazines not loaded by a core */
+    slab_magazine_t *sa_depot_empty; /* empty magazines likewise */
+    slab_cpu_t sa_cpu[MAX_LAPICS];  /* indexed by core id */
+    size_t sa_nslabs;               /* number of slabs */
+    size_t sa_peak_nslabs;          /* high-water mark of sa_nslabs */
+    size_t sa_slab_inuse;           /* objs taken out of the slabs */
+    spinlock_t sa_lock;             /* protects everything above */
 } slab_allocator_t;
 
 /* Stored at the end of every object to keep track of the 
@@ -97,10 +144,17 @@ GDB_DEFINE_HOOK(slab_obj_free, void *addr, slab_allocator_t *allocator)
 
 /* Head of global list of slab allocators. This is used in the python gdb script */
 static slab_allocator_t *slab_allocators = NULL;
+/* Protects slab_allocators and slab_reclaim_totals. Taken before sa_lock. */
+static spinlock_t slab_allocators_lock;
+
+static slab_reclaim_stats_t slab_reclaim_totals;
 
 /* Special case - allocator for allocation of slab_allocator objects. */
 static slab_allocator_t slab_allocator_allocator;
 
+/* Allocator for magazines; it doesn't use magazines itself. */
+static slab_allocator_t slab_magazine_allocator;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -194,7 +248,7 @@ static void _calc_slab_size(slab_allocator_t *allocator)
  * Initializes a given allocator using the name and size passed in. 
 */
 static void _allocator_init(slab_allocator_t *allocator, const char *name,
-                            size_t size)
+                            size_t size, long magazines)
 {
 #ifdef SLAB_REDZONE
     /*
@@ -210,14 +264,29 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
 
     allocator->sa_name = name;
     allocator->sa_objsize = size;
-    allocator->sa_slabs = NULL;
+    list_init(&allocator->sa_partial_slabs);
+    list_init(&allocator->sa_full_slabs);
+    list_init(&allocator->sa_empty_slabs);
+    allocator->sa_magazines = magazines;
+    allocator->sa_depot_full = NULL;
+    allocator->sa_depot_empty = NULL;
+    memset(allocator->sa_cpu, 0, sizeof(allocator->sa_cpu));
+    for (size_t i = 0; i < MAX_LAPICS; i++)
+    {
+        spinlock_init(&allocator->sa_cpu[i].sc_lock);
+    }
+    allocator->sa_nslabs = 0;
+    allocator->sa_peak_nslabs = 0;
+    allocator->sa_slab_inuse = 0;
     spinlock_init(&allocator->sa_lock);
     // this will set the fields sa_order and the number of objects per slab
     _calc_slab_size(allocator);
 
     /* Add cache to global cache list. */
+    spinlock_lock(&slab_allocators_lock);
     allocator->sa_next = slab_allocators;
     slab_allocators = allocator;
+    spinlock_unlock(&slab_allocators_lock);
 
     dbg(DBG_MM, "Initialized new slab allocator:\n");
     dbgq(DBG_MM, "  Name:          \"%s\" (0x%p)\n", allocator->sa_name,
@@ -242,15 +311,81 @@ slab_allocator_t *slab_allocator_create(const char *name, size_t size)
         return NULL;
     }
 
-    _allocator_init(allocator, name, size);
+    _allocator_init(allocator, name, size, 1);
     return allocator;
 }
 
+static void _slab_obj_put(slab_allocator_t *allocator, void *obj);
+
+/*
+ * Returns the objects in a list of magazines (linked through m_next) to their
+ * slabs, and frees the magazines.
+ */
+static void _slab_magazines_free(slab_allocator_t *allocator,
+                                 slab_magazine_t *mag)
+{
+    while (mag)
+    {
+        slab_magazine_t *next = mag->m_next;
+        while (mag->m_rounds)
+        {
+            _slab_obj_put(allocator, mag->m_objs[--mag->m_rounds]);
+        }
+        slab_obj_free(&slab_magazine_allocator, mag);
+        mag = next;
+    }
+}
+
 /*
- * Free a given allocator. 
+ * Free a given allocator. All of its objects must have been freed, and no
+ * other core may still be using it.
 */
 void slab_allocator_destroy(slab_allocator_t *allocator)
 {
+    spinlock_lock(&slab_allocators_lock);
+    slab_allocator_t **prev = &slab_allocators;
+    while (*prev != allocator)
+    {
+        KASSERT(*prev);
+        prev = &(*prev)->sa_next;
+    }
+    *prev = allocator->sa_next;
+    spinlock_unlock(&slab_allocators_lock);
+
+    /* Return every core's magazines to the depot, then empty it. */
+    spinlock_lock(&allocator->sa_lock);
+    for (size_t i = 0; i < MAX_LAPICS; i++)
+    {
+        slab_magazine_t **mags[] = {&allocator->sa_cpu[i].sc_loaded,
+                                    &allocator->sa_cpu[i].sc_previous};
+        for (size_t j = 0; j < sizeof(mags) / sizeof(mags[0]); j++)
+        {
+            if (*mags[j])
+            {
+                (*mags[j])->m_next = allocator->sa_depot_full;
+                allocator->sa_depot_full = *mags[j];
+                *mags[j] = NULL;
+            }
+        }
+    }
+    slab_magazine_t *full = allocator->sa_depot_full;
+    slab_magazine_t *empty = allocator->sa_depot_empty;
+    allocator->sa_depot_full = allocator->sa_depot_empty = NULL;
+    spinlock_unlock(&allocator->sa_lock);
+
+    _slab_magazines_free(allocator, full);
+    _slab_magazines_free(allocator, empty);
+
+    KASSERT(list_empty(&allocator->sa_partial_slabs) &&
+            list_empty(&allocator->sa_full_slabs) &&
+            "destroying a slab allocator with live objects");
+    list_iterate(&allocator->sa_empty_slabs, slab, struct slab, s_link)
+    {
+        list_remove(&slab->s_link);
+        page_free_n(slab->s_addr, 1UL << allocator->sa_order);
+        allocator->sa_nslabs--;
+    }
+
     slab_obj_free(&slab_allocator_allocator, allocator);
 }
 
@@ -264,7 +399,7 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
     void *obj;
     struct slab *slab;
 
-    addr = page_alloc_n(1UL << allocator->sa_order);
+    addr = page_alloc_n_noreclaim(1UL << allocator->sa_order);
     if (!addr)
     {
         return 0;
@@ -312,56 +447,262 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
         allocator->sa_name, allocator, slab, 1UL << allocator->sa_order);
 
     /* Place this slab into the cache. */
-    slab->s_next = allocator->sa_slabs;
-    allocator->sa_slabs = slab;
+    list_insert_head(&allocator->sa_empty_slabs, &slab->s_link);
+    if (++allocator->sa_nslabs > allocator->sa_peak_nslabs)
+    {
+        allocator->sa_peak_nslabs = allocator->sa_nslabs;
+    }
 
     return 1;
 }
 
+/* Moves slab onto the list matching its number of allocated objects. */
+static void _slab_relink(slab_allocator_t *allocator, struct slab *slab)
+{
+    list_remove(&slab->s_link);
+    if (!slab->s_inuse)
+    {
+        list_insert_head(&allocator->sa_empty_slabs, &slab->s_link);
+    }
+    else if (slab->s_inuse == allocator->sa_slab_nobjs)
+    {
+        list_insert_head(&allocator->sa_full_slabs, &slab->s_link);
+    }
+    else
+    {
+        list_insert_head(&allocator->sa_partial_slabs, &slab->s_link);
+    }
+}
+
 /*
- * Given an allocator, will allocate an object.  
-*/
-void *slab_obj_alloc(slab_allocator_t *allocator)
+ * Takes an object off a slab, growing the allocator if there are no free
+ * objects. Returns the raw object (including the front red-zone), or NULL.
+ */
+static void *_slab_obj_get(slab_allocator_t *allocator)
 {
-    spinlock_lock(&allocator->sa_lock);
-    struct slab *slab;
-    void *obj;
+    long reclaimed = 0;
 
-    /* Find a slab with a free object. */
-    for (;;)
+    spinlock_lock(&allocator->sa_lock);
+    while (list_empty(&allocator->sa_partial_slabs) &&
+           list_empty(&allocator->sa_empty_slabs) &&
+           !_slab_allocator_grow(allocator))
     {
-        slab = allocator->sa_slabs;
-        while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-            slab = slab->s_next;
-        if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
+        /* Reclaim frees objects back into slab allocators (possibly this
+         * one), so it has to happen without the lock held. */
+        spinlock_unlock(&allocator->sa_lock);
+        size_t npages = 1UL << allocator->sa_order;
+        if (reclaimed || (slab_allocators_reclaim(npages) <= 0 &&
+                          !pageout_reclaim(npages, 0)))
         {
-            break;
-        }
-        if (!_slab_allocator_grow(allocator))
-        {
-            spinlock_unlock(&allocator->sa_lock);
             return NULL;
         }
+        reclaimed = 1;
+        spinlock_lock(&allocator->sa_lock);
     }
 
+    /* Prefer partial slabs, so that empty ones stay empty. */
+    struct slab *slab =
+        !list_empty(&allocator->sa_partial_slabs)
+            ? list_head(&allocator->sa_partial_slabs, struct slab, s_link)
+            : list_head(&allocator->sa_empty_slabs, struct slab, s_link);
+    KASSERT(slab->s_inuse < allocator->sa_slab_nobjs);
+
     /*
      * Remove an object from the slab's free list.  We'll use the
      * free list pointer to store a pointer back to the containing
      * slab.
      */
-    obj = slab->s_free;
+    void *obj = slab->s_free;
     slab->s_free = obj_bufctl(allocator, obj)->sb_next;
     obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-    obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
 
     slab->s_inuse++;
+    allocator->sa_slab_inuse++;
+    _slab_relink(allocator, slab);
 
     dbg(DBG_MM,
         "Allocated object 0x%p from \"%s\" (0x%p), "
         "slab 0x%p, inuse %lu\n",
-        obj, allocator->sa_name, allocator, allocator, slab->s_inuse);
+        obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+    spinlock_unlock(&allocator->sa_lock);
+    return obj;
+}
+
+/* Puts a raw object back on its slab. */
+static void _slab_obj_put(slab_allocator_t *allocator, void *obj)
+{
+    spinlock_lock(&allocator->sa_lock);
+    struct slab *slab = obj_bufctl(allocator, obj)->sb_slab;
+
+    /* Place this object back on the slab's free list. */
+    obj_bufctl(allocator, obj)->sb_next = slab->s_free;
+    slab->s_free = obj;
+
+    slab->s_inuse--;
+    allocator->sa_slab_inuse--;
+    _slab_relink(allocator, slab);
+
+    dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %lu\n",
+        obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+    spinlock_unlock(&allocator->sa_lock);
+}
+
+/* Interrupts must be blocked, so that we stay on this core. */
+static inline slab_cpu_t *_slab_cpu(slab_allocator_t *allocator)
+{
+    KASSERT(curcore.kc_id >= 0 && curcore.kc_id < MAX_LAPICS);
+    return &allocator->sa_cpu[curcore.kc_id];
+}
+
+static inline void _slab_cpu_count(slab_allocator_t *allocator, long alloc)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    slab_cpu_t *cpu = _slab_cpu(allocator);
+    if (alloc)
+    {
+        cpu->sc_allocs++;
+    }
+    else
+    {
+        cpu->sc_frees++;
+    }
+    intr_setipl(ipl);
+}
+
+/* Takes an object from this core's magazines, or returns NULL. */
+static void *_slab_magazine_alloc(slab_allocator_t *allocator)
+{
+    void *obj = NULL;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    slab_cpu_t *cpu = _slab_cpu(allocator);
+    spinlock_lock(&cpu->sc_lock);
+    for (;;)
+    {
+        slab_magazine_t *loaded = cpu->sc_loaded;
+        if (loaded && loaded->m_rounds)
+        {
+            obj = loaded->m_objs[--loaded->m_rounds];
+            break;
+        }
+        if (cpu->sc_previous && cpu->sc_previous->m_rounds)
+        {
+            cpu->sc_loaded = cpu->sc_previous;
+            cpu->sc_previous = loaded;
+            continue;
+        }
+
+        /* Both are empty; exchange the previous one for a full one. */
+        spinlock_lock(&allocator->sa_lock);
+        slab_magazine_t *full = allocator->sa_depot_full;
+        if (full)
+        {
+            allocator->sa_depot_full = full->m_next;
+            if (cpu->sc_previous)
+            {
+                cpu->sc_previous->m_next = allocator->sa_depot_empty;
+                allocator->sa_depot_empty = cpu->sc_previous;
+            }
+            cpu->sc_previous = loaded;
+            cpu->sc_loaded = full;
+        }
+        spinlock_unlock(&allocator->sa_lock);
+        if (!full)
+        {
+            break;
+        }
+    }
+    spinlock_unlock(&cpu->sc_lock);
+    intr_setipl(ipl);
+    return obj;
+}
+
+/* Puts an object in this core's magazines. Returns 0 if there was no room
+ * and no empty magazine could be allocated. */
+static long _slab_magazine_free(slab_allocator_t *allocator, void *obj)
+{
+    long ret = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    slab_cpu_t *cpu = _slab_cpu(allocator);
+    spinlock_lock(&cpu->sc_lock);
+    for (;;)
+    {
+        slab_magazine_t *loaded = cpu->sc_loaded;
+        if (loaded && loaded->m_rounds < SLAB_MAGAZINE_SIZE)
+        {
+            loaded->m_objs[loaded->m_rounds++] = obj;
+            ret = 1;
+            break;
+        }
+        if (cpu->sc_previous && !cpu->sc_previous->m_rounds)
+        {
+            cpu->sc_loaded = cpu->sc_previous;
+            cpu->sc_previous = loaded;
+            continue;
+        }
+
+        /* Both are full; exchange the previous one for an empty one. */
+        spinlock_lock(&allocator->sa_lock);
+        slab_magazine_t *empty = allocator->sa_depot_empty;
+        if (empty)
+        {
+            allocator->sa_depot_empty = empty->m_next;
+            if (cpu->sc_previous)
+            {
+                cpu->sc_previous->m_next = allocator->sa_depot_full;
+                allocator->sa_depot_full = cpu->sc_previous;
+            }
+            cpu->sc_previous = loaded;
+            cpu->sc_loaded = empty;
+        }
+        spinlock_unlock(&allocator->sa_lock);
+        if (empty)
+        {
+            continue;
+        }
+
+        /* The depot has no empty magazines either, so make one. This may
+         * reclaim memory, so do it at the caller's interrupt level, without
+         * sc_lock; we may come back on another core. */
+        spinlock_unlock(&cpu->sc_lock);
+        intr_setipl(ipl);
+        empty = slab_obj_alloc(&slab_magazine_allocator);
+        intr_setipl(IPL_HIGH);
+        cpu = _slab_cpu(allocator);
+        spinlock_lock(&cpu->sc_lock);
+        if (!empty)
+        {
+            break;
+        }
+        empty->m_rounds = 0;
+        spinlock_lock(&allocator->sa_lock);
+        empty->m_next = allocator->sa_depot_empty;
+        allocator->sa_depot_empty = empty;
+        spinlock_unlock(&allocator->sa_lock);
+    }
+    spinlock_unlock(&cpu->sc_lock);
+    intr_setipl(ipl);
+    return ret;
+}
+
+/*
+ * Given an allocator, will allocate an object.  
+*/
+void *slab_obj_alloc(slab_allocator_t *allocator)
+{
+    void *obj = NULL;
+    if (allocator->sa_magazines)
+    {
+        obj = _slab_magazine_alloc(allocator);
+    }
+    if (!obj && !(obj = _slab_obj_get(allocator)))
+    {
+        return NULL;
+    }
+
+#ifdef SLAB_CHECK_FREE
+    KASSERT(obj_bufctl(allocator, obj)->sb_free);
+    obj_bufctl(allocator, obj)->sb_free = 0;
+#endif
 
 #ifdef SLAB_REDZONE
     VERIFY_REDZONES(allocator, obj);
@@ -372,15 +713,13 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
     obj = (void *)((uintptr_t)obj + sizeof(uintptr_t));
 #endif
 
+    _slab_cpu_count(allocator, 1);
     GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
-    spinlock_unlock(&allocator->sa_lock);
     return obj;
 }
 
 void slab_obj_free(slab_allocator_t *allocator, void *obj)
 {
-    spinlock_lock(&allocator->sa_lock);
-    struct slab *slab;
     GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
 #ifdef SLAB_REDZONE
@@ -395,17 +734,129 @@ void slab_obj_free(slab_allocator_t *allocator, void *obj)
     obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
-    slab = obj_bufctl(allocator, obj)->sb_slab;
+    _slab_cpu_count(allocator, 0);
+    if (!allocator->sa_magazines || !_slab_magazine_free(allocator, obj))
+    {
+        _slab_obj_put(allocator, obj);
+    }
+}
 
-    /* Place this object back on the slab's free list. */
-    obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-    slab->s_free = obj;
+size_t slab_allocators_stats(slab_allocator_stats_t *stats, size_t max)
+{
+    size_t count = 0;
+    spinlock_lock(&slab_allocators_lock);
+    for (slab_allocator_t *a = slab_allocators; a; a = a->sa_next, count++)
+    {
+        if (count >= max)
+        {
+            continue;
+        }
+        slab_allocator_stats_t *st = &stats[count];
+        memset(st, 0, sizeof(*st));
+        st->sas_name = a->sa_name;
+        st->sas_objsize = a->sa_objsize;
+
+        /* The per-core counters are read without stopping the other cores,
+         * so the totals can be slightly stale, and are clamped where they
+         * are compared with counters taken under the lock. */
+        for (size_t i = 0; i < MAX_LAPICS; i++)
+        {
+            st->sas_allocs += a->sa_cpu[i].sc_allocs;
+            st->sas_frees += a->sa_cpu[i].sc_frees;
+        }
+        st->sas_inuse = st->sas_allocs > st->sas_frees
+                            ? st->sas_allocs - st->sas_frees
+                            : 0;
+
+        spinlock_lock(&a->sa_lock);
+        st->sas_cached = a->sa_slab_inuse > st->sas_inuse
+                             ? a->sa_slab_inuse - st->sas_inuse
+                             : 0;
+        st->sas_slabs = a->sa_nslabs;
+        st->sas_pages = a->sa_nslabs << a->sa_order;
+        st->sas_peak_pages = a->sa_peak_nslabs << a->sa_order;
+        spinlock_unlock(&a->sa_lock);
+    }
+    spinlock_unlock(&slab_allocators_lock);
+    return count;
+}
 
-    slab->s_inuse--;
+/*
+ * Returns the magazines of every core and the depot to the slab layer, then
+ * frees up to target pages worth of empty slabs (all of them if target is
+ * negative).
+ */
+static size_t _slab_allocator_reclaim(slab_allocator_t *allocator, long target,
+                                      slab_reclaim_stats_t *stats)
+{
+    /* two per core, then the two depot lists */
+    slab_magazine_t *mags[2 * MAX_LAPICS + 2];
+    memset(mags, 0, sizeof(mags));
 
-    dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %lu\n",
-        obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+    if (allocator->sa_magazines)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        for (size_t i = 0; i < MAX_LAPICS; i++)
+        {
+            slab_cpu_t *cpu = &allocator->sa_cpu[i];
+            spinlock_lock(&cpu->sc_lock);
+            mags[2 * i] = cpu->sc_loaded;
+            mags[2 * i + 1] = cpu->sc_previous;
+            cpu->sc_loaded = cpu->sc_previous = NULL;
+            spinlock_unlock(&cpu->sc_lock);
+        }
+        spinlock_lock(&allocator->sa_lock);
+        mags[2 * MAX_LAPICS] = allocator->sa_depot_full;
+        mags[2 * MAX_LAPICS + 1] = allocator->sa_depot_empty;
+        allocator->sa_depot_full = allocator->sa_depot_empty = NULL;
+        spinlock_unlock(&allocator->sa_lock);
+        intr_setipl(ipl);
+    }
+
+    for (size_t i = 0; i < sizeof(mags) / sizeof(mags[0]); i++)
+    {
+        if (i < 2 * MAX_LAPICS && mags[i])
+        {
+            mags[i]->m_next = NULL;
+        }
+        for (slab_magazine_t *mag = mags[i]; mag; mag = mag->m_next)
+        {
+            stats->srs_magazines++;
+        }
+        _slab_magazines_free(allocator, mags[i]);
+    }
+
+    /* Take the slabs off the allocator first; the slab struct lives in the
+     * pages being freed. */
+    list_t slabs;
+    list_init(&slabs);
+    size_t npages = 0;
+    spinlock_lock(&allocator->sa_lock);
+    while ((target < 0 || npages < (size_t)target) &&
+           !list_empty(&allocator->sa_empty_slabs))
+    {
+        struct slab *slab =
+            list_tail(&allocator->sa_empty_slabs, struct slab, s_link);
+        list_remove(&slab->s_link);
+        list_insert_tail(&slabs, &slab->s_link);
+        npages += 1UL << allocator->sa_order;
+        allocator->sa_nslabs--;
+    }
     spinlock_unlock(&allocator->sa_lock);
+
+    list_iterate(&slabs, slab, struct slab, s_link)
+    {
+        list_remove(&slab->s_link);
+        page_free_n(slab->s_addr, 1UL << allocator->sa_order);
+        stats->srs_slabs++;
+    }
+
+    if (npages)
+    {
+        dbg(DBG_MM, "reclaimed %lu pages from \"%s\" (0x%p)\n", npages,
+            allocator->sa_name, allocator);
+    }
+    return npages;
 }
 
 /*
@@ -417,85 +868,166 @@ void slab_obj_free(slab_allocator_t *allocator, void *obj)
  */
 long slab_allocators_reclaim(long target)
 {
-    panic("slab_allocators_reclaim NYI for SMP");
-    // spinlock_lock(&allocator->sa_lock);
-    //     int npages_freed = 0, npages;
-
-    //     slab_allocator_t *a;
-    //     struct slab *s, **prev;
-
-    //     /* Go through all caches */
-    //     for (a = slab_allocators; NULL != a; a = a->sa_next) {
-    //             prev = &(a->sa_slabs);
-    //             s = a->sa_slabs;
-    //             while (NULL != s) {
-    //                     struct slab *next = s->s_next;
-    //                     if (0 == s->s_inuse) {
-    //                             /* Free Slab */
-    //                             (*prev) = next;
-    //                             npages = 1 << a->sa_order;
-
-    //                             page_free_n(s->s_addr, npages);
-    //                             npages_freed += npages;
-    //                     } else {
-    //                             prev = &(s->s_next);
-    //                     }
-    //                     /* Check if target was met */
-    //                     if ((target > 0) && (npages_freed >= target)) {
-    //                             return npages_freed;
-    //                     }
-    //                     s = next;
-    //             }
-    //     }
-    // spinlock_unlock(&allocator->sa_lock);
-    //     return npages_freed;
-}
+    slab_reclaim_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    /* The allocators for magazines and for allocators were created first, so
+     * they come last, after the other allocators have freed their
+     * magazines. */
+    spinlock_lock(&slab_allocators_lock);
+    size_t npages_freed = 0;
+    for (slab_allocator_t *a = slab_allocators; a; a = a->sa_next)
+    {
+        npages_freed += _slab_allocator_reclaim(
+            a, target < 0 ? target : target - (long)npages_freed, &stats);
+        if (target >= 0 && npages_freed >= (size_t)target)
+        {
+            break;
+        }
+    }
 
-#define KMALLOC_SIZE_MIN_ORDER (6)
-#define KMALLOC_SIZE_MAX_ORDER (18)
+    slab_reclaim_totals.srs_calls++;
+    slab_reclaim_totals.srs_pages += npages_freed;
+    slab_reclaim_totals.srs_slabs += stats.srs_slabs;
+    slab_reclaim_totals.srs_magazines += stats.srs_magazines;
+    spinlock_unlock(&slab_allocators_lock);
+
+    return npages_freed;
+}
 
-static slab_allocator_t
-    *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
+void slab_reclaim_stats(slab_reclaim_stats_t *stats)
+{
+    spinlock_lock(&slab_allocators_lock);
+    *stats = slab_reclaim_totals;
+    spinlock_unlock(&slab_allocators_lock);
+}
 
-/* Note that kmalloc_allocator_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+/*
+ * kmalloc size classes: every power of two from 64 bytes to 8K, plus the
+ * three sizes a quarter of the way apart in between, so a request is rounded
+ * up by at most 25% (not counting the allocator header). Must be sorted,
+ * multiples of KMALLOC_SIZE_ALIGN, and end at KMALLOC_MAX_SIZE.
+ *
+ * Requests for a whole number of pages, and anything bigger than the largest
+ * class, skip the slabs and the header entirely and come straight from the
+ * page allocator; see _kmalloc_pages().
  */
-static const char *kmalloc_allocator_names[] = {
-    "size-64", "size-128", "size-256", "size-512", "size-1024",
-    "size-2048", "size-4096", "size-8192", "size-16384", "size-32768",
-    "size-65536", "size-131072", "size-262144"};
+#define KMALLOC_SIZE_ALIGN 16
+#define KMALLOC_MAX_SIZE 8192
 
-void *kmalloc(size_t size)
+#define KMALLOC_CLASS(size) \
+    {                       \
+        size, "size-" #size \
+    }
+
+static const struct
 {
-    size += sizeof(slab_allocator_t *);
+    size_t size;
+    const char *name;
+} kmalloc_classes[] = {
+    KMALLOC_CLASS(64),   KMALLOC_CLASS(80),   KMALLOC_CLASS(96),
+    KMALLOC_CLASS(112),  KMALLOC_CLASS(128),  KMALLOC_CLASS(160),
+    KMALLOC_CLASS(192),  KMALLOC_CLASS(224),  KMALLOC_CLASS(256),
+    KMALLOC_CLASS(320),  KMALLOC_CLASS(384),  KMALLOC_CLASS(448),
+    KMALLOC_CLASS(512),  KMALLOC_CLASS(640),  KMALLOC_CLASS(768),
+    KMALLOC_CLASS(896),  KMALLOC_CLASS(1024), KMALLOC_CLASS(1280),
+    KMALLOC_CLASS(1536), KMALLOC_CLASS(1792), KMALLOC_CLASS(2048),
+    KMALLOC_CLASS(2560), KMALLOC_CLASS(3072), KMALLOC_CLASS(3584),
+    KMALLOC_CLASS(4096), KMALLOC_CLASS(5120), KMALLOC_CLASS(6144),
+    KMALLOC_CLASS(7168), KMALLOC_CLASS(8192)};
+
+#define KMALLOC_NCLASSES (sizeof(kmalloc_classes) / sizeof(kmalloc_classes[0]))
+
+static slab_allocator_t *kmalloc_allocators[KMALLOC_NCLASSES];
+
+/* Maps a size, rounded up to KMALLOC_SIZE_ALIGN and divided by it, to the
+ * index of the smallest class that fits it. Filled in by slab_init. */
+static uint8_t kmalloc_class_index[KMALLOC_MAX_SIZE / KMALLOC_SIZE_ALIGN + 1];
+
+/* Number of pages of each page-backed allocation, keyed by page number. */
+static radix_tree_t kmalloc_pages = RADIX_TREE_INITIALIZER;
+static size_t kmalloc_npages;
+static spinlock_t kmalloc_pages_lock;
+
+static void *_kmalloc_pages(size_t size)
+{
+    size_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+    void *addr = page_alloc_n(npages);
+    if (!addr)
+    {
+        dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+        return NULL;
+    }
 
-    /*
-     * Find the first power of two bucket bigger than the
-     * requested size, and allocate from it.
-     */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
+    spinlock_lock(&kmalloc_pages_lock);
+    long ret = radix_tree_insert(&kmalloc_pages, ADDR_TO_PN(addr),
+                                 (void *)npages);
+    if (!ret)
     {
-        if ((1UL << order) >= size)
-        {
-            void *addr = slab_obj_alloc(*cs);
-            if (!addr)
-            {
-                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                return NULL;
-            }
+        kmalloc_npages += npages;
+    }
+    spinlock_unlock(&kmalloc_pages_lock);
+    if (ret)
+    {
+        page_free_n(addr, npages);
+        return NULL;
+    }
 #ifdef MM_POISON
-            memset(addr, MM_POISON_ALLOC, size);
+    memset(addr, MM_POISON_ALLOC, npages << PAGE_SHIFT);
 #endif /* MM_POISON */
-            *((slab_allocator_t **)addr) = *cs;
-            return (void *)(((slab_allocator_t **)addr) + 1);
-        }
+    return addr;
+}
+
+/* Frees addr if it is a page-backed allocation. Returns 0 if it is not, which
+ * a page-aligned address may still be: depending on SLAB_REDZONE and
+ * SLAB_CHECK_FREE, some slab objects end up page aligned after the header. */
+static long _kfree_pages(void *addr)
+{
+    if (!PAGE_ALIGNED(addr))
+    {
+        return 0;
+    }
+    spinlock_lock(&kmalloc_pages_lock);
+    size_t npages = (size_t)radix_tree_remove(&kmalloc_pages, ADDR_TO_PN(addr));
+    kmalloc_npages -= npages;
+    spinlock_unlock(&kmalloc_pages_lock);
+    if (!npages)
+    {
+        return 0;
+    }
+#ifdef MM_POISON
+    memset(addr, MM_POISON_FREE, npages << PAGE_SHIFT);
+#endif /* MM_POISON */
+    page_free_n(addr, npages);
+    return 1;
+}
+
+void *kmalloc(size_t size)
+{
+    if ((size && PAGE_ALIGNED(size)) ||
+        size + sizeof(slab_allocator_t *) > KMALLOC_MAX_SIZE)
+    {
+        return _kmalloc_pages(size);
     }
 
-    panic("size bigger than maxorder %ld\n", size);
+    size += sizeof(slab_allocator_t *);
+    size_t class = (size + KMALLOC_SIZE_ALIGN - 1) / KMALLOC_SIZE_ALIGN;
+    slab_allocator_t *sa = kmalloc_allocators[kmalloc_class_index[class]];
+    void *addr = slab_obj_alloc(sa);
+    if (!addr)
+    {
+        dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+        return NULL;
+    }
+#ifdef MM_POISON
+    memset(addr, MM_POISON_ALLOC, size);
+#endif /* MM_POISON */
+    *((slab_allocator_t **)addr) = sa;
+    return (void *)(((slab_allocator_t **)addr) + 1);
 }
 
+size_t kmalloc_page_count() { return kmalloc_npages; }
+
 __attribute__((used)) static void *malloc(size_t size)
 {
     /* This function is used by gdb to allocate memory
@@ -506,6 +1038,11 @@ __attribute__((used)) static void *malloc(size_t size)
 
 void kfree(void *addr)
 {
+    if (_kfree_pages(addr))
+    {
+        return;
+    }
+
     addr = (void *)(((slab_allocator_t **)addr) - 1);
     slab_allocator_t *sa = *(slab_allocator_t **)addr;
 
@@ -533,25 +1070,33 @@ __attribute__((used)) static void free(void *addr)
 
 void slab_init()
 {
+    spinlock_init(&slab_allocators_lock);
+
     /* Special case initialization of the allocator for `slab_allocator_t`s */
     /* In other words, initializes a slab allocator for other slab allocators. */
     _allocator_init(&slab_allocator_allocator, "slab_allocators",
-                    sizeof(slab_allocator_t));
+                    sizeof(slab_allocator_t), 0);
+    _allocator_init(&slab_magazine_allocator, "slab_magazines",
+                    sizeof(slab_magazine_t), 0);
 
     /*
-     * Allocate the power of two buckets for generic
-     * kmalloc/kfree.
+     * Allocate the size classes for generic kmalloc/kfree, and fill in the
+     * size to class table.
      */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
-    {
-        if (NULL ==
-            (*cs = slab_allocator_create(
-                 kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER],
-                 (1UL << order))))
+    spinlock_init(&kmalloc_pages_lock);
+    size_t class = 0;
+    for (size_t i = 0; i < KMALLOC_NCLASSES; i++)
+    {
+        KASSERT(!(kmalloc_classes[i].size % KMALLOC_SIZE_ALIGN));
+        if (NULL == (kmalloc_allocators[i] = slab_allocator_create(
+                         kmalloc_classes[i].name, kmalloc_classes[i].size)))
         {
             panic("Couldn't create kmalloc allocators!\n");
         }
+        for (; class * KMALLOC_SIZE_ALIGN <= kmalloc_classes[i].size; class++)
+        {
+            kmalloc_class_index[class] = (uint8_t)i;
+        }
     }
+    KASSERT(class == sizeof(kmalloc_class_index));
 }
@@ -0,0 +1,301 @@
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+
+#include "util/debug.h"
+
+/* CR4 bit that enables process-context identifiers */
+#define CR4_PCIDE (1UL << 17)
+
+/* Set in the value loaded into CR3 to keep the TLB entries of the PCID */
+#define CR3_NOFLUSH (1UL << 63)
+
+/*
+ * The TLB state of a core. With PCIDs, PCID i + 1 holds the entries of
+ * tc_owner[i] (PCID 0 is what the core booted with, before tlb_init()), and
+ * slots are handed out round robin. Only touched by the core itself, with
+ * interrupts masked, except that other cores read it (racily, but see
+ * tlb_shootdown_remote()) to decide whether to send it a shootdown.
+ */
+typedef struct tlb_cpu
+{
+    pml4_t *tc_current;
+    pml4_t *tc_owner[TLB_NPCIDS];
+    size_t tc_next;
+    tlb_stats_t tc_stats;
+} tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpu CORE_SPECIFIC_DATA;
+
+#ifdef __SMP__
+/*
+ * The shootdown under way, if any. Each core whose bit is set in tr_pending
+ * still has to do tr_batch; the sender waits for them all, then releases
+ * tr_busy for the next one.
+ */
+static struct
+{
+    volatile long tr_busy;
+    const tlb_batch_t *volatile tr_batch;
+    volatile uint64_t tr_pending;
+} tlb_request;
+
+static long tlb_shootdown_intr(regs_t *regs);
+#endif
+
+void tlb_init()
+{
+    tlb_cpu_t *tc = &tlb_cpu;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    if (ecx & CPUID_FEAT_ECX_PCID)
+    {
+        /* PCIDE can only be set while the current PCID is 0, which it is until
+         * the first tlb_load() */
+        uintptr_t cr4;
+        __asm__ volatile("movq %%cr4, %0"
+                         : "=r"(cr4));
+        __asm__ volatile("movq %0, %%cr4" ::"r"(cr4 | CR4_PCIDE)
+                         : "memory");
+        tc->tc_stats.ts_pcid = 1;
+    }
+    tc->tc_current = pt_get();
+    dbg(DBG_CORE, "TLB: %s PCIDs\n", tc->tc_stats.ts_pcid ? "using" : "no");
+
+#ifdef __SMP__
+    intr_register(INTR_TLB_SHOOTDOWN, tlb_shootdown_intr);
+#endif
+}
+
+void tlb_load(pml4_t *pml4)
+{
+    KASSERT((void *)pml4 >= physmap_start());
+    tlb_cpu_t *tc = &tlb_cpu;
+    uintptr_t cr3 = pt_virt_to_phys((uintptr_t)pml4);
+
+    uint8_t ipl = intr_setipl(IPL_HIGHEST);
+    tc->tc_current = pml4;
+    tc->tc_stats.ts_loads++;
+    if (tc->tc_stats.ts_pcid)
+    {
+        size_t slot = 0;
+        while (slot < TLB_NPCIDS && tc->tc_owner[slot] != pml4)
+        {
+            slot++;
+        }
+        if (slot < TLB_NPCIDS)
+        {
+            cr3 |= (slot + 1) | CR3_NOFLUSH;
+            tc->tc_stats.ts_pcid_hits++;
+        }
+        else
+        {
+            /* loading without CR3_NOFLUSH throws out what the previous owner
+             * of the slot left behind */
+            slot = tc->tc_next;
+            tc->tc_next = (slot + 1) % TLB_NPCIDS;
+            tc->tc_owner[slot] = pml4;
+            cr3 |= slot + 1;
+        }
+    }
+    __asm__ volatile("movq %0, %%cr3" ::"r"(cr3)
+                     : "memory");
+    intr_setipl(ipl);
+}
+
+/* Does tb on this core. Called with interrupts masked. */
+static void tlb_invalidate_local(tlb_cpu_t *tc, const tlb_batch_t *tb)
+{
+    if (tb->tb_pml4 == tc->tc_current)
+    {
+        if (tb->tb_npages > TLB_FLUSH_ALL_THRESHOLD)
+        {
+            tlb_flush_all();
+            tc->tc_stats.ts_full++;
+        }
+        else
+        {
+            for (size_t i = 0; i < tb->tb_nranges; i++)
+            {
+                tlb_flush_range(tb->tb_vaddr[i], tb->tb_count[i]);
+            }
+            tc->tc_stats.ts_pages += tb->tb_npages;
+        }
+        return;
+    }
+    for (size_t slot = 0; slot < TLB_NPCIDS; slot++)
+    {
+        if (tc->tc_owner[slot] == tb->tb_pml4)
+        {
+            tc->tc_owner[slot] = NULL;
+            tc->tc_stats.ts_dropped++;
+        }
+    }
+}
+
+#ifdef __SMP__
+/* Does this core's part of the shootdown under way, if it has one. Called with
+ * interrupts masked. */
+static void tlb_request_poll(tlb_cpu_t *tc)
+{
+    uint64_t bit = 1UL << curcore.kc_id;
+    if (tlb_request.tr_pending & bit)
+    {
+        tlb_invalidate_local(tc, tlb_request.tr_batch);
+        __sync_fetch_and_and(&tlb_request.tr_pending, ~bit);
+    }
+}
+
+static long tlb_shootdown_intr(regs_t *regs)
+{
+    tlb_request_poll(&tlb_cpu);
+    return 0;
+}
+
+static long tlb_core_may_cache(long core, pml4_t *pml4)
+{
+    tlb_cpu_t *tc = GET_CSD(core, tlb_cpu_t, tlb_cpu);
+    if (tc->tc_current == pml4)
+    {
+        return 1;
+    }
+    for (size_t slot = 0; slot < TLB_NPCIDS; slot++)
+    {
+        if (tc->tc_owner[slot] == pml4)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sends tb to the other cores that may have TLB entries for its address space,
+ * and waits until they have all done it. A core that has just started loading
+ * the address space doesn't need it: the entries it picks up come from the page
+ * table as it is now, and a PCID it takes over is flushed on the way in.
+ *
+ * Called with interrupts masked, so while waiting for its turn a core keeps
+ * doing its share of the shootdown in progress itself, or the sender would wait
+ * for it forever.
+ */
+static void tlb_shootdown_remote(tlb_cpu_t *tc, const tlb_batch_t *tb)
+{
+    while (!__sync_bool_compare_and_swap(&tlb_request.tr_busy, 0, 1))
+    {
+        tlb_request_poll(tc);
+        __asm__ volatile("pause");
+    }
+
+    uint64_t targets = 0;
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (core != curcore.kc_id && csd_vaddr_table[core] &&
+            tlb_core_may_cache(core, tb->tb_pml4))
+        {
+            targets |= 1UL << core;
+        }
+    }
+    if (targets)
+    {
+        tlb_request.tr_batch = tb;
+        __sync_fetch_and_or(&tlb_request.tr_pending, targets);
+        for (long core = 0; core < MAX_LAPICS; core++)
+        {
+            if (targets & (1UL << core))
+            {
+                apic_send_ipi(core, DESTINATION_MODE_FIXED,
+                              INTR_TLB_SHOOTDOWN);
+                tc->tc_stats.ts_ipis++;
+            }
+        }
+        while (tlb_request.tr_pending)
+        {
+            __asm__ volatile("pause");
+        }
+        tlb_request.tr_batch = NULL;
+    }
+    __sync_lock_release(&tlb_request.tr_busy);
+}
+#endif
+
+void tlb_shootdown(pml4_t *pml4, uintptr_t vaddr, size_t npages)
+{
+    tlb_batch_t tb;
+    tlb_batch_init(&tb, pml4);
+    tlb_batch_add(&tb, vaddr, npages);
+    tlb_batch_flush(&tb);
+}
+
+void tlb_batch_init(tlb_batch_t *tb, pml4_t *pml4)
+{
+    tb->tb_pml4 = pml4;
+    tb->tb_npages = 0;
+    tb->tb_nranges = 0;
+}
+
+void tlb_batch_add(tlb_batch_t *tb, uintptr_t vaddr, size_t npages)
+{
+    /* nothing more to keep track of once everything will be flushed */
+    if (!tb->tb_pml4 || !npages || tb->tb_npages > TLB_FLUSH_ALL_THRESHOLD)
+    {
+        return;
+    }
+    if (npages > TLB_FLUSH_ALL_THRESHOLD ||
+        tb->tb_npages + npages > TLB_FLUSH_ALL_THRESHOLD)
+    {
+        tb->tb_npages = TLB_SHOOTDOWN_ALL;
+        return;
+    }
+
+    size_t last = tb->tb_nranges - 1;
+    if (tb->tb_nranges &&
+        tb->tb_vaddr[last] + tb->tb_count[last] * PAGE_SIZE == vaddr)
+    {
+        tb->tb_count[last] += npages;
+    }
+    else if (tb->tb_nranges < TLB_BATCH_RANGES)
+    {
+        tb->tb_vaddr[tb->tb_nranges] = vaddr;
+        tb->tb_count[tb->tb_nranges++] = npages;
+    }
+    else
+    {
+        tb->tb_npages = TLB_SHOOTDOWN_ALL;
+        return;
+    }
+    tb->tb_npages += npages;
+}
+
+void tlb_batch_flush(tlb_batch_t *tb)
+{
+    if (!tb->tb_pml4 || !tb->tb_npages)
+    {
+        return;
+    }
+    /* the page table changes must be visible before anyone is told */
+    __sync_synchronize();
+
+    uint8_t ipl = intr_setipl(IPL_HIGHEST);
+    tlb_invalidate_local(&tlb_cpu, tb);
+#ifdef __SMP__
+    tlb_shootdown_remote(&tlb_cpu, tb);
+#endif
+    intr_setipl(ipl);
+
+    tb->tb_npages = 0;
+    tb->tb_nranges = 0;
+}
+
+void tlb_stats(tlb_stats_t *stats)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGHEST);
+    *stats = tlb_cpu.tc_stats;
+    intr_setipl(ipl);
+}
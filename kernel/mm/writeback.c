@@ -0,0 +1,398 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "mm/mobj.h"
+#include "mm/pframe.h"
+#include "mm/writeback.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/*
+ * Lock ordering: the writeback lock is only ever held to update the counters
+ * or the list of dirty mobjs, never while locking a mobj or pframe. A mobj's
+ * own dirty list and mo_ndirty are protected by its mo_mutex.
+ */
+static spinlock_t writeback_lock;
+static list_t writeback_mobjs;
+static size_t writeback_nmobjs;
+static size_t writeback_ndirty;
+static size_t writeback_nkept;
+
+static ktqueue_t writeback_waitq;
+static timer_t writeback_timer;
+
+/* Writers waiting in writeback_throttle(), and how many frames the writeback
+ * thread's last run wrote back */
+static ktqueue_t writeback_throttleq;
+static size_t writeback_progress;
+
+static writeback_stats_t writeback_totals;
+
+void writeback_init()
+{
+    spinlock_init(&writeback_lock);
+    list_init(&writeback_mobjs);
+    writeback_nmobjs = 0;
+    writeback_ndirty = 0;
+    writeback_nkept = 0;
+    sched_queue_init(&writeback_waitq);
+    sched_queue_init(&writeback_throttleq);
+}
+
+void writeback_mark_dirty(pframe_t *pf)
+{
+    mobj_t *o = pf->pf_obj;
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pf->pf_dirty = 1;
+    if (!mobj_has_backing_store(o))
+    {
+        return;
+    }
+
+    /* A kept frame is dirty as of now, like any other. */
+    long kept = pf->pf_kept_dirty;
+    if (kept)
+    {
+        list_remove(&pf->pf_dirty_link);
+        pf->pf_kept_dirty = 0;
+    }
+    else if (list_link_is_linked(&pf->pf_dirty_link))
+    {
+        return;
+    }
+
+    pf->pf_dirtied = jiffies;
+    list_insert_tail(&o->mo_dirty, &pf->pf_dirty_link);
+    spinlock_lock(&writeback_lock);
+    if (kept)
+    {
+        writeback_nkept--;
+    }
+    else if (!o->mo_ndirty++)
+    {
+        list_insert_tail(&writeback_mobjs, &o->mo_dirty_link);
+        writeback_nmobjs++;
+    }
+    long background = ++writeback_ndirty > WRITEBACK_DIRTY_BACKGROUND;
+    spinlock_unlock(&writeback_lock);
+
+    if (background)
+    {
+        sched_wakeup_on(&writeback_waitq, NULL);
+    }
+}
+
+void writeback_mark_clean(pframe_t *pf)
+{
+    mobj_t *o = pf->pf_obj;
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pf->pf_dirty = 0;
+    if (!list_link_is_linked(&pf->pf_dirty_link))
+    {
+        return;
+    }
+
+    list_remove(&pf->pf_dirty_link);
+    spinlock_lock(&writeback_lock);
+    if (!--o->mo_ndirty)
+    {
+        list_remove(&o->mo_dirty_link);
+        writeback_nmobjs--;
+    }
+    if (pf->pf_kept_dirty)
+    {
+        writeback_nkept--;
+    }
+    else
+    {
+        writeback_ndirty--;
+    }
+    spinlock_unlock(&writeback_lock);
+    pf->pf_kept_dirty = 0;
+}
+
+/*
+ * A frame that is mapped into a user address space may be mapped writable,
+ * and user writes through that mapping don't fault, so they can't mark it
+ * dirty again. There is no reverse map to write-protect its mappings with, so
+ * a mapped frame of an object with a backing store is kept dirty once written
+ * back; every sync writes it out again. It no longer counts as dirty for the
+ * background and throttling limits, though, since writing it back doesn't
+ * make it clean.
+ */
+void writeback_mark_written(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (!pf->pf_mapped || !mobj_has_backing_store(pf->pf_obj))
+    {
+        writeback_mark_clean(pf);
+        return;
+    }
+    KASSERT(list_link_is_linked(&pf->pf_dirty_link));
+    if (!pf->pf_kept_dirty)
+    {
+        pf->pf_kept_dirty = 1;
+        spinlock_lock(&writeback_lock);
+        writeback_ndirty--;
+        writeback_nkept++;
+        spinlock_unlock(&writeback_lock);
+    }
+}
+
+/* Sorts n frames by page number. n is small, and the frames are usually
+ * nearly sorted already, so insertion sort does. */
+static void _writeback_sort(pframe_t **pfs, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        pframe_t *pf = pfs[i];
+        size_t j = i;
+        while (j && pfs[j - 1]->pf_pagenum > pf->pf_pagenum)
+        {
+            pfs[j] = pfs[j - 1];
+            j--;
+        }
+        pfs[j] = pf;
+    }
+}
+
+/*
+ * Takes the oldest WRITEBACK_GATHER dirty frames at a time, sorts them, and
+ * flushes each run of consecutive page numbers together. Only the first frame
+ * of a run is waited for; the run ends early at a frame that someone else has
+ * locked, which then starts the next one.
+ *
+ * Frames that fail to flush, and mapped frames kept dirty after they are
+ * written back, stay on the dirty list. Nobody else can change the list while
+ * o is locked, and only gathered frames come off it, so the first frame not
+ * gathered yet is still linked after a batch, and the next batch starts there.
+ */
+long writeback_flush_mobj(mobj_t *o, uint64_t dirtied_before, size_t max,
+                          long skip_kept, size_t *nwritten)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pframe_t *pfs[WRITEBACK_GATHER];
+    list_link_t *next = o->mo_dirty.l_next;
+    size_t written = 0;
+    size_t nruns = 0;
+    long ret = 0;
+    while (written < max)
+    {
+        size_t n = 0;
+        for (; next != &o->mo_dirty; next = next->l_next)
+        {
+            pframe_t *pf = list_item(next, pframe_t, pf_dirty_link);
+            if (n == WRITEBACK_GATHER || written + n >= max ||
+                pf->pf_dirtied > dirtied_before)
+            {
+                break;
+            }
+            /* pf_mapped is only a hint without pf's mutex; a kept frame
+             * that was unmapped meanwhile just waits for the next pass */
+            if (!skip_kept || !pf->pf_kept_dirty || !pf->pf_mapped)
+            {
+                pfs[n++] = pf;
+            }
+        }
+        if (!n)
+        {
+            break;
+        }
+        _writeback_sort(pfs, n);
+
+        for (size_t i = 0; i < n;)
+        {
+            kmutex_lock(&pfs[i]->pf_mutex);
+            size_t run = 1;
+            while (i + run < n &&
+                   pfs[i + run]->pf_pagenum == pfs[i]->pf_pagenum + run &&
+                   kmutex_trylock(&pfs[i + run]->pf_mutex))
+            {
+                run++;
+            }
+            long err = mobj_flush_pframes(o, &pfs[i], run);
+            if (err && !ret)
+            {
+                ret = err;
+            }
+            nruns += !err;
+            for (size_t j = 0; j < run; j++)
+            {
+                if (!err || !list_link_is_linked(&pfs[i + j]->pf_dirty_link))
+                {
+                    written++;
+                }
+                pframe_release(&pfs[i + j]);
+            }
+            i += run;
+        }
+    }
+
+    spinlock_lock(&writeback_lock);
+    writeback_totals.wbs_runs += nruns;
+    spinlock_unlock(&writeback_lock);
+    if (nwritten)
+    {
+        *nwritten = written;
+    }
+    return ret;
+}
+
+/*
+ * Writes back up to max of o's dirty frames that are old enough, leaving out
+ * mapped kept frames if skip_kept is set. Frames that fail to flush stay dirty,
+ * and make *errp nonzero.
+ */
+static size_t _writeback_mobj(mobj_t *o, uint64_t dirtied_before, size_t max,
+                              long skip_kept, long *errp)
+{
+    size_t nwritten;
+    mobj_lock(o);
+    *errp |= writeback_flush_mobj(o, dirtied_before, max, skip_kept,
+                                  &nwritten);
+    mobj_unlock(o);
+    return nwritten;
+}
+
+/*
+ * Visits each mobj that was dirty when the pass started once, rotating it to
+ * the tail of the list so that no single object starves the others.
+ */
+static size_t _writeback_pass(uint64_t dirtied_before, size_t max,
+                              long skip_kept, long *errp)
+{
+    size_t nwritten = 0;
+    spinlock_lock(&writeback_lock);
+    size_t nmobjs = writeback_nmobjs;
+    while (nmobjs-- && !list_empty(&writeback_mobjs))
+    {
+        mobj_t *o = list_head(&writeback_mobjs, mobj_t, mo_dirty_link);
+        list_remove(&o->mo_dirty_link);
+        list_insert_tail(&writeback_mobjs, &o->mo_dirty_link);
+
+        /* A mobj with no references left is being torn down by its
+         * destructor, which will flush its frames itself. Its last
+         * reference can be dropped on another core at any time, so check
+         * and take ours in one step; the mobj can't be freed before its
+         * frames come off the list, which needs writeback_lock. */
+        if (!atomic_inc_not_zero(&o->mo_refcount))
+        {
+            continue;
+        }
+        spinlock_unlock(&writeback_lock);
+
+        nwritten += _writeback_mobj(o, dirtied_before, max, skip_kept, errp);
+        mobj_put(&o);
+
+        spinlock_lock(&writeback_lock);
+    }
+    spinlock_unlock(&writeback_lock);
+    return nwritten;
+}
+
+long writeback_sync()
+{
+    long err = 0;
+    size_t nwritten = _writeback_pass((uint64_t)-1, (size_t)-1, 0, &err);
+
+    spinlock_lock(&writeback_lock);
+    writeback_totals.wbs_syncs++;
+    writeback_totals.wbs_synced += nwritten;
+    spinlock_unlock(&writeback_lock);
+
+    dbg(DBG_MM, "sync wrote back %lu frames\n", nwritten);
+    return err;
+}
+
+void writeback_throttle()
+{
+    spinlock_lock(&writeback_lock);
+    if (writeback_ndirty > WRITEBACK_DIRTY_LIMIT)
+    {
+        writeback_totals.wbs_throttled++;
+    }
+    while (writeback_ndirty > WRITEBACK_DIRTY_LIMIT)
+    {
+        sched_wakeup_on(&writeback_waitq, NULL);
+        sched_sleep_on(&writeback_throttleq, &writeback_lock);
+        spinlock_lock(&writeback_lock);
+        if (!writeback_progress)
+        {
+            /* The backing store isn't taking the writes; don't wait on it
+             * forever. */
+            break;
+        }
+    }
+    spinlock_unlock(&writeback_lock);
+}
+
+static void writeback_timer_fire(uint64_t data)
+{
+    sched_wakeup_on(&writeback_waitq, NULL);
+}
+
+static void *writeback_run(long arg1, void *arg2)
+{
+    uint64_t expire = time_ms_to_jiffies(WRITEBACK_EXPIRE_MS);
+    while (1)
+    {
+        writeback_timer.expires =
+            jiffies + time_ms_to_jiffies(WRITEBACK_INTERVAL_MS);
+        timer_add(&writeback_timer);
+        sched_sleep_on(&writeback_waitq, NULL);
+
+        long err = 0;
+        uint64_t now = jiffies;
+        size_t nwritten = _writeback_pass(now > expire ? now - expire : 0,
+                                          WRITEBACK_BATCH, 1, &err);
+        size_t n = 1;
+        while (n && writeback_ndirty > WRITEBACK_DIRTY_BACKGROUND)
+        {
+            n = _writeback_pass((uint64_t)-1, WRITEBACK_BATCH, 1, &err);
+            nwritten += n;
+        }
+
+        spinlock_lock(&writeback_lock);
+        writeback_totals.wbs_wakeups++;
+        writeback_totals.wbs_written += nwritten;
+        writeback_progress = nwritten;
+        sched_broadcast_on(&writeback_throttleq);
+        spinlock_unlock(&writeback_lock);
+
+        if (nwritten || err)
+        {
+            dbg(DBG_MM, "writeback wrote %lu frames (error %ld)\n", nwritten,
+                err);
+        }
+    }
+    return NULL;
+}
+
+void writeback_stats(writeback_stats_t *stats)
+{
+    spinlock_lock(&writeback_lock);
+    *stats = writeback_totals;
+    stats->wbs_dirty = writeback_ndirty;
+    stats->wbs_kept = writeback_nkept;
+    stats->wbs_mobjs = writeback_nmobjs;
+    spinlock_unlock(&writeback_lock);
+}
+
+void writeback_thread_init()
+{
+    timer_init(&writeback_timer);
+    writeback_timer.function = writeback_timer_fire;
+    writeback_timer.data = 0;
+
+    kthread_t *thr = kthread_create(&idleproc, writeback_run, 0, NULL);
+    KASSERT(thr && "failed to create the writeback thread");
+    sched_make_runnable(thr);
+}
@@ -6,6 +6,8 @@
 #include "main/apic.h"
 #include "main/gdt.h"
 
+#include "mm/tlb.h"
+
 typedef struct context_initial_func_args
 {
     context_func_t func;
@@ -73,17 +75,18 @@ void context_setup(context_t *c, context_func_t func, long arg1, void *arg2,
 
 /*
  * WARNING!! POTENTIAL EDITOR BEWARE!!
- * IF YOU REMOVE THE PT_SET CALLS BELOW,
+ * IF YOU REPLACE THE TLB_LOAD CALLS BELOW,
  * YOU ***MUST*** DEAL WITH SMP TLB SHOOTDOWN
  *
- * IN OTHER WORDS, THINK *VERY* CAREFULLY BEFORE
- * REMOVING THE CALLS TO PT_SET BELOW
+ * tlb_shootdown() finds the cores that may have TLB entries for an address
+ * space by what tlb_load() recorded, so page tables must never be switched
+ * any other way.
  */
 
 void context_make_active(context_t *c)
 {
     // gdt_set_kernel_stack((void *)((uintptr_t)c->c_kstack + c->c_kstacksz));
-    pt_set(c->c_pml4);
+    tlb_load(c->c_pml4);
 
     /* Switch stacks and run the thread */
     __asm__ volatile(
@@ -109,7 +112,7 @@ void context_switch(context_t *oldc, context_t *newc)
         pt_virt_to_phys_helper(newc->c_pml4, (uintptr_t)&curthr);
 
     kthread_t *prev_curthr = curthr; // Store the current thread
-    pt_set(newc->c_pml4);
+    tlb_load(newc->c_pml4);
     KASSERT(pt_get() == newc->c_pml4);
 
     KASSERT(curthr_paddr == new_curthr_paddr);
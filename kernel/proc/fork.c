@@ -31,6 +31,31 @@ static uintptr_t fork_setup_stack(const regs_t *regs, void *kstack)
     return rsp;
 }
 
+/* Clones curthr into child, set up to return 0 from the system call in
+ * userland. Returns the new thread, or NULL if there is no memory for it. */
+static kthread_t *fork_clone_thread(proc_t *child_proc, regs_t *regs)
+{
+    kthread_t *new_thr=kthread_clone(curthr);
+    if(new_thr==NULL){
+        return NULL;
+    }
+    list_insert_tail(&child_proc->p_threads,&new_thr->kt_plink);
+    new_thr->kt_proc=child_proc;
+
+    regs->r_rax=0;  // Set return value to 0 before copying to child process's stack 
+
+    // Instruction pointer should point to userland_entry
+    // new_thr->kt_ctx.c_kstack=(uintptr_t)new_thr->kt_kstack;
+    // new_thr->kt_ctx.c_kstacksz=DEFAULT_STACK_SIZE;
+    new_thr->kt_ctx.c_rip=(uintptr_t)userland_entry;
+
+    new_thr->kt_ctx.c_pml4=child_proc->p_pml4;
+
+    new_thr->kt_ctx.c_rsp=fork_setup_stack(regs,new_thr->kt_kstack);
+    // regs->r_rax=child_proc->p_pid;  // Set the regs return value to child process's return ID
+    return new_thr;
+}
+
 /*
  * This function implements the fork(2) system call.
  *
@@ -50,8 +75,10 @@ static uintptr_t fork_setup_stack(const regs_t *regs, void *kstack)
  *    c) Before the process begins execution in userland_entry, 
  *       we need to push all registers onto the kernel stack of the kthread. 
  *       Use fork_setup_stack to do this, and set RSP accordingly. 
- *    d) Use pt_unmap_range and tlb_flush_all on the parent in advance of
- *       copy-on-write.
+ *    d) In advance of copy-on-write, use pt_write_protect_range on the
+ *       parent's private areas and tlb_shootdown_all. Their pages stay mapped,
+ *       so only the ones the parent writes to fault into its new shadow
+ *       objects.
  * 5) Prepare the child process to be run on the CPU.
  * 6) Return the child's process id to the parent.
  */
@@ -64,30 +91,25 @@ long do_fork(struct regs *regs)
         return -1;
     }
   
-    kthread_t *new_thr=kthread_clone(curthr);
+    kthread_t *new_thr=fork_clone_thread(child_proc,regs);
     if(new_thr==NULL){
         proc_destroy(child_proc);    
         curthr->kt_errno=ENOMEM;
         return -1;
     }
-    list_insert_tail(&child_proc->p_threads,&new_thr->kt_plink);
-    new_thr->kt_proc=child_proc;
-
-    regs->r_rax=0;  // Set return value to 0 before copying to child process's stack 
 
-    // Instruction pointer should point to userland_entry
-    // new_thr->kt_ctx.c_kstack=(uintptr_t)new_thr->kt_kstack;
-    // new_thr->kt_ctx.c_kstacksz=DEFAULT_STACK_SIZE;
-    new_thr->kt_ctx.c_rip=(uintptr_t)userland_entry;
-
-    new_thr->kt_ctx.c_pml4=child_proc->p_pml4;
-
-    new_thr->kt_ctx.c_rsp=fork_setup_stack(regs,new_thr->kt_kstack);
-    // regs->r_rax=child_proc->p_pid;  // Set the regs return value to child process's return ID
-
-    // Use them at parent
-    pt_unmap_range(curproc->p_pml4,USER_MEM_LOW,USER_MEM_HIGH);
-    tlb_flush_all();
+    // Use them at parent: vmmap_clone gave each private area a new shadow
+    // object, so its pages can still be read where they are, but a write must
+    // fault and get a copy of its own
+    size_t nprotected=0;
+    list_iterate(&curproc->p_vmmap->vmm_list,vma,vmarea_t,vma_plink){
+        if(!(vma->vma_flags&MAP_SHARED)&&vma->vma_end>vma->vma_start){
+            nprotected+=pt_write_protect_range(curproc->p_pml4,(uintptr_t)PN_TO_ADDR(vma->vma_start),
+                (uintptr_t)PN_TO_ADDR(vma->vma_end));
+        }
+    }
+    dbg(DBG_VM,"fork write-protected %lu pages in the parent\n",nprotected);
+    tlb_shootdown_all(curproc->p_pml4);
 
     sched_make_runnable(new_thr);   // Make the child process's thread runable
 
@@ -95,3 +117,43 @@ long do_fork(struct regs *regs)
     return child_proc->p_pid;
     // return -1;
 }
+
+/*
+ * This function implements the vfork(2) system call, for a child that is
+ * going to exec (or exit) right away, as the shell's children do. Instead of
+ * cloning the vmmap, giving every private area a shadow object and
+ * write-protecting the parent's pages, only for the child to throw it all away
+ * in exec, the child runs in the parent's address space, on the parent's
+ * page table. Its writes to memory are the parent's, so the parent sleeps until
+ * the child has let go of the address space (see proc_vfork_release()); until
+ * then the child's user stack is the parent's too, which is why the libc stub
+ * keeps its return address in a register across the trap.
+ */
+long do_vfork(struct regs *regs)
+{
+    proc_t* child_proc=proc_create_vfork("new_process");
+    if(child_proc==NULL){
+        return -ENOMEM;
+    }
+
+    kthread_t *new_thr=fork_clone_thread(child_proc,regs);
+    if(new_thr==NULL){
+        proc_destroy(child_proc);
+        return -ENOMEM;
+    }
+
+    pid_t pid=child_proc->p_pid;
+    sched_make_runnable(new_thr);
+
+    // The child can't be reaped before we wait for it, so it is safe to look at.
+    // It clears p_vfork_parent under our p_children_lock, so it can't wake us
+    // between the test and the sleep
+    spinlock_lock(&curproc->p_children_lock);
+    while(child_proc->p_vfork_parent){
+        sched_sleep_on(&child_proc->p_vfork_wait,&curproc->p_children_lock);
+        spinlock_lock(&curproc->p_children_lock);
+    }
+    spinlock_unlock(&curproc->p_children_lock);
+    dbg(DBG_PROC,"P%d has given back the address space of P%d\n",pid,curproc->p_pid);
+    return pid;
+}
@@ -81,6 +81,26 @@ void kmutex_lock(kmutex_t *mtx)
     /* PROCS }}} */
 }
 
+/*
+ * Obtains a mutex only if nobody holds it; never blocks. Returns 1 if the
+ * mutex was acquired and 0 otherwise.
+ */
+long kmutex_trylock(kmutex_t *mtx)
+{
+    spinlock_lock(&mtx->km_lock);
+    KASSERT(curthr && "need thread context to lock mutex");
+
+    if (mtx->km_holder)
+    {
+        spinlock_unlock(&mtx->km_lock);
+        return 0;
+    }
+    mtx->km_holder = curthr;
+    list_insert_tail(&curthr->kt_mutexes, &mtx->km_link);
+    spinlock_unlock(&mtx->km_lock);
+    return 1;
+}
+
 /*
  * Releases a mutex.
  *
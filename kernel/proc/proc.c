@@ -7,7 +7,9 @@
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/mm.h"
 #include "mm/slab.h"
+#include "mm/tlb.h"
 #include "util/debug.h"
 #include "util/printf.h"
 #include "util/string.h"
@@ -183,7 +185,7 @@ proc_t *proc_lookup(pid_t pid)
  * 
  * Be sure to free resources appropriately if proc_create() fails midway!
  */
-proc_t *proc_create(const char *name)
+static proc_t *_proc_create(const char *name, long vfork)
 {
     proc_t *new_proc;
     new_proc=slab_obj_alloc(proc_allocator); // Allocated new space for new_proc
@@ -193,7 +195,8 @@ proc_t *proc_create(const char *name)
         return NULL;
     }
     strcpy(new_proc->p_name,name); //Initialize the name TODO: Check it
-    new_proc->p_pml4=pt_create(); // New page table
+    // New page table, unless the child runs in ours until it execs
+    new_proc->p_pml4=vfork?curproc->p_pml4:pt_create();
     list_init(&new_proc->p_threads); // Initialize two lists
     list_init(&new_proc->p_children); 
     new_proc->p_pproc=curproc; // set the parent process, which is current process
@@ -227,12 +230,62 @@ proc_t *proc_create(const char *name)
     // Initialize VM part
     new_proc->p_brk=curproc->p_brk;     // Set the break
     new_proc->p_start_brk=curproc->p_start_brk;
-    new_proc->p_vmmap=vmmap_clone(curproc->p_vmmap);    // Set the vmmap
-    new_proc->p_vmmap->vmm_proc = new_proc;
+    new_proc->p_vfork_parent=NULL;
+    sched_queue_init(&new_proc->p_vfork_wait);
+    if(vfork){
+        // Borrow the vmmap: it stays the parent's (vmm_proc too), so nothing
+        // is copied and nothing is write-protected
+        new_proc->p_vmmap=curproc->p_vmmap;
+        new_proc->p_vfork_parent=curproc;
+    }
+    else{
+        new_proc->p_vmmap=vmmap_clone(curproc->p_vmmap);    // Set the vmmap
+        new_proc->p_vmmap->vmm_proc = new_proc;
+    }
     // NOT_YET_IMPLEMENTED("PROCS: proc_create");
     return new_proc;
 }
 
+proc_t *proc_create(const char *name)
+{
+    return _proc_create(name,0);
+}
+
+proc_t *proc_create_vfork(const char *name)
+{
+    return _proc_create(name,1);
+}
+
+/*
+ * Gives the address space borrowed by a vfork() child back to its parent.
+ * From exec, the child switches to the page table it was given. On exit it
+ * has none of its own, so it switches to the kernel's (idleproc's) for the
+ * rest of its life: once woken, the parent may exit and have its page table
+ * destroyed before the child is switched out for the last time. Either way
+ * the switch comes before the wakeup.
+ *
+ * idleproc's page table maps this core's core-specific data, and the
+ * scheduler would map another core's into it if the thread moved, so an
+ * exiting child isn't preempted again (it doesn't sleep on its way out).
+ */
+void proc_vfork_release(pml4_t *pml4)
+{
+    proc_t *parent=curproc->p_vfork_parent;
+    KASSERT(parent);
+    curproc->p_vmmap=NULL;
+    curproc->p_pml4=pml4;
+    if(!pml4){
+        preemption_disable();
+    }
+    curthr->kt_ctx.c_pml4=pml4?pml4:idleproc.p_pml4;
+    tlb_load(curthr->kt_ctx.c_pml4);
+
+    spinlock_lock(&parent->p_children_lock);
+    curproc->p_vfork_parent=NULL;
+    sched_broadcast_on(&curproc->p_vfork_wait);
+    spinlock_unlock(&parent->p_children_lock);
+}
+
 /*
  * Helper for proc_thread_exiting() that cleans up resources from the current
  * process in preparation for its destruction (which occurs later via proc_destroy()). 
@@ -260,7 +313,12 @@ void proc_cleanup(long status)
     if(curproc->p_cwd){
         vput(&curproc->p_cwd);
     }
+    if(curproc->p_vfork_parent){
+        proc_vfork_release(NULL);   // Not ours to destroy
+    }
     if(curproc->p_vmmap){
+        // Unmap everything first, so that the frames mapped no longer count as mapped
+        vmmap_remove(curproc->p_vmmap,ADDR_TO_PN(USER_MEM_LOW),ADDR_TO_PN(USER_MEM_HIGH)-ADDR_TO_PN(USER_MEM_LOW));
         vmmap_destroy(&curproc->p_vmmap);
     }
 
@@ -370,6 +428,13 @@ void proc_destroy(proc_t *proc)
     }
 #endif
 
+    /* A vfork() child that never ran still has its parent's address space */
+    if (proc->p_vfork_parent)
+    {
+        proc->p_vmmap = NULL;
+        proc->p_pml4 = NULL;
+    }
+
 #ifdef __VM__
     if (proc->p_vmmap)
         vmmap_destroy(&proc->p_vmmap);
@@ -377,8 +442,11 @@ void proc_destroy(proc_t *proc)
 
     dbg(DBG_THR, "destroying P%d\n", proc->p_pid);
 
-    KASSERT(proc->p_pml4);
-    pt_destroy(proc->p_pml4);
+    /* Nor did one that exited without exec ever get a page table */
+    if (proc->p_pml4)
+    {
+        pt_destroy(proc->p_pml4);
+    }
 
     slab_obj_free(proc_allocator, proc);
 }
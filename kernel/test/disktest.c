@@ -0,0 +1,209 @@
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/sata.h"
+
+#include "mm/page.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "test/disktest.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+
+/*
+ * Stress test and throughput benchmark for the disk driver. A reference pass
+ * reads the first DISKTEST_NBLOCKS blocks of the disk one at a time and
+ * checksums them. Then, for each queue depth, that many processes issue
+ * random single-block reads straight to the driver (bypassing the page cache)
+ * until DISKTEST_OPS reads have been done in total, checking every block
+ * against its reference checksum. The sweep over queue depths is repeated for
+ * each of the driver's completion modes. A read whose data ends up in the wrong
+ * buffer, or that completes before its data has arrived, shows up as a
+ * mismatch.
+ *
+ * Run it from the kernel shell with "disktest"; the throughput at each depth,
+ * how often the workers had to wait for a free command slot, and how the reads
+ * were completed are reported on the console. Nothing is written to the disk.
+ */
+
+#define DISKTEST_NBLOCKS 1024
+#define DISKTEST_OPS 2048
+#define DISKTEST_MAX_DEPTH 64
+
+static const struct
+{
+    const char *name;
+    long completion;
+} disktest_modes[] = {
+    {"interrupt", SATA_COMPLETION_INTERRUPT},
+    {"poll", SATA_COMPLETION_POLL},
+    {"batch", SATA_COMPLETION_BATCH},
+};
+
+typedef struct disktest_worker
+{
+    blockdev_t *dw_bdev;
+    char *dw_buf;
+    uint64_t dw_seed;
+    size_t dw_nreads;
+} disktest_worker_t;
+
+static uint64_t disktest_sums[DISKTEST_NBLOCKS];
+static disktest_worker_t disktest_workers[DISKTEST_MAX_DEPTH];
+static size_t disktest_errors;
+static size_t disktest_mismatches;
+
+static uint64_t disktest_checksum(const char *buf)
+{
+    const uint64_t *words = (const uint64_t *)buf;
+    uint64_t sum = 14695981039346656037UL;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++)
+    {
+        sum = (sum ^ words[i]) * 1099511628211UL;
+    }
+    return sum;
+}
+
+static inline uint64_t disktest_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static void *disktest_worker_run(long arg1, void *arg2)
+{
+    disktest_worker_t *w = arg2;
+    for (size_t i = 0; i < w->dw_nreads; i++)
+    {
+        blocknum_t block =
+            (blocknum_t)(disktest_random(&w->dw_seed) % DISKTEST_NBLOCKS);
+        if (w->dw_bdev->bd_ops->read_block(w->dw_bdev, w->dw_buf, block, 1))
+        {
+            disktest_errors++;
+        }
+        else if (disktest_checksum(w->dw_buf) != disktest_sums[block])
+        {
+            dbg(DBG_TEST, "block %u read back with the wrong contents\n",
+                block);
+            disktest_mismatches++;
+        }
+    }
+    return NULL;
+}
+
+static void disktest_depth(blockdev_t *bdev, size_t depth)
+{
+    size_t nstarted = 0;
+    sata_stats_t before, after;
+    sata_stats(bdev, &before);
+    time_t start = core_uptime();
+    for (size_t i = 0; i < depth; i++)
+    {
+        disktest_worker_t *w = &disktest_workers[i];
+        w->dw_seed = 0x9e3779b97f4a7c15UL * (i + 1) + depth;
+        w->dw_nreads = DISKTEST_OPS / depth;
+
+        proc_t *proc = proc_create("disktest");
+        if (!proc)
+        {
+            dbg(DBG_TEST, "could not start worker %lu\n", i);
+            break;
+        }
+        kthread_t *thr = kthread_create(proc, disktest_worker_run, 0, w);
+        KASSERT(thr && "failed to create a disktest worker thread");
+        sched_make_runnable(thr);
+        nstarted++;
+    }
+
+    int status;
+    while (do_waitpid(-1, &status, 0) != -ECHILD)
+        ;
+    time_t elapsed = core_uptime() - start;
+    sata_stats(bdev, &after);
+
+    size_t nreads = nstarted * (DISKTEST_OPS / depth);
+    dbg(DBG_TEST,
+        "depth %2lu: %5lu reads in %5lu ms, %6lu reads/s, %6lu KB/s\n", depth,
+        nreads, elapsed, elapsed ? nreads * 1000 / elapsed : 0,
+        elapsed ? nreads * (BLOCK_SIZE / 1024) * 1000 / elapsed : 0);
+    dbg(DBG_TEST, "          %5lu waits for a command slot, %2lu in flight\n",
+        after.ss_slot_waits - before.ss_slot_waits, after.ss_max_inflight);
+    dbg(DBG_TEST,
+        "          %5lu polled, %5lu completed by %5lu interrupts\n",
+        after.ss_polled - before.ss_polled,
+        after.ss_irq_completions - before.ss_irq_completions,
+        after.ss_interrupts - before.ss_interrupts);
+}
+
+long disktest_main(long arg1, void *arg2)
+{
+    blockdev_t *bdev = blockdev_lookup(MKDEVID(DISK_MAJOR, 0));
+    if (!bdev)
+    {
+        dbg(DBG_TEST, "no disk to test\n");
+        return -ENODEV;
+    }
+
+    size_t nbufs = 0;
+    while (nbufs < DISKTEST_MAX_DEPTH &&
+           (disktest_workers[nbufs].dw_buf = page_alloc()))
+    {
+        disktest_workers[nbufs].dw_bdev = bdev;
+        nbufs++;
+    }
+    if (!nbufs)
+    {
+        return -ENOMEM;
+    }
+
+    disktest_errors = 0;
+    disktest_mismatches = 0;
+    char *buf = disktest_workers[0].dw_buf;
+    time_t start = core_uptime();
+    for (blocknum_t block = 0; block < DISKTEST_NBLOCKS; block++)
+    {
+        long ret = bdev->bd_ops->read_block(bdev, buf, block, 1);
+        if (ret)
+        {
+            dbg(DBG_TEST, "reference read of block %u failed: %ld\n", block,
+                ret);
+            disktest_errors++;
+            goto out;
+        }
+        disktest_sums[block] = disktest_checksum(buf);
+    }
+    dbg(DBG_TEST, "reference pass: %d sequential reads in %lu ms\n",
+        DISKTEST_NBLOCKS, core_uptime() - start);
+
+    long completion = sata_set_completion(bdev, SATA_COMPLETION_INTERRUPT);
+    for (size_t m = 0; m < sizeof(disktest_modes) / sizeof(*disktest_modes);
+         m++)
+    {
+        dbg(DBG_TEST, "%s completion:\n", disktest_modes[m].name);
+        sata_set_completion(bdev, disktest_modes[m].completion);
+        for (size_t depth = 1; depth <= nbufs; depth *= 2)
+        {
+            disktest_depth(bdev, depth);
+        }
+    }
+    sata_set_completion(bdev, completion);
+
+    dbg(DBG_TEST, "disk test done: %lu read errors, %lu mismatched blocks\n",
+        disktest_errors, disktest_mismatches);
+
+out:
+    while (nbufs--)
+    {
+        page_free(disktest_workers[nbufs].dw_buf);
+    }
+    return disktest_errors || disktest_mismatches ? -EIO : 0;
+}
@@ -11,10 +11,24 @@
 
 #endif
 
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pageout.h"
+#include "mm/slab.h"
+#include "mm/tlb.h"
+#include "mm/writeback.h"
+
 #include "test/kshell/io.h"
+#include "test/disktest.h"
+#include "test/pagebench.h"
 
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/time.h"
+
+#include "vm/pagefault.h"
 
 list_t kshell_commands_list = LIST_INITIALIZER(kshell_commands_list);
 
@@ -75,6 +89,187 @@ long kshell_echo(kshell_t *ksh, size_t argc, char **argv)
     return 0;
 }
 
+/* Takes two samples of the slab counters, ms milliseconds apart. Returns the
+ * number of allocators in both, or 0 if memory for the samples ran out. */
+static size_t kshell_slab_sample(slab_allocator_stats_t **statsp,
+                                 slab_allocator_stats_t **prevp, time_t ms)
+{
+    size_t count = slab_allocators_stats(NULL, 0);
+    for (;;)
+    {
+        /* Leave room for allocators created while we sample. */
+        size_t max = count + 4;
+        *statsp = kmalloc(max * sizeof(slab_allocator_stats_t));
+        *prevp = ms ? kmalloc(max * sizeof(slab_allocator_stats_t)) : NULL;
+        if (!*statsp || (ms && !*prevp))
+        {
+            break;
+        }
+        if (ms)
+        {
+            count = slab_allocators_stats(*prevp, max);
+            time_sleep(ms);
+            if (slab_allocators_stats(*statsp, max) != count || count > max)
+            {
+                kfree(*statsp);
+                kfree(*prevp);
+                continue;
+            }
+        }
+        else if ((count = slab_allocators_stats(*statsp, max)) > max)
+        {
+            kfree(*statsp);
+            continue;
+        }
+        return count;
+    }
+    if (*statsp)
+    {
+        kfree(*statsp);
+    }
+    if (*prevp)
+    {
+        kfree(*prevp);
+    }
+    return 0;
+}
+
+long kshell_slabinfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    time_t ms = 0;
+    if (argc > 2)
+    {
+        kprintf(ksh, "usage: slabinfo [interval-ms]\n");
+        return -EINVAL;
+    }
+    for (char *c = argc == 2 ? argv[1] : ""; *c; c++)
+    {
+        if (*c < '0' || *c > '9')
+        {
+            kprintf(ksh, "slabinfo: invalid interval %s\n", argv[1]);
+            return -EINVAL;
+        }
+        ms = ms * 10 + (*c - '0');
+    }
+
+    slab_allocator_stats_t *stats, *prev;
+    size_t count = kshell_slab_sample(&stats, &prev, ms);
+    if (!count)
+    {
+        return -ENOMEM;
+    }
+
+    if (ms)
+    {
+        kprintf(ksh, "%-16s %7s %7s %6s %9s %9s %9s\n", "name", "objsize",
+                "inuse", "pages", "+inuse", "allocs/s", "frees/s");
+    }
+    else
+    {
+        kprintf(ksh, "%-16s %7s %7s %7s %6s %6s %6s %9s %9s\n", "name",
+                "objsize", "inuse", "cached", "slabs", "pages", "peak",
+                "allocs", "frees");
+    }
+
+    size_t total_pages = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        slab_allocator_stats_t *st = &stats[i];
+        total_pages += st->sas_pages;
+        if (ms)
+        {
+            slab_allocator_stats_t *pr = &prev[i];
+            kprintf(ksh, "%-16s %7lu %7lu %6lu %9ld %9lu %9lu\n", st->sas_name,
+                    st->sas_objsize, st->sas_inuse, st->sas_pages,
+                    (long)(st->sas_inuse - pr->sas_inuse),
+                    (st->sas_allocs - pr->sas_allocs) * 1000 / ms,
+                    (st->sas_frees - pr->sas_frees) * 1000 / ms);
+        }
+        else
+        {
+            kprintf(ksh, "%-16s %7lu %7lu %7lu %6lu %6lu %6lu %9lu %9lu\n",
+                    st->sas_name, st->sas_objsize, st->sas_inuse,
+                    st->sas_cached, st->sas_slabs, st->sas_pages,
+                    st->sas_peak_pages, st->sas_allocs, st->sas_frees);
+        }
+    }
+    kprintf(ksh, "%lu allocators, %lu pages in slabs\n", count, total_pages);
+
+    kfree(stats);
+    if (prev)
+    {
+        kfree(prev);
+    }
+    return 0;
+}
+
+long kshell_meminfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    size_t total = page_total_count();
+    size_t nfree = page_free_count();
+    size_t slab_pages = 0;
+
+    size_t count = slab_allocators_stats(NULL, 0);
+    slab_allocator_stats_t *stats =
+        kmalloc(count * sizeof(slab_allocator_stats_t));
+    if (!stats)
+    {
+        return -ENOMEM;
+    }
+    count = MIN(count, slab_allocators_stats(stats, count));
+    for (size_t i = 0; i < count; i++)
+    {
+        slab_pages += stats[i].sas_pages;
+    }
+    kfree(stats);
+
+    pageout_stats_t po;
+    pageout_stats(&po);
+    slab_reclaim_stats_t sr;
+    slab_reclaim_stats(&sr);
+    page_cpu_cache_stats_t pcc;
+    page_cpu_cache_stats(&pcc);
+    writeback_stats_t wb;
+    writeback_stats(&wb);
+    pagefault_stats_t pfs;
+    pagefault_stats(&pfs);
+    tlb_stats_t tlbs;
+    tlb_stats(&tlbs);
+
+    kprintf(ksh, "total:          %8lu pages\n", total);
+    kprintf(ksh, "free:           %8lu pages\n", nfree);
+    kprintf(ksh, "used:           %8lu pages\n", total - nfree);
+    kprintf(ksh, "  slab:         %8lu pages\n", slab_pages);
+    kprintf(ksh, "  kmalloc:      %8lu pages (page-sized and larger)\n",
+            kmalloc_page_count());
+    kprintf(ksh, "  page cache:   %8lu pages (%lu active, %lu inactive)\n",
+            po.pos_active + po.pos_inactive, po.pos_active, po.pos_inactive);
+    kprintf(ksh, "  dirty:        %8lu pages (%lu objects, %lu more mapped)\n",
+            wb.wbs_dirty, wb.wbs_mobjs, wb.wbs_kept);
+    kprintf(ksh, "watermarks:     %8lu low, %lu high\n", po.pos_low_watermark,
+            po.pos_high_watermark);
+    kprintf(ksh, "pageout:        %8lu wakeups, %lu pages evicted\n",
+            po.pos_wakeups, po.pos_reclaimed);
+    kprintf(ksh, "writeback:      %8lu wakeups, %lu pages written, "
+                 "%lu syncs (%lu pages)\n",
+            wb.wbs_wakeups, wb.wbs_written, wb.wbs_syncs, wb.wbs_synced);
+    kprintf(ksh, "                %8lu runs written, %lu writers throttled\n",
+            wb.wbs_runs, wb.wbs_throttled);
+    kprintf(ksh, "page faults:    %8lu faults, %lu pages mapped around\n",
+            pfs.pfs_faults, pfs.pfs_around);
+    kprintf(ksh, "tlb:            %8lu loads, %lu pcid hits (pcids %s), "
+                 "%lu pages, %lu full flushes, %lu pcids dropped, %lu ipis\n",
+            tlbs.ts_loads, tlbs.ts_pcid_hits, tlbs.ts_pcid ? "on" : "off",
+            tlbs.ts_pages, tlbs.ts_full, tlbs.ts_dropped, tlbs.ts_ipis);
+    kprintf(ksh, "slab reclaim:   %8lu calls, %lu pages, %lu slabs\n",
+            sr.srs_calls, sr.srs_pages, sr.srs_slabs);
+    kprintf(ksh, "page cpu cache: %8lu alloc hits, %lu misses, "
+                 "%lu free hits, %lu drains\n",
+            pcc.pccs_alloc_hits, pcc.pccs_alloc_misses, pcc.pccs_free_hits,
+            pcc.pccs_free_drains);
+    return 0;
+}
+
 #ifdef __VFS__
 
 long kshell_cat(kshell_t *ksh, size_t argc, char **argv)
@@ -402,3 +597,38 @@ long kshell_s5fstest(kshell_t *ksh, size_t argc, char **argv)
 }
 
 #endif
+
+long kshell_pagebench(kshell_t *ksh, size_t argc, char **argv)
+{
+    kprintf(ksh, "PAGEBENCH: Running... Please wait.\n");
+
+    long ret = pagebench_main(0, NULL);
+
+    kprintf(ksh, "PAGEBENCH: done, check console for results\n");
+
+    return ret;
+}
+
+long kshell_iostat(kshell_t *ksh, size_t argc, char **argv)
+{
+    char *buf = page_alloc();
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+    size_t left = blockdev_list_info(NULL, buf, PAGE_SIZE);
+    long ret = kshell_write_all(ksh, buf, PAGE_SIZE - left);
+    page_free(buf);
+    return ret < 0 ? ret : 0;
+}
+
+long kshell_disktest(kshell_t *ksh, size_t argc, char **argv)
+{
+    kprintf(ksh, "DISKTEST: Running... Please wait.\n");
+
+    long ret = disktest_main(0, NULL);
+
+    kprintf(ksh, "DISKTEST: done (%ld), check console for results\n", ret);
+
+    return ret;
+}
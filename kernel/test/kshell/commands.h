@@ -14,6 +14,11 @@ KSHELL_CMD(halt);
 KSHELL_CMD(echo);
 
 KSHELL_CMD(clear);
+KSHELL_CMD(pagebench);
+KSHELL_CMD(disktest);
+KSHELL_CMD(slabinfo);
+KSHELL_CMD(meminfo);
+KSHELL_CMD(iostat);
 
 #ifdef __VFS__
 KSHELL_CMD(cat);
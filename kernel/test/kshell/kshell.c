@@ -52,6 +52,12 @@ void kshell_init()
                        "prints a list of available commands");
     kshell_add_command("echo", kshell_echo, "display a line of text");
     kshell_add_command("clear", kshell_clear, "clears the screen");
+    kshell_add_command("slabinfo", kshell_slabinfo,
+                       "show slab allocator usage [over an interval in ms]");
+    kshell_add_command("meminfo", kshell_meminfo,
+                       "show physical memory usage");
+    kshell_add_command("iostat", kshell_iostat,
+                       "show block device I/O counters and latencies");
 #ifdef __VFS__
     kshell_add_command("cat", kshell_cat,
                        "concatenate files and print on the standard output");
@@ -70,6 +76,12 @@ void kshell_init()
     kshell_add_command("s5fstest", kshell_s5fstest, "runs S5FS tests");
 #endif
 
+    kshell_add_command("pagebench", kshell_pagebench,
+                       "benchmarks the page allocator");
+    kshell_add_command("disktest", kshell_disktest,
+                       "stress tests the disk driver at increasing queue "
+                       "depths");
+
     kshell_add_command("halt", kshell_halt, "halts the systems");
     kshell_add_command("exit", kshell_exit, "exits the shell");
 }
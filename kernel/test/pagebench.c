@@ -0,0 +1,131 @@
+#include "globals.h"
+#include "types.h"
+
+#include "mm/page.h"
+
+#include "test/pagebench.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+
+/*
+ * Microbenchmark for the physical page allocator. Each workload is timed with
+ * the cycle counter and reported as the average number of cycles per
+ * allocation + free. Run it from the kernel shell with "pagebench"; comparing
+ * its output across allocator changes is the point, so keep the workloads
+ * stable.
+ *
+ * Blocks of up to 2^PAGE_CPU_CACHE_MAX_ORDER pages mostly come from and go
+ * back to the per-core page caches, so the workloads on them measure those;
+ * the ones on bigger blocks always reach the btree, and measure how it finds,
+ * splits and coalesces free blocks. The caches are drained before each
+ * workload so that none starts with blocks left over from the one before.
+ */
+
+#define PAGEBENCH_ITERS 4096
+#define PAGEBENCH_BATCH 256
+
+static void *pagebench_pages[PAGEBENCH_BATCH];
+
+static void pagebench_report(const char *name, uint64_t cycles, size_t nops)
+{
+    dbg(DBG_TEST, "%-24s %8lu ops %8lu cycles/op\n", name, nops,
+        nops ? cycles / nops : 0);
+}
+
+/* alloc/free pairs of the same size, back to back */
+static void pagebench_pairs(const char *name, size_t npages)
+{
+    size_t nops = 0;
+    page_cpu_cache_drain();
+    uint64_t start = time_cycles();
+    for (size_t i = 0; i < PAGEBENCH_ITERS; i++)
+    {
+        void *page = page_alloc_n(npages);
+        if (!page)
+        {
+            break;
+        }
+        page_free_n(page, npages);
+        nops++;
+    }
+    pagebench_report(name, time_cycles() - start, nops);
+}
+
+/* allocate a batch of blocks, then free them all, in the given order */
+static void pagebench_batch(const char *name, size_t npages, long reverse)
+{
+    size_t nops = 0;
+    page_cpu_cache_drain();
+    uint64_t start = time_cycles();
+    for (size_t round = 0; round < PAGEBENCH_ITERS / PAGEBENCH_BATCH; round++)
+    {
+        size_t nalloced = 0;
+        while (nalloced < PAGEBENCH_BATCH &&
+               (pagebench_pages[nalloced] = page_alloc_n(npages)))
+        {
+            nalloced++;
+        }
+        for (size_t i = 0; i < nalloced; i++)
+        {
+            size_t j = reverse ? nalloced - i - 1 : i;
+            page_free_n(pagebench_pages[j], npages);
+        }
+        nops += nalloced;
+    }
+    pagebench_report(name, time_cycles() - start, nops);
+}
+
+/* interleave sizes so that blocks of different orders are split and freed
+ * next to each other */
+static void pagebench_mixed(const char *name)
+{
+    static const size_t sizes[] = {1, 3, 1, 8, 2, 1, 16, 5};
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t nops = 0;
+    page_cpu_cache_drain();
+    uint64_t start = time_cycles();
+    for (size_t round = 0; round < PAGEBENCH_ITERS / PAGEBENCH_BATCH; round++)
+    {
+        size_t nalloced = 0;
+        while (nalloced < PAGEBENCH_BATCH &&
+               (pagebench_pages[nalloced] =
+                    page_alloc_n(sizes[nalloced % nsizes])))
+        {
+            nalloced++;
+        }
+        /* free every other block first, then the rest */
+        for (size_t i = 0; i < nalloced; i += 2)
+        {
+            page_free_n(pagebench_pages[i], sizes[i % nsizes]);
+        }
+        for (size_t i = 1; i < nalloced; i += 2)
+        {
+            page_free_n(pagebench_pages[i], sizes[i % nsizes]);
+        }
+        nops += nalloced;
+    }
+    pagebench_report(name, time_cycles() - start, nops);
+}
+
+long pagebench_main(long arg1, void *arg2)
+{
+    size_t free_before = page_free_count();
+    dbg(DBG_TEST, "page allocator benchmark, %lu free pages\n", free_before);
+
+    pagebench_pairs("alloc/free 1 page", 1);
+    pagebench_pairs("alloc/free 8 pages", 8);
+    pagebench_pairs("alloc/free 64 pages", 64);
+    pagebench_batch("batch 1 page fifo", 1, 0);
+    pagebench_batch("batch 1 page lifo", 1, 1);
+    pagebench_batch("batch 4 pages lifo", 4, 1);
+    pagebench_batch("batch 8 pages fifo", 8, 0);
+    pagebench_batch("batch 8 pages lifo", 8, 1);
+    pagebench_batch("batch 32 pages lifo", 32, 1);
+    pagebench_mixed("mixed sizes");
+
+    KASSERT(page_free_count() == free_before &&
+            "page allocator benchmark leaked pages");
+    dbg(DBG_TEST, "page allocator benchmark done\n");
+    return 0;
+}
@@ -56,7 +56,7 @@ long test_vmmap() {
     // section start --> HP - (num_vmareas * num_pages_per_vmarea) 
     
     list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        list_remove(&vma->vma_plink); 
+        vmmap_remove_area(map, vma); 
         kfree(vma);
     }
     
@@ -0,0 +1,295 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+
+static slab_allocator_t *radix_node_allocator;
+
+void radix_init()
+{
+    radix_node_allocator =
+        slab_allocator_create("radix_node", sizeof(radix_node_t));
+    KASSERT(radix_node_allocator);
+}
+
+void radix_tree_init(radix_tree_t *tree)
+{
+    tree->rt_root = NULL;
+    tree->rt_height = 0;
+    tree->rt_count = 0;
+}
+
+static radix_node_t *_radix_node_alloc()
+{
+    radix_node_t *node = slab_obj_alloc(radix_node_allocator);
+    if (node)
+    {
+        memset(node, 0, sizeof(radix_node_t));
+    }
+    return node;
+}
+
+static inline void _radix_node_free(radix_node_t *node)
+{
+    slab_obj_free(radix_node_allocator, node);
+}
+
+/* Number of levels needed to hold index; always at least 1. */
+static unsigned _radix_height_for(uint64_t index)
+{
+    unsigned height = 1;
+    while (height < RADIX_TREE_MAX_HEIGHT &&
+           (index >> (height * RADIX_TREE_MAP_SHIFT)))
+    {
+        height++;
+    }
+    return height;
+}
+
+/* Largest index representable by a tree of the given height. */
+static inline uint64_t _radix_max_index(unsigned height)
+{
+    if (height * RADIX_TREE_MAP_SHIFT >= 64)
+    {
+        return (uint64_t)-1;
+    }
+    return (1UL << (height * RADIX_TREE_MAP_SHIFT)) - 1;
+}
+
+static inline unsigned _radix_slot(uint64_t index, unsigned level)
+{
+    return (unsigned)((index >> (level * RADIX_TREE_MAP_SHIFT)) &
+                      RADIX_TREE_MAP_MASK);
+}
+
+/*
+ * Frees empty nodes along the path to index, then collapses the root while it
+ * only has a child in slot 0. Used both after a removal and to undo a
+ * partially-completed insertion.
+ */
+static void _radix_prune(radix_tree_t *tree, uint64_t index)
+{
+    radix_node_t *path[RADIX_TREE_MAX_HEIGHT];
+    unsigned depth = 0;
+
+    radix_node_t *node = tree->rt_root;
+    for (unsigned level = tree->rt_height; node && level > 0; level--)
+    {
+        path[depth++] = node;
+        node = level > 1 ? node->rn_slots[_radix_slot(index, level - 1)]
+                         : NULL;
+    }
+
+    while (depth > 0)
+    {
+        node = path[--depth];
+        if (node->rn_bitmap)
+        {
+            break;
+        }
+        _radix_node_free(node);
+        if (depth == 0)
+        {
+            tree->rt_root = NULL;
+            tree->rt_height = 0;
+            return;
+        }
+        unsigned slot = _radix_slot(index, tree->rt_height - depth);
+        path[depth - 1]->rn_slots[slot] = NULL;
+        path[depth - 1]->rn_bitmap &= ~(1UL << slot);
+    }
+
+    while (tree->rt_height > 1 && tree->rt_root->rn_bitmap == 1)
+    {
+        radix_node_t *old_root = tree->rt_root;
+        tree->rt_root = old_root->rn_slots[0];
+        tree->rt_height--;
+        _radix_node_free(old_root);
+    }
+}
+
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t index)
+{
+    if (!tree->rt_root || index > _radix_max_index(tree->rt_height))
+    {
+        return NULL;
+    }
+
+    radix_node_t *node = tree->rt_root;
+    for (unsigned level = tree->rt_height - 1; level > 0; level--)
+    {
+        node = node->rn_slots[_radix_slot(index, level)];
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+    return node->rn_slots[_radix_slot(index, 0)];
+}
+
+long radix_tree_insert(radix_tree_t *tree, uint64_t index, void *item)
+{
+    KASSERT(item);
+
+    /* Grow the tree upwards until index fits, keeping the old root as the
+     * leftmost child of each new root. */
+    unsigned height = _radix_height_for(index);
+    if (!tree->rt_root)
+    {
+        if (!(tree->rt_root = _radix_node_alloc()))
+        {
+            return -ENOMEM;
+        }
+        tree->rt_height = height;
+    }
+    while (tree->rt_height < height)
+    {
+        radix_node_t *root = _radix_node_alloc();
+        if (!root)
+        {
+            _radix_prune(tree, index);
+            return -ENOMEM;
+        }
+        root->rn_slots[0] = tree->rt_root;
+        root->rn_bitmap = 1;
+        tree->rt_root = root;
+        tree->rt_height++;
+    }
+
+    radix_node_t *node = tree->rt_root;
+    for (unsigned level = tree->rt_height - 1; level > 0; level--)
+    {
+        unsigned slot = _radix_slot(index, level);
+        if (!node->rn_slots[slot])
+        {
+            radix_node_t *child = _radix_node_alloc();
+            if (!child)
+            {
+                _radix_prune(tree, index);
+                return -ENOMEM;
+            }
+            node->rn_slots[slot] = child;
+            node->rn_bitmap |= 1UL << slot;
+        }
+        node = node->rn_slots[slot];
+    }
+
+    unsigned slot = _radix_slot(index, 0);
+    KASSERT(!node->rn_slots[slot] && "index already present in radix tree");
+    node->rn_slots[slot] = item;
+    node->rn_bitmap |= 1UL << slot;
+    tree->rt_count++;
+    return 0;
+}
+
+void *radix_tree_remove(radix_tree_t *tree, uint64_t index)
+{
+    if (!tree->rt_root || index > _radix_max_index(tree->rt_height))
+    {
+        return NULL;
+    }
+
+    radix_node_t *node = tree->rt_root;
+    for (unsigned level = tree->rt_height - 1; level > 0; level--)
+    {
+        node = node->rn_slots[_radix_slot(index, level)];
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned slot = _radix_slot(index, 0);
+    void *item = node->rn_slots[slot];
+    if (item)
+    {
+        node->rn_slots[slot] = NULL;
+        node->rn_bitmap &= ~(1UL << slot);
+        tree->rt_count--;
+        _radix_prune(tree, index);
+    }
+    return item;
+}
+
+/*
+ * Finds the smallest index >= start under node, whose children are at the
+ * given level (0 means the slots hold items).
+ */
+static void *_radix_node_next(radix_node_t *node, unsigned level,
+                              uint64_t start, uint64_t *indexp)
+{
+    unsigned slot = _radix_slot(start, level);
+    uint64_t shift = level * RADIX_TREE_MAP_SHIFT;
+    uint64_t base = start & ~(((uint64_t)RADIX_TREE_MAP_SIZE << shift) - 1);
+    if (shift + RADIX_TREE_MAP_SHIFT >= 64)
+    {
+        base = 0;
+    }
+
+    uint64_t candidates = node->rn_bitmap & (~0UL << slot);
+    while (candidates)
+    {
+        slot = (unsigned)__builtin_ctzl(candidates);
+        uint64_t child_base = base | ((uint64_t)slot << shift);
+        if (!level)
+        {
+            *indexp = child_base;
+            return node->rn_slots[slot];
+        }
+        /* Only the first child we visit is constrained by start. */
+        uint64_t child_start = child_base > start ? child_base : start;
+        void *item =
+            _radix_node_next(node->rn_slots[slot], level - 1, child_start,
+                             indexp);
+        if (item)
+        {
+            return item;
+        }
+        candidates &= ~(1UL << slot);
+    }
+    return NULL;
+}
+
+void *radix_tree_next(radix_tree_t *tree, uint64_t start, uint64_t *indexp)
+{
+    if (!tree->rt_root || start > _radix_max_index(tree->rt_height))
+    {
+        return NULL;
+    }
+    uint64_t index;
+    void *item =
+        _radix_node_next(tree->rt_root, tree->rt_height - 1, start, &index);
+    if (item && indexp)
+    {
+        *indexp = index;
+    }
+    return item;
+}
+
+static void _radix_node_destroy(radix_node_t *node, unsigned level)
+{
+    if (level)
+    {
+        uint64_t children = node->rn_bitmap;
+        while (children)
+        {
+            unsigned slot = (unsigned)__builtin_ctzl(children);
+            _radix_node_destroy(node->rn_slots[slot], level - 1);
+            children &= ~(1UL << slot);
+        }
+    }
+    _radix_node_free(node);
+}
+
+void radix_tree_destroy(radix_tree_t *tree)
+{
+    if (tree->rt_root)
+    {
+        _radix_node_destroy(tree->rt_root, tree->rt_height - 1);
+    }
+    radix_tree_init(tree);
+}
@@ -17,6 +17,10 @@ uint64_t user_preempted_count CORE_SPECIFIC_DATA;
 uint64_t not_preempted_count CORE_SPECIFIC_DATA;
 uint64_t idle_count CORE_SPECIFIC_DATA;
 
+/* Time stamp counter reading when the timer was started, to work out the
+ * counter's rate from. */
+static uint64_t time_start_cycles;
+
 // (freq / 16) interrupts per millisecond
 static long timer_tick_handler(regs_t *regs)
 {
@@ -53,10 +57,29 @@ static long timer_tick_handler(regs_t *regs)
 void time_init()
 {
     timer_tickcount = 0;
+    time_start_cycles = time_cycles();
     intr_register(INTR_APICTIMER, timer_tick_handler);
     apic_enable_periodic_timer(TIME_APIC_TICK_FREQUENCY);
 }
 
+uint64_t time_cycles()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* The rate of the time stamp counter is measured against the timer over the
+ * whole uptime, so it is only as good as the timer, but gets better as the
+ * system runs. Returns 0 before the first tick. */
+uint64_t time_cycles_to_us(uint64_t cycles)
+{
+    uint64_t elapsed_us = MICROSECONDS_PER_APIC_TICK * timer_tickcount;
+    uint64_t cycles_per_us =
+        elapsed_us ? (time_cycles() - time_start_cycles) / elapsed_us : 0;
+    return cycles_per_us ? cycles / cycles_per_us : 0;
+}
+
 void time_spin(uint64_t ms)
 {
     uint64_t ticks_to_wait = ms * TIME_APIC_TICK_FREQUENCY / 16;
@@ -77,6 +100,13 @@ inline time_t core_uptime()
     return (MICROSECONDS_PER_APIC_TICK * timer_tickcount) / 1000;
 }
 
+/* Converts a duration in milliseconds to a number of timer ticks, the unit of
+ * jiffies and of timer expiry times. */
+uint64_t time_ms_to_jiffies(time_t ms)
+{
+    return (ms * 1000) / MICROSECONDS_PER_APIC_TICK;
+}
+
 static int mdays[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
 
 time_t do_time()
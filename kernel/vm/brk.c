@@ -92,6 +92,7 @@ long do_brk(void *addr, void **ret)
                 return -ENOMEM;     // Beyond its valid range
             }
             new_vm->vma_end=add_pn; // Expand it
+            vmmap_update_area(curproc->p_vmmap,new_vm);
         }
         curproc->p_brk=addr;
     }
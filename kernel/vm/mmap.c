@@ -6,7 +6,6 @@
 #include "globals.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
-#include "mm/tlb.h"
 #include "util/debug.h"
 
 /*
@@ -44,9 +43,10 @@
  *  2) Call vmmap_map() to create the mapping.
  *     a) Use VMMAP_DIR_HILO as default, which will make other stencil code in
  *        Weenix happy.
- *  3) Call tlb_flush_range() on the newly-mapped region. This is because the
- *     newly-mapped region could have been used by someone else, and you don't
- *     want to get stale mappings.
+ *  3) The newly-mapped region could have been used by someone else, and you
+ *     don't want to get stale mappings. vmmap_map() unmaps whatever was there
+ *     through vmmap_remove(), which shoots the range down, so there is
+ *     nothing left to flush here.
  *  4) Don't forget to set ret if it was provided.
  * 
  *  If you are mapping less than a page, make sure that you are still allocating 
@@ -142,7 +142,6 @@ long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
         return tmp;
     }
 
-    tlb_flush_range((uintptr_t)PAGE_ALIGN_DOWN(addr),npages);
     if(ret!=NULL){
         *ret=PN_TO_ADDR(new_vma->vma_start);
     } 
@@ -8,6 +8,58 @@
 #include "mm/tlb.h"
 #include "types.h"
 #include "util/debug.h"
+#include "vm/shadow.h"
+
+static pagefault_stats_t pagefault_counts;
+
+void pagefault_stats(pagefault_stats_t *stats)
+{
+    *stats=pagefault_counts;
+}
+
+/*
+ * Maps the resident pages of vma around a read fault at pagenum, read-only,
+ * as a read fault on each of them would. The window is aligned, so it lies
+ * within the one page table that mapping the faulting page has made sure of,
+ * and it is filled in with a single walk. Pages that aren't resident are left
+ * to fault on their own, as are busy ones, and mappings already there are
+ * kept. They were not present before, so there is nothing to flush.
+ *
+ * A frame can't be evicted while it is mapped (see below), so only frames that
+ * are already mapped somewhere, like the text of a program another process is
+ * running or a page shared with a forked parent, are mapped here: pages the
+ * process may never touch are not pinned in the page cache on its behalf.
+ */
+static void fault_around(vmarea_t *vma, size_t pagenum)
+{
+    size_t window=pagenum-pagenum%FAULT_AROUND_PAGES;
+    size_t lopage=MAX(window,vma->vma_start);
+    size_t npages=MIN(window+FAULT_AROUND_PAGES,vma->vma_end)-lopage;
+    pframe_t *pfs[FAULT_AROUND_PAGES];
+    uintptr_t paddrs[FAULT_AROUND_PAGES];
+
+    mobj_lock(vma->vma_obj);
+    for(size_t i=0;i<npages;i++){
+        pfs[i]=NULL;
+        if(lopage+i!=pagenum){  // Already mapped by the caller
+            shadow_find_resident_pframe(vma->vma_obj,lopage+i-vma->vma_start+vma->vma_off,&pfs[i]);
+        }
+        if(pfs[i]&&!pfs[i]->pf_mapped){
+            pframe_release(&pfs[i]);
+        }
+        paddrs[i]=pfs[i]?pt_virt_to_phys((uintptr_t)pfs[i]->pf_addr):0;
+    }
+    mobj_unlock(vma->vma_obj);
+
+    size_t nmapped=pt_map_batch(curproc->p_pml4,(uintptr_t)PN_TO_ADDR(lopage),paddrs,npages,PT_PRESENT|PT_USER);
+    for(size_t i=0;i<npages;i++){
+        if(pfs[i]){
+            pfs[i]->pf_mapped+=paddrs[i]!=0;    // Left at 0 where nothing was mapped
+            pframe_release(&pfs[i]);
+        }
+    }
+    pagefault_counts.pfs_around+=nmapped;
+}
 
 /*
  * Respond to a user mode pagefault by setting up the desired page.
@@ -51,6 +103,7 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
         PAGE_ALIGN_DOWN(vaddr), cause);
 
     KASSERT((cause&FAULT_USER)&&"Assert fault user is always set");
+    pagefault_counts.pfs_faults++;
 
     vmarea_t *fault_vmarea=vmmap_lookup(curproc->p_vmmap,ADDR_TO_PN(vaddr));
     if(fault_vmarea==NULL){
@@ -79,10 +132,16 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
         panic("Don't have any access");
     }
     pframe_t *pf;
+    size_t pagenum=ADDR_TO_PN(vaddr)-fault_vmarea->vma_start+fault_vmarea->vma_off;
+    // A write fault on a page mapped read-only may map another frame in place of the old one
+    uintptr_t old_paddr=pt_lookup(curproc->p_pml4,(uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+    pframe_t *old_pf=NULL;
     // TODO: Check the vaddr
     mobj_lock(fault_vmarea->vma_obj);
-    long tmp=mobj_get_pframe(fault_vmarea->vma_obj,ADDR_TO_PN(vaddr)-fault_vmarea->vma_start+fault_vmarea->vma_off,
-        cause&FAULT_WRITE,&pf);
+    if(old_paddr){
+        old_pf=shadow_find_mapped_pframe(fault_vmarea->vma_obj,pagenum,old_paddr);
+    }
+    long tmp=mobj_get_pframe(fault_vmarea->vma_obj,pagenum,cause&FAULT_WRITE,&pf);
     mobj_unlock(fault_vmarea->vma_obj);
     if(tmp<0){
         do_exit(EFAULT);
@@ -101,13 +160,27 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
     long tmp2=pt_map(curproc->p_pml4,pt_virt_to_phys((uintptr_t)pf->pf_addr),
         (uintptr_t)PAGE_ALIGN_DOWN(vaddr),pdflags,ptflags);
 
-    if(tmp<0){
+    if(tmp2<0){
         pframe_release(&pf);
         do_exit(EFAULT);
     }
 
     // Flush the tlb
-    tlb_flush((uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+    tlb_shootdown(curproc->p_pml4,(uintptr_t)PAGE_ALIGN_DOWN(vaddr),1);
+    // Count the mapping, so that the page cache doesn't evict this frame until it is unmapped again
+    if(pt_virt_to_phys((uintptr_t)pf->pf_addr)!=old_paddr){
+        pf->pf_mapped++;
+    }else{
+        old_pf=NULL;    // Just made writable
+    }
     pframe_release(&pf);
+    if(old_pf){
+        pframe_unmapped(old_pf);
+    }
+
+    // Reads tend to be followed by reads of the neighbouring pages
+    if(!(cause&FAULT_WRITE)&&FAULT_AROUND_PAGES>1){
+        fault_around(fault_vmarea,ADDR_TO_PN(vaddr));
+    }
     // NOT_YET_IMPLEMENTED("VM: handle_pagefault");
 }
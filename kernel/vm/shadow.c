@@ -1,5 +1,6 @@
 #include "vm/shadow.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
 #include "util/debug.h"
@@ -111,25 +112,37 @@ void shadow_collapse(mobj_t *o)
         // Previous one call find pframe
        if(cur_o->mo_refcount==1){
             // mobj_lock(sha_o->shadowed);
-            list_iterate(&cur_o->mo_pframes,cur_pf,pframe_t,pf_link){
+            long err=0;
+            radix_tree_iterate(&cur_o->mo_pframes,cur_pf,pframe_t){
                 // Check if this pframe exist in parent shadow object
                 pframe_t *pf;
                 if(par_o!=o){
                     mobj_lock(par_o);
                 }
                 mobj_find_pframe(par_o,cur_pf->pf_pagenum,&pf); 
-                if(par_o!=o){
-                    mobj_unlock(par_o);
-                }  
                 // If the pframe is NULL
                 if(pf==NULL){   // If we cannot find it in parent shadow object, we should migrate it 
-                    list_remove(&cur_pf->pf_link);  // Remove current pframe from its list on shadowed object
-                    list_insert_tail(&par_o->mo_pframes,&cur_pf->pf_link);  // Insert it into current mobj
+                    // Insert into the parent's index first, so that failing to allocate an index node leaves the pframe where it was
+                    err=radix_tree_insert(&par_o->mo_pframes,cur_pf->pf_pagenum,cur_pf);
+                    if(!err){
+                        cur_pf->pf_obj=par_o;
+                        radix_tree_remove(&cur_o->mo_pframes,cur_pf->pf_pagenum);  // Remove current pframe from the shadowed object
+                    }
                 }
                 else{   // If the pframe is not NULL, which means that it exist on parent shadow object
                     pframe_release(&pf);        //  Unlock the pframe
                     // mobj_free_pframe(sha_o->shadowed,&cur_pf);    
                 }
+                if(par_o!=o){
+                    mobj_unlock(par_o);
+                }  
+                if(err){
+                    break;
+                }
+            }
+            if(err){
+                // Out of memory: leave cur_o in the chain. Frames already moved up are still found first in par_o
+                break;
             }
             // mobj_t *removed_mobj=cur_o;   // Store the shadowed object need to be removed
             MOBJ_TO_SO(par_o)->shadowed=MOBJ_TO_SO(cur_o)->shadowed;  // Update parent's shadowed object
@@ -223,6 +236,79 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
     return 0;
 }
 
+/*
+ * Find the frame that a read of pagenum from o would get, but only if it is
+ * already resident and nobody is busy with it: neither is it filled, nor is
+ * its mutex waited for. o need not be a shadow object; if it is, the nearest
+ * copy in its chain is the one found, falling back on the bottom object's, and
+ * a copy that is busy hides the ones below it. So does a frame left in the
+ * tree without memory by a fill that failed. For mapping pages around a fault
+ * (see handle_pagefault()).
+ *
+ * o must be locked. On return, *pfp is either NULL or a locked pframe.
+ */
+void shadow_find_resident_pframe(mobj_t *o, size_t pagenum, pframe_t **pfp)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    *pfp=NULL;
+    mobj_t *cur_o=o;
+    while(1){
+        if(cur_o!=o){
+            mobj_lock(cur_o);
+        }
+        pframe_t *cur_pf=radix_tree_lookup(&cur_o->mo_pframes,pagenum);
+        long is_shadow=cur_o->mo_type==MOBJ_SHADOW;
+        if(cur_pf&&kmutex_trylock(&cur_pf->pf_mutex)){
+            if(cur_pf->pf_addr){
+                *pfp=cur_pf;
+            }else{
+                kmutex_unlock(&cur_pf->pf_mutex);
+            }
+        }
+        if(cur_o!=o){
+            mobj_unlock(cur_o);
+        }
+        // Stop at the first copy, whether we got it or not
+        if(cur_pf||!is_shadow){
+            return;
+        }
+        cur_o=MOBJ_TO_SO(cur_o)->shadowed;
+    }
+}
+
+/*
+ * Find the frame of pagenum in o's shadow chain whose memory is at physical
+ * address paddr, as a page table entry for the page may map any copy in the
+ * chain, not just the nearest one. A frame that is mapped can't be evicted, so
+ * it is returned unlocked; it stays put as long as the chain does. For keeping
+ * count of the mappings of each frame (see vmmap_remove()).
+ *
+ * o must be locked. Returns NULL if no frame in the chain is at paddr.
+ */
+pframe_t *shadow_find_mapped_pframe(mobj_t *o, size_t pagenum, uintptr_t paddr)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pframe_t *pf=NULL;
+    mobj_t *cur_o=o;
+    while(1){
+        if(cur_o!=o){
+            mobj_lock(cur_o);
+        }
+        pframe_t *cur_pf=radix_tree_lookup(&cur_o->mo_pframes,pagenum);
+        if(cur_pf&&cur_pf->pf_addr&&pt_virt_to_phys((uintptr_t)cur_pf->pf_addr)==paddr){
+            pf=cur_pf;
+        }
+        long is_shadow=cur_o->mo_type==MOBJ_SHADOW;
+        if(cur_o!=o){
+            mobj_unlock(cur_o);
+        }
+        if(pf||!is_shadow){
+            return pf;
+        }
+        cur_o=MOBJ_TO_SO(cur_o)->shadowed;
+    }
+}
+
 /*
  * Use the given mobj's shadow chain to fill the given pframe.
  *
@@ -15,6 +15,7 @@
 
 #include "mm/mm.h"
 #include "mm/mman.h"
+#include "mm/pframe.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
@@ -28,6 +29,207 @@ void vmmap_init(void)
     KASSERT(vmmap_allocator && vmarea_allocator);
 }
 
+/*
+ * The tree of areas (see vmmap.h). These helpers keep vma_height, vma_gap and
+ * vma_max_gap up to date; the list is maintained by their callers.
+ */
+
+static inline long _vma_height(vmarea_t *vma)
+{
+    return vma ? vma->vma_height : 0;
+}
+
+static inline size_t _vma_max_gap(vmarea_t *vma)
+{
+    return vma ? vma->vma_max_gap : 0;
+}
+
+static inline vmarea_t *_vmmap_prev(vmmap_t *map, vmarea_t *vma)
+{
+    return vma->vma_plink.l_prev == &map->vmm_list
+               ? NULL
+               : list_prev(vma, vmarea_t, vma_plink);
+}
+
+static inline vmarea_t *_vmmap_next(vmmap_t *map, vmarea_t *vma)
+{
+    return vma->vma_plink.l_next == &map->vmm_list
+               ? NULL
+               : list_next(vma, vmarea_t, vma_plink);
+}
+
+/* Recomputes the height and largest gap of the subtree rooted at vma from
+ * those of its children. */
+static void _vmmap_tree_fix(vmarea_t *vma)
+{
+    vma->vma_height =
+        1 + MAX(_vma_height(vma->vma_left), _vma_height(vma->vma_right));
+    vma->vma_max_gap =
+        MAX(vma->vma_gap,
+            MAX(_vma_max_gap(vma->vma_left), _vma_max_gap(vma->vma_right)));
+}
+
+/* Puts new (which may be NULL) in old's place under old's parent. */
+static void _vmmap_tree_replace(vmmap_t *map, vmarea_t *old, vmarea_t *new)
+{
+    vmarea_t *parent = old->vma_parent;
+    if (!parent)
+    {
+        map->vmm_root = new;
+    }
+    else if (parent->vma_left == old)
+    {
+        parent->vma_left = new;
+    }
+    else
+    {
+        parent->vma_right = new;
+    }
+    if (new)
+    {
+        new->vma_parent = parent;
+    }
+}
+
+static vmarea_t *_vmmap_rotate_left(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *right = vma->vma_right;
+    _vmmap_tree_replace(map, vma, right);
+    vma->vma_right = right->vma_left;
+    if (vma->vma_right)
+    {
+        vma->vma_right->vma_parent = vma;
+    }
+    right->vma_left = vma;
+    vma->vma_parent = right;
+    _vmmap_tree_fix(vma);
+    _vmmap_tree_fix(right);
+    return right;
+}
+
+static vmarea_t *_vmmap_rotate_right(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *left = vma->vma_left;
+    _vmmap_tree_replace(map, vma, left);
+    vma->vma_left = left->vma_right;
+    if (vma->vma_left)
+    {
+        vma->vma_left->vma_parent = vma;
+    }
+    left->vma_right = vma;
+    vma->vma_parent = left;
+    _vmmap_tree_fix(vma);
+    _vmmap_tree_fix(left);
+    return left;
+}
+
+/* Refreshes every subtree from vma up to the root, rotating wherever the
+ * heights of two siblings differ by more than one. */
+static void _vmmap_tree_rebalance(vmmap_t *map, vmarea_t *vma)
+{
+    while (vma)
+    {
+        _vmmap_tree_fix(vma);
+        long balance = _vma_height(vma->vma_left) - _vma_height(vma->vma_right);
+        if (balance > 1)
+        {
+            vmarea_t *left = vma->vma_left;
+            if (_vma_height(left->vma_left) < _vma_height(left->vma_right))
+            {
+                _vmmap_rotate_left(map, left);
+            }
+            vma = _vmmap_rotate_right(map, vma);
+        }
+        else if (balance < -1)
+        {
+            vmarea_t *right = vma->vma_right;
+            if (_vma_height(right->vma_right) < _vma_height(right->vma_left))
+            {
+                _vmmap_rotate_right(map, right);
+            }
+            vma = _vmmap_rotate_left(map, vma);
+        }
+        vma = vma->vma_parent;
+    }
+}
+
+/* Recomputes the gap before vma, which is already on the list. */
+static void _vmmap_update_gap(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *prev = _vmmap_prev(map, vma);
+    size_t base = prev ? prev->vma_end : ADDR_TO_PN(USER_MEM_LOW);
+    vma->vma_gap = vma->vma_start > base ? vma->vma_start - base : 0;
+}
+
+static void _vmmap_tree_insert(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *parent = NULL;
+    vmarea_t **link = &map->vmm_root;
+    while (*link)
+    {
+        parent = *link;
+        link = vma->vma_start < parent->vma_start ? &parent->vma_left
+                                                  : &parent->vma_right;
+    }
+    *link = vma;
+    vma->vma_parent = parent;
+    vma->vma_left = vma->vma_right = NULL;
+    _vmmap_update_gap(map, vma);
+    _vmmap_tree_rebalance(map, vma);
+}
+
+static void _vmmap_tree_remove(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *fix;
+    if (vma->vma_left && vma->vma_right)
+    {
+        /* Put the next area in the tree in vma's place. */
+        vmarea_t *next = vma->vma_right;
+        while (next->vma_left)
+        {
+            next = next->vma_left;
+        }
+        fix = next->vma_parent == vma ? next : next->vma_parent;
+        if (next->vma_parent != vma)
+        {
+            _vmmap_tree_replace(map, next, next->vma_right);
+            next->vma_right = vma->vma_right;
+            next->vma_right->vma_parent = next;
+        }
+        _vmmap_tree_replace(map, vma, next);
+        next->vma_left = vma->vma_left;
+        next->vma_left->vma_parent = next;
+    }
+    else
+    {
+        fix = vma->vma_parent;
+        _vmmap_tree_replace(map, vma,
+                            vma->vma_left ? vma->vma_left : vma->vma_right);
+    }
+    vma->vma_parent = vma->vma_left = vma->vma_right = NULL;
+    _vmmap_tree_rebalance(map, fix);
+}
+
+/* Returns the lowest area that ends after vfn, or NULL if there is none. */
+static vmarea_t *_vmmap_first_ending_after(vmmap_t *map, size_t vfn)
+{
+    vmarea_t *found = NULL;
+    vmarea_t *vma = map->vmm_root;
+    while (vma)
+    {
+        if (vma->vma_end > vfn)
+        {
+            found = vma;
+            vma = vma->vma_left;
+        }
+        else
+        {
+            vma = vma->vma_right;
+        }
+    }
+    return found;
+}
+
 /*
  * Allocate and initialize a new vmarea using vmarea_allocator.
  */
@@ -54,7 +256,7 @@ void vmarea_free(vmarea_t *vma)
 {   
     // dbg(DBG_VM, " In vmarea_free, the freeed vmarea is %p",vma);
     if(list_link_is_linked(&vma->vma_plink)){
-        list_remove(&vma->vma_plink); // Remove it from lists
+        vmmap_remove_area(vma->vma_vmmap,vma); // Remove it from lists
     }   
     if(vma->vma_obj){
         mobj_put(&vma->vma_obj); // Put memory object
@@ -76,6 +278,8 @@ vmmap_t *vmmap_create(void)
 
     list_init(&new_vmmap->vmm_list);
     new_vmmap->vmm_proc=NULL;
+    new_vmmap->vmm_root=NULL;
+    new_vmmap->vmm_cache=NULL;
     // NOT_YET_IMPLEMENTED("VM: vmmap_create");
     return new_vmmap;
 }
@@ -98,39 +302,64 @@ void vmmap_destroy(vmmap_t **mapp)
 
 /*
  * Add a vmarea to an address space. Assumes (i.e. asserts to some extent) the
- * vmarea is valid. Iterate through the list of vmareas, and add it 
- * accordingly. 
+ * vmarea is valid. The area goes on the list in front of the first area that
+ * ends after it starts, which the tree finds without walking the list.
  */
 void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
 {
-    // dbg(DBG_VM, " In vmmap_insert \n");
     KASSERT(new_vma->vma_end>=new_vma->vma_start&&"Make sure the start cannot be greater than end");
-    // KASSERT(list_link_is_linked(&new_vma->vma_plink) && "Make sure the link list is valid");
-    //  KASSERT((new_vma->vma_flags&MAP_SHARED)||((new_vma->vma_flags&MAP_PRIVATE)&&
-    // "Make sure either MAP_SHARED and MAP_PRIVATE is set"));
 
-    size_t start_pn=ADDR_TO_PN(USER_MEM_LOW);
-    size_t end_pn=0;
+    vmarea_t *next=_vmmap_first_ending_after(map,new_vma->vma_start);
+    KASSERT((!next||next->vma_start>=new_vma->vma_end)&&"Make sure the new vmarea doesn't overlap another");
+    if(next){
+        list_insert_before(&next->vma_plink,&new_vma->vma_plink);
+    } else{
+        list_insert_tail(&map->vmm_list,&new_vma->vma_plink);
+    }
+    new_vma->vma_vmmap=map; // Update it's corresponding vmmap
+
+    _vmmap_tree_insert(map,new_vma);
+    if(next){
+        // The new area took over the start of the gap in front of next
+        _vmmap_update_gap(map,next);
+        _vmmap_tree_rebalance(map,next);
+    }
+}
 
-    vmarea_t *cur_vmarea;
-    // vmarea_t *pre_vmarea;
-    list_iterate(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
-        // If we found we can insert it into one vmarea
-        end_pn=cur_vmarea->vma_start;
-        // If new vmarea can be inserted in front of this cur_vmarea
-        if(new_vma->vma_start>=start_pn&&new_vma->vma_end<=end_pn){
-            list_insert_before(&cur_vmarea->vma_plink,&new_vma->vma_plink);
-            new_vma->vma_vmmap=map; // Update it's corresponding vmmap
-            return;
-        }
-        start_pn=cur_vmarea->vma_end;
-        //pre_vmarea=cur_vmarea;
+/*
+ * Take a vmarea off its address space's list and tree, without freeing it.
+ */
+void vmmap_remove_area(vmmap_t *map, vmarea_t *vma)
+{
+    KASSERT(vma->vma_vmmap==map&&list_link_is_linked(&vma->vma_plink));
+    vmarea_t *next=_vmmap_next(map,vma);
+    _vmmap_tree_remove(map,vma);
+    list_remove(&vma->vma_plink);
+    if(next){
+        _vmmap_update_gap(map,next);
+        _vmmap_tree_rebalance(map,next);
+    }
+    if(map->vmm_cache==vma){
+        map->vmm_cache=NULL;
     }
+}
 
-    // If we cannot find an appropriate place, we may insert it in the tail
-    list_insert_tail(&map->vmm_list,&new_vma->vma_plink);
-    new_vma->vma_vmmap=map;
-    // NOT_YET_IMPLEMENTED("VM: vmmap_insert");
+/*
+ * Bring the tree up to date after the start or end of vma has moved. The area
+ * must still lie between the same neighbours.
+ */
+void vmmap_update_area(vmmap_t *map, vmarea_t *vma)
+{
+    KASSERT(vma->vma_vmmap==map&&list_link_is_linked(&vma->vma_plink));
+    KASSERT(vma->vma_end>=vma->vma_start);
+    _vmmap_update_gap(map,vma);
+    _vmmap_tree_rebalance(map,vma);
+    vmarea_t *next=_vmmap_next(map,vma);
+    if(next){
+        KASSERT(next->vma_start>=vma->vma_end);
+        _vmmap_update_gap(map,next);
+        _vmmap_tree_rebalance(map,next);
+    }
 }
 
 /*
@@ -148,65 +377,58 @@ void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
  */
 ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir)
 {
-    // dbg(DBG_VM, "vmmap_find_range,the current map is %p, page size is %ld, the Mode is %d \n",map,npages,dir);
-    // KASSERT(dir==VMMAP_DIR_HILO||dir==VMMAP_DIR_LOHI);
-    // Check the begining
-    if(dir==VMMAP_DIR_LOHI){    // From low to high        
-        size_t start_pn=ADDR_TO_PN(USER_MEM_LOW);
-        size_t end_pn=0;
-        if(list_empty(&map->vmm_list)&&start_pn+npages<=ADDR_TO_PN(USER_MEM_HIGH)){
-            return start_pn;
-        }
-        
-        list_iterate(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
-            end_pn=cur_vmarea->vma_start;
-            if(end_pn-start_pn>=npages){
-                return start_pn;
-            }
-            start_pn=cur_vmarea->vma_end;
-        }
+    // The gap above the last area isn't in the tree
+    size_t top_pn=list_empty(&map->vmm_list)?ADDR_TO_PN(USER_MEM_LOW):
+        (list_tail(&map->vmm_list,vmarea_t,vma_plink))->vma_end;
+    size_t top_gap=ADDR_TO_PN(USER_MEM_HIGH)-top_pn;
 
-        // If we cannot find a range in the map list, check the last address space
-        end_pn=ADDR_TO_PN(USER_MEM_HIGH);
-        if(end_pn-start_pn>=npages){
-            return start_pn;
-        }
-    }  else{    // From high to low
-        size_t start_pn=ADDR_TO_PN(USER_MEM_HIGH);
-        size_t end_pn=0;
-        if(list_empty(&map->vmm_list)&&start_pn>=ADDR_TO_PN(USER_MEM_LOW)+npages){
-            return (start_pn-npages);   // As high as possible
-        }
-        
-        list_iterate_reverse(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
-            end_pn=cur_vmarea->vma_end;
-            if(start_pn-end_pn>=npages){
-                return start_pn-npages;
+    if(dir==VMMAP_DIR_HILO&&top_gap>=npages){
+        return ADDR_TO_PN(USER_MEM_HIGH)-npages;   // As high as possible
+    }
+
+    // Otherwise, look for the lowest (or highest) area with a big enough gap
+    // in front of it, skipping subtrees whose largest gap is too small
+    vmarea_t *vma=map->vmm_root;
+    if(vma!=NULL&&vma->vma_max_gap>=npages){
+        while(1){
+            vmarea_t *first=dir==VMMAP_DIR_HILO?vma->vma_right:vma->vma_left;
+            vmarea_t *second=dir==VMMAP_DIR_HILO?vma->vma_left:vma->vma_right;
+            if(_vma_max_gap(first)>=npages){
+                vma=first;
+            } else if(vma->vma_gap>=npages){
+                return dir==VMMAP_DIR_HILO?vma->vma_start-npages:vma->vma_start-vma->vma_gap;
+            } else{
+                KASSERT(_vma_max_gap(second)>=npages);
+                vma=second;
             }
-            start_pn=cur_vmarea->vma_start;
         }
+    }
 
-        // If we still cannot find one available page
-        // Check the first vmarea
-        end_pn=ADDR_TO_PN(USER_MEM_LOW);
-        if(start_pn-end_pn>=npages){
-            return (start_pn-npages);
-        }
+    if(dir==VMMAP_DIR_LOHI&&top_gap>=npages){
+        return top_pn;
     }
     // NOT_YET_IMPLEMENTED("VM: vmmap_find_range");
     return -1;
 }
 
 /*
- * Return the vm_area that vfn (a page number) lies in. Scan the address space looking
- * for a vma whose range covers vfn. If the page is unmapped, return NULL.
+ * Return the vm_area that vfn (a page number) lies in. Check the area found
+ * last time first, then search the tree. If the page is unmapped, return NULL.
  */
 vmarea_t *vmmap_lookup(vmmap_t *map, size_t vfn)
 {
-    // dbg(DBG_VM,"vmmap_lookup, the current map is %p, page number is %ld \n",map,vfn);
-    vmarea_t *cur_vmarea;
-    list_iterate(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
-        if(cur_vmarea->vma_start<=vfn&&cur_vmarea->vma_end>vfn){
+    vmarea_t *cur_vmarea=map->vmm_cache;
+    if(cur_vmarea!=NULL&&cur_vmarea->vma_start<=vfn&&cur_vmarea->vma_end>vfn){
+        return cur_vmarea;
+    }
+    cur_vmarea=map->vmm_root;
+    while(cur_vmarea!=NULL){
+        if(vfn<cur_vmarea->vma_start){
+            cur_vmarea=cur_vmarea->vma_left;
+        } else if(vfn>=cur_vmarea->vma_end){
+            cur_vmarea=cur_vmarea->vma_right;
+        } else{
+            map->vmm_cache=cur_vmarea;
             return cur_vmarea;
         }
     }
@@ -408,6 +630,74 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
     return 0;
 }
 
+/* Frames whose page table entries have been removed, but may still be cached
+ * in some TLB */
+#define VMMAP_UNMAP_PFRAMES 32
+
+typedef struct vmmap_unmap
+{
+    tlb_batch_t vu_tb;
+    size_t vu_npframes;
+    pframe_t *vu_pframes[VMMAP_UNMAP_PFRAMES];
+} vmmap_unmap_t;
+
+/*
+ * Shoot down the entries removed so far, and only then drop them from the
+ * counts of mappings of the frames they mapped: until then, another core could
+ * still reach a frame that had become free to evict.
+ */
+static void _vmmap_unmap_flush(vmmap_unmap_t *vu)
+{
+    tlb_batch_flush(&vu->vu_tb);
+    for(size_t i=0;i<vu->vu_npframes;i++){
+        pframe_unmapped(vu->vu_pframes[i]);
+    }
+    vu->vu_npframes=0;
+}
+
+/*
+ * Unmap npages pages from lopage, which map the pages of o from pagenum on, from
+ * map's page table. The frame that each present entry maps is looked up before
+ * the entry is removed, as there is no other way to find it afterwards. When
+ * vu has no room for more frames, the part of the range walked so far is
+ * unmapped and shot down early.
+ */
+static void _vmmap_unmap(vmmap_t *map, vmmap_unmap_t *vu, mobj_t *o, size_t pagenum, size_t lopage, size_t npages)
+{
+    if(!map->vmm_proc){
+        return;
+    }
+    pml4_t *pml4=map->vmm_proc->p_pml4;
+    size_t start=lopage;
+    size_t end=lopage+npages;
+    if(o){
+        mobj_lock(o);
+        for(size_t pn=lopage;pn<end;pn++){
+            uintptr_t paddr=pt_lookup(pml4,(uintptr_t)PN_TO_ADDR(pn));
+            if(!paddr){
+                continue;
+            }
+            if(vu->vu_npframes==VMMAP_UNMAP_PFRAMES){
+                mobj_unlock(o);
+                if(pn>start){
+                    pt_unmap_range(pml4,(uintptr_t)PN_TO_ADDR(start),(uintptr_t)PN_TO_ADDR(pn));
+                    tlb_batch_add(&vu->vu_tb,(uintptr_t)PN_TO_ADDR(start),pn-start);
+                    start=pn;
+                }
+                _vmmap_unmap_flush(vu);
+                mobj_lock(o);
+            }
+            pframe_t *pf=shadow_find_mapped_pframe(o,pagenum+pn-lopage,paddr);
+            if(pf){
+                vu->vu_pframes[vu->vu_npframes++]=pf;
+            }
+        }
+        mobj_unlock(o);
+    }
+    pt_unmap_range(pml4,(uintptr_t)PN_TO_ADDR(start),(uintptr_t)PN_TO_ADDR(end));
+    tlb_batch_add(&vu->vu_tb,(uintptr_t)PN_TO_ADDR(start),end-start);
+}
+
 /*
  * Iterate over the mapping's vmm_list and make sure that the specified range
  * is completely empty. You will have to handle the following cases:
@@ -438,6 +728,12 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
  * Hints:
  *  - Whenever you shorten/remove any mappings, be sure to call pt_unmap_range()
  *    tlb_flush_range() to clean your pagetables and TLB.
+ *
+ * The TLB invalidations for the whole range are gathered in a tlb_batch_t and
+ * shot down at once at the end, before the objects of the removed vmareas are
+ * put, so that no core can still reach their pages through a stale entry. The
+ * mappings of the frames that were mapped are only uncounted then, too (see
+ * _vmmap_unmap()).
  */
 long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
 {
@@ -446,16 +742,25 @@ long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
         return 0;   // We don't need to remove
     }
 
-    vmarea_t *cur_vmarea;
-    int case_type=0;    // Consider the listed case type
     size_t end_page=lopage+npages;
+    long ret=0;
+    vmmap_unmap_t vu;
+    list_t dead;    // Vmareas removed in case 4, freed after the shootdown
+    tlb_batch_init(&vu.vu_tb,map->vmm_proc?map->vmm_proc->p_pml4:NULL);
+    vu.vu_npframes=0;
+    list_init(&dead);
     
     // TODO: Do need to clean TLB and pagetables when there are no mappings
-    list_iterate(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
+    // Only visit the areas that overlap the range, starting from the first one
+    // the tree finds
+    vmarea_t *cur_vmarea=_vmmap_first_ending_after(map,lopage);
+    while(cur_vmarea!=NULL&&cur_vmarea->vma_start<end_page){
+        vmarea_t *next_vmarea=_vmmap_next(map,cur_vmarea);
         if(cur_vmarea->vma_start<lopage&&cur_vmarea->vma_end>end_page){   // Case 1
             vmarea_t *new_vmarea=vmarea_alloc();
             if(new_vmarea==NULL){
-                return -ENOMEM;
+                ret=-ENOMEM;
+                break;
             }
             // Update the start, end and off, and initalize it
             new_vmarea->vma_start=end_page;
@@ -468,48 +773,40 @@ long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
                 mobj_ref(cur_vmarea->vma_obj);  // Increase the refcount of this mobj
             }
 
+            _vmmap_unmap(map,&vu,cur_vmarea->vma_obj,cur_vmarea->vma_off+lopage-cur_vmarea->vma_start,lopage,npages);
             cur_vmarea->vma_end=lopage; // Set the new end of current vmarea, so that we can split the previous vmarea
-            if(map->vmm_proc){
-                pt_unmap_range(map->vmm_proc->p_pml4,(uintptr_t)PN_TO_ADDR(lopage),(uintptr_t)PN_TO_ADDR(lopage+npages));
-            }
-            tlb_flush_range((uintptr_t)PN_TO_ADDR(lopage),npages);
+            vmmap_update_area(map,cur_vmarea);
 
             vmmap_insert(map,new_vmarea);  // Insert it into the map list 
         } else if(cur_vmarea->vma_end>lopage&&cur_vmarea->vma_end<=end_page&&cur_vmarea->vma_start<lopage){  // Case 2
-            uintptr_t vmax=(uintptr_t)PN_TO_ADDR(cur_vmarea->vma_end);
             size_t range=cur_vmarea->vma_end-lopage;
+            _vmmap_unmap(map,&vu,cur_vmarea->vma_obj,cur_vmarea->vma_off+lopage-cur_vmarea->vma_start,lopage,range);
             cur_vmarea->vma_end=lopage; // Cut the size of vmarea
-
-            if(map->vmm_proc){
-                pt_unmap_range(map->vmm_proc->p_pml4,(uintptr_t)PN_TO_ADDR(lopage),vmax);
-            }
-            tlb_flush_range((uintptr_t)PN_TO_ADDR(lopage),range);
+            vmmap_update_area(map,cur_vmarea);
         } else if(cur_vmarea->vma_end>end_page&&cur_vmarea->vma_start>=lopage&&cur_vmarea->vma_start<end_page) { // Case 3
-            uintptr_t vmax=(uintptr_t)PN_TO_ADDR(lopage+npages);
             size_t range=lopage+npages-cur_vmarea->vma_start;
+            _vmmap_unmap(map,&vu,cur_vmarea->vma_obj,cur_vmarea->vma_off,cur_vmarea->vma_start,range);
 
-            size_t old_start=cur_vmarea->vma_start;
             cur_vmarea->vma_off=cur_vmarea->vma_off+end_page-cur_vmarea->vma_start;
             cur_vmarea->vma_start=end_page;
-
-            if(map->vmm_proc){
-                pt_unmap_range(map->vmm_proc->p_pml4,(uintptr_t)PN_TO_ADDR(old_start),vmax);
-            }
-            tlb_flush_range((uintptr_t)PN_TO_ADDR(old_start),range);
+            vmmap_update_area(map,cur_vmarea);
         } else if(cur_vmarea->vma_start>=lopage&&cur_vmarea->vma_end<=end_page){    // Case 4
-            uintptr_t vmax=(uintptr_t)PN_TO_ADDR(cur_vmarea->vma_end);
             size_t range=cur_vmarea->vma_end-cur_vmarea->vma_start;
-
-            if(map->vmm_proc){
-                pt_unmap_range(map->vmm_proc->p_pml4,(uintptr_t)PN_TO_ADDR(cur_vmarea->vma_start),vmax);
-            }
-            vmarea_free(cur_vmarea);
-            tlb_flush_range((uintptr_t)PN_TO_ADDR(cur_vmarea->vma_start),range);
+            _vmmap_unmap(map,&vu,cur_vmarea->vma_obj,cur_vmarea->vma_off,cur_vmarea->vma_start,range);
+            vmmap_remove_area(map,cur_vmarea);
+            list_insert_tail(&dead,&cur_vmarea->vma_plink);
         }
+        cur_vmarea=next_vmarea;
+    }
+
+    _vmmap_unmap_flush(&vu);
+    list_iterate(&dead,vma,vmarea_t,vma_plink){
+        list_remove(&vma->vma_plink);
+        vmarea_free(vma);
     }
 
     // NOT_YET_IMPLEMENTED("VM: vmmap_remove");
-    return 0;
+    return ret;
 }
 
 /*
@@ -522,20 +819,11 @@ long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages)
     if(npages==0){  // If there are no address space
         return 1;
     }
-    vmarea_t *cur_vmarea;
     size_t endvfn=startvfn+npages; // Not inclusive
-    list_iterate(&map->vmm_list,cur_vmarea,vmarea_t,vma_plink){
-        if((startvfn<cur_vmarea->vma_start&&endvfn>cur_vmarea->vma_end)||
-        (startvfn>=cur_vmarea->vma_start&&startvfn<cur_vmarea->vma_end)||
-        (endvfn>cur_vmarea->vma_start&&endvfn<=cur_vmarea->vma_end)
-        ){
-        // There are 3 cases that the given address space is not empty
-        // Start is inside of vmarea, end is inside of vmarea and vmarea is contained between start and end
-            return 0;   
-        }
-    }
+    // Only the first area ending after the range starts can overlap it first
+    vmarea_t *cur_vmarea=_vmmap_first_ending_after(map,startvfn);
     // NOT_YET_IMPLEMENTED("VM: vmmap_is_range_empty");
-    return 1;
+    return cur_vmarea==NULL||cur_vmarea->vma_start>=endvfn;
 }
 
 /*
@@ -1494,11 +1494,15 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
         return 0;
     }
 
-    if (!(pid = fork()))
+    /* The child only redirects and execs, so there is no point copying the
+     * address space for it. Until it has exec'd, its memory is ours: it must
+     * leave with _Exit(), not run our atexit handlers or flush our stdio. */
+    if (!(pid = vfork()))
     {
         if (do_redirect(map) < 0)
         {
-            exit(1);
+            fflush(stderr);
+            _Exit(1);
         }
 
         execve(argv[0], argv, my_envp);
@@ -1522,7 +1526,9 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
             fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
                     strerror(errno));
         }
-        exit(errno);
+        int err = errno;
+        fflush(stderr);
+        _Exit(err);
     }
     else
     {
@@ -17,6 +17,9 @@ struct dirent;
 
 /* User exec-related */
 int fork(void);
+/* The child shares the caller's memory and may only call execve() or _Exit();
+ * the caller is suspended until it has done either. */
+__attribute__((returns_twice)) pid_t vfork(void);
 
 int execl(const char *filename, const char *arg, ...);  /* NYI */
 int execle(const char *filename, const char *arg, ...); /* NYI */
@@ -71,6 +71,14 @@ int brk(void *addr)
 
 pid_t fork(void) { return (pid_t)trap(SYS_fork, 0); }
 
+/* The rest of vfork() (see vfork.S), run by the parent once it has its stack
+ * back: picks up errno, which the child may have changed in the meantime. */
+__attribute__((visibility("hidden"))) pid_t __vfork_return(ssize_t ret)
+{
+    errno = (int)trap(SYS_errno, 0);
+    return (pid_t)ret;
+}
+
 int atexit(void (*func)(void))
 {
     if (atexit_handlers < MAX_EXIT_HANDLERS)